@@ -0,0 +1,60 @@
+
+/*
+ * Reconnect scheduling: capped exponential backoff with full jitter.
+ *
+ * After the N-th failure in a row, the next attempt is delayed by a random
+ * time in [0, min(cap, base * 2^N)], so devices that lost the connection
+ * together (cloud or router outage) do not all come back at the same moment.
+ */
+
+#if defined(UNIT_TEST)
+uint32_t backoffRandom();               // seeded by the test
+#else
+static inline
+uint32_t backoffRandom() {
+  return esp_random();
+}
+#endif
+
+class Backoff {
+public:
+  Backoff(uint32_t base, uint32_t cap)
+    : _base(base), _cap(cap), _attempt(0), _until(0), _pending(false)
+  {}
+
+  // Connected, the next failure starts from base again
+  void reset() {
+    _attempt = 0;
+    _pending = false;
+  }
+
+  // Schedules the next attempt, returns its delay in ms
+  uint32_t fail() {
+    const uint64_t limit = BlynkMin((uint64_t)_cap, (uint64_t)_base << BlynkMin(_attempt, (uint8_t)31));
+    const uint32_t wait = backoffRandom() % (uint32_t)(limit + 1);
+    if (_attempt < 255) {
+      _attempt++;
+    }
+    _until = millis() + wait;
+    _pending = (wait > 0);
+    return wait;
+  }
+
+  // True until the scheduled attempt is due
+  bool waiting() {
+    if (_pending && (int32_t)(millis() - _until) < 0) {
+      return true;
+    }
+    _pending = false;
+    return false;
+  }
+
+  uint8_t attempts() const { return _attempt; }
+
+private:
+  uint32_t _base;
+  uint32_t _cap;
+  uint8_t  _attempt;
+  uint32_t _until;
+  bool     _pending;
+};
@@ -25,20 +25,34 @@ extern "C" {
 BlynkTimer edgentTimer;
 
 #include "SysUtils.h"
+#include "FileIndex.h"
+#include "FileTransfer.h"
 #include "BlynkState.h"
+#include "StateTrace.h"
+#include "Watchdog.h"
+#include "Profiler.h"
+#include "OfflineBuffer.h"
+#include "WriteCoalesce.h"
 #include "ConfigStore.h"
 #include "ResetButton.h"
+#include "DeepSleep.h"
 #include "ConfigMode.h"
 #include "Indicator.h"
 #include "OTA.h"
+#include "BlynkTask.h"
+#include "RemoteConsole.h"
 #include "Console.h"
 
 
 inline
-void BlynkState::set(State m) {
+void BlynkState::set(State m, StateReason reason) {
   if (state != m && m < MODE_MAX_VALUE) {
-    DEBUG_PRINT(String(StateStr[state]) + " => " + StateStr[m]);
+    if (!state_trace_transition(state, m, reason)) {
+      return;
+    }
     state = m;
+    stateStartedAt = 0;
+    portal_events_push(m);
 
     // You can put your state handling here,
     // i.e. implement custom indication
@@ -67,18 +81,59 @@ void printDeviceBanner()
 }
 
 void runBlynkWithChecks() {
-  Blynk.run();
+  {
+    WatchdogScope scope(WDT_PHASE_BLYNK);
+    ProfileScope  profile(PROF_BLYNK);
+    Blynk.run();
+  }
   if (BlynkState::get() == MODE_RUNNING) {
     if (!Blynk.connected()) {
+      // Even the first reconnect is delayed by a random time,
+      // so a cloud outage does not end with every device at once
       if (WiFi.status() == WL_CONNECTED) {
-        BlynkState::set(MODE_CONNECTING_CLOUD);
+        DEBUG_PRINT(String("Reconnecting to cloud in ") + cloudBackoff.fail() + " ms");
+        BlynkState::set(MODE_CONNECTING_CLOUD, REASON_CLOUD_LOST);
       } else {
-        BlynkState::set(MODE_CONNECTING_NET);
+        DEBUG_PRINT(String("Reconnecting to WiFi in ") + netBackoff.fail() + " ms");
+        BlynkState::set(MODE_CONNECTING_NET, REASON_NET_LOST);
       }
+    } else {
+      write_coalesce_flush();
+      remote_console_run();
     }
   }
 }
 
+void cloudConnected() {
+  state_trace_report();
+  watchdog_report();
+}
+
+struct StateHooks {
+  void (*enter)();    // on the first step() in the state
+  void (*run)();      // on every step() in the state
+  void (*exit)();     // on the first step() in another state
+};
+
+// Indexed by State
+constexpr StateHooks stateHooks[MODE_MAX_VALUE] = {
+  /* WAIT_CONFIG      */ { NULL,               enterConfigMode,    exitConfigMode },
+  /* CONFIGURING      */ { NULL,               enterConfigMode,    exitConfigMode },
+  /* CONNECTING_NET   */ { NULL,               enterConnectNet,    NULL },
+  /* CONNECTING_CLOUD */ { NULL,               enterConnectCloud,  NULL },
+  /* RUNNING          */ { cloudConnected,     runBlynkWithChecks, NULL },
+  /* OTA_UPGRADE      */ { NULL,               enterOTA,           NULL },
+  /* SWITCH_TO_STA    */ { NULL,               enterSwitchToSTA,   NULL },
+  /* RESET_CONFIG     */ { NULL,               enterResetConfig,   NULL },
+  /* ERROR            */ { NULL,               enterError,         NULL },
+};
+
+constexpr bool state_hooks_complete(unsigned m = 0) {
+  return m >= MODE_MAX_VALUE || (stateHooks[m].run != NULL && state_hooks_complete(m + 1));
+}
+
+static_assert(state_hooks_complete(), "Every state needs a run hook");
+
 class Edgent {
 
 public:
@@ -91,10 +146,17 @@ public:
 #endif
 
     systemInit();
+    file_index_init();
+    state_trace_init();
+    watchdog_init();
+    offline_buffer_init();
 
     indicator_init();
     button_init();
-    config_init();
+    if (!deep_sleep_resume_config()) {
+      config_init();
+    }
+    cloud_client_init();
     printDeviceBanner();
     console_init();
 
@@ -113,27 +175,105 @@ public:
       DEBUG_PRINT("Invalid configuration of TEMPLATE_ID / TEMPLATE_NAME");
       while (true) { delay(100); }
     }
+
+#if defined(BLYNK_TASK_ENABLE)
+    blynk_task_start([](void* self) { ((Edgent*)self)->step(); }, this);
+#endif
+  }
+
+#if defined(BLYNK_TASK_ENABLE)
+  // The connection runs in its own task, this only calls the
+  // BLYNK_WRITE handlers of what it received
+  void run() {
+    profiler_run_begin();
+    blynk_task_dispatch();
+    profiler_run_end();
   }
 
+  // Queued for the task, which sends it with the next batch (see WriteCoalesce.h)
+  template <typename... Args>
+  bool virtualWrite(int pin, Args... values) {
+    return blynk_task_write(pin, values...);
+  }
+#else
   void run() {
-    app_loop();
-    switch (BlynkState::get()) {
-    case MODE_WAIT_CONFIG:       
-    case MODE_CONFIGURING:       enterConfigMode();    break;
-    case MODE_CONNECTING_NET:    enterConnectNet();    break;
-    case MODE_CONNECTING_CLOUD:  enterConnectCloud();  break;
-    case MODE_RUNNING:           runBlynkWithChecks(); break;
-    case MODE_OTA_UPGRADE:       enterOTA();           break;
-    case MODE_SWITCH_TO_STA:     enterSwitchToSTA();   break;
-    case MODE_RESET_CONFIG:      enterResetConfig();   break;
-    default:                     enterError();         break;
+    profiler_run_begin();
+    step();
+    profiler_run_end();
+  }
+
+  // Keeps the latest value, sent with the next batch (see WriteCoalesce.h)
+  template <typename... Args>
+  void virtualWrite(int pin, Args... values) {
+    write_coalesce_add(pin, values...);
+  }
+#endif
+
+  // With BLYNK_TASK_ENABLE, only call it before begin()
+  void writePolicy(int pin, uint32_t minInterval, float deadband = 0) {
+    write_coalesce_set_policy(pin, minInterval, deadband);
+  }
+
+  // Each call does a bounded amount of work and returns,
+  // only the configuration portal keeps control until it is done.
+  // Called by run(), or by the Blynk task with BLYNK_TASK_ENABLE
+  void step() {
+    ProfileScope profile(PROF_STEP);
+    watchdog_feed();
+    {
+      WatchdogScope scope(WDT_PHASE_APP);
+      app_loop();
+    }
+    const State m = BlynkState::get();
+    if (m != current) {
+      // Not in BlynkState::set(), which may be called from an ISR
+      if (current < MODE_MAX_VALUE && stateHooks[current].exit) {
+        stateHooks[current].exit();
+      }
+      current = m;
+      if (m < MODE_MAX_VALUE && stateHooks[m].enter) {
+        stateHooks[m].enter();
+      }
+    }
+    if (m < MODE_MAX_VALUE) {
+      WatchdogScope scope(m);
+      stateHooks[m].run();
+    } else {
+      BlynkState::set(MODE_ERROR); // begin() did not pick a state
     }
+    if (m != MODE_RUNNING && offline_buffer_ready()) {
+      write_coalesce_flush(); // Not connected, due pins are stored
+    }
+    offline_buffer_run();
+    deep_sleep_run();
+  }
+
+#if defined(DEEP_SLEEP_ENABLE)
+  // Go to sleep as soon as connected, i.e. once the readings are sent
+  void sleep() {
+    deep_sleep_request();
   }
+#endif
+
+private:
+  State current = MODE_MAX_VALUE;   // as last seen by step()
 
 } BlynkEdgent;
 
 void app_loop() {
+  {
+    ProfileScope profile(PROF_TIMER);
     edgentTimer.run();
+  }
+  {
+    ProfileScope profile(PROF_CONSOLE);
     edgentConsole.run();
+    file_transfer_run(edgentConsole.getStream());
+  }
 }
 
+#if defined(BLYNK_TASK_ENABLE)
+  // From here on, BLYNK_WRITE() handlers run on the app core
+  #undef  BLYNK_WRITE
+  #define BLYNK_WRITE(pin)  BLYNK_TASK_WRITE(pin)
+#endif
@@ -13,7 +13,7 @@ enum State {
   MODE_MAX_VALUE
 };
 
-#if defined(APP_DEBUG)
+// Also used by the portal event stream
 const char* StateStr[MODE_MAX_VALUE+1] = {
   "WAIT_CONFIG",
   "CONFIGURING",
@@ -27,7 +27,79 @@ const char* StateStr[MODE_MAX_VALUE+1] = {
 
   "INIT"
 };
-#endif
+
+// Why a transition happened, kept in the state trace
+enum StateReason {
+  REASON_NONE,
+  REASON_BUTTON,            // reset button held
+  REASON_CONFIG,            // new configuration received
+  REASON_NET_LOST,
+  REASON_CLOUD_LOST,
+  REASON_NET_FAILED,        // out of connection retries
+  REASON_CLOUD_FAILED,
+  REASON_TOKEN,             // token rejected by the cloud
+  REASON_OTA,
+
+  REASON_MAX_VALUE
+};
+
+const char* StateReasonStr[REASON_MAX_VALUE+1] = {
+  "none",
+  "button",
+  "config",
+  "net lost",
+  "cloud lost",
+  "net failed",
+  "cloud failed",
+  "token",
+  "ota",
+
+  "?"
+};
+
+#define STATE_BIT(m)    (1U << (m))
+
+// The console and the portal may restart provisioning from any state
+#define STATE_ANY       (STATE_BIT(MODE_WAIT_CONFIG) | STATE_BIT(MODE_SWITCH_TO_STA) | STATE_BIT(MODE_RESET_CONFIG))
+
+// States each state may go to. BlynkState::set() rejects anything else
+constexpr uint16_t StateTransitions[MODE_MAX_VALUE+1] = {
+  /* WAIT_CONFIG      */ STATE_ANY | STATE_BIT(MODE_CONFIGURING) | STATE_BIT(MODE_CONNECTING_NET) | STATE_BIT(MODE_ERROR),
+  /* CONFIGURING      */ STATE_ANY | STATE_BIT(MODE_CONNECTING_NET) | STATE_BIT(MODE_ERROR),
+  /* CONNECTING_NET   */ STATE_ANY | STATE_BIT(MODE_CONNECTING_CLOUD) | STATE_BIT(MODE_ERROR),
+  /* CONNECTING_CLOUD */ STATE_ANY | STATE_BIT(MODE_CONNECTING_NET) | STATE_BIT(MODE_RUNNING) | STATE_BIT(MODE_OTA_UPGRADE) | STATE_BIT(MODE_ERROR),
+  /* RUNNING          */ STATE_ANY | STATE_BIT(MODE_CONNECTING_NET) | STATE_BIT(MODE_CONNECTING_CLOUD) | STATE_BIT(MODE_OTA_UPGRADE),
+  /* OTA_UPGRADE      */ STATE_ANY | STATE_BIT(MODE_ERROR),
+  /* SWITCH_TO_STA    */ STATE_ANY | STATE_BIT(MODE_CONNECTING_NET),
+  /* RESET_CONFIG     */ STATE_ANY,
+  /* ERROR            */ STATE_ANY,
+  /* INIT             */ STATE_BIT(MODE_WAIT_CONFIG) | STATE_BIT(MODE_CONNECTING_NET) | STATE_BIT(MODE_ERROR)
+};
+
+constexpr bool state_transition_allowed(unsigned from, unsigned to) {
+  return from <= MODE_MAX_VALUE && to < MODE_MAX_VALUE && (StateTransitions[from] & STATE_BIT(to));
+}
+
+// All states the given ones lead to in one step
+constexpr uint16_t state_targets(uint16_t from, unsigned m = 0) {
+  return (m > MODE_MAX_VALUE) ? 0 :
+         (((from & STATE_BIT(m)) ? StateTransitions[m] : 0) | state_targets(from, m + 1));
+}
+
+constexpr uint16_t state_reachable(uint16_t from) {
+  return ((from | state_targets(from)) == from) ? from : state_reachable(from | state_targets(from));
+}
+
+static_assert(state_reachable(STATE_BIT(MODE_MAX_VALUE)) == (STATE_BIT(MODE_MAX_VALUE + 1) - 1),
+              "Every state must be reachable from INIT");
+static_assert(state_reachable(STATE_BIT(MODE_WAIT_CONFIG)) & STATE_BIT(MODE_RUNNING),
+              "Provisioning must lead to RUNNING");
+static_assert(state_reachable(StateTransitions[MODE_RUNNING]) & STATE_BIT(MODE_RUNNING),
+              "A lost connection must lead back to RUNNING");
+static_assert(state_reachable(StateTransitions[MODE_ERROR]) & STATE_BIT(MODE_RUNNING),
+              "ERROR must not be a dead end");
+static_assert(!state_transition_allowed(MODE_WAIT_CONFIG, MODE_RUNNING),
+              "RUNNING needs a cloud connection first");
 
 namespace BlynkState
 {
@@ -35,6 +107,6 @@ namespace BlynkState
 
   State get()        { return state; }
   bool  is (State m) { return (state == m); }
-  void  set(State m);
+  void  set(State m, StateReason reason = REASON_NONE);
 };
 
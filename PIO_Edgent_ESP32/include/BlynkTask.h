@@ -0,0 +1,247 @@
+
+/*
+ * Blynk connection in its own task (dual-core ESP32 only).
+ *
+ * With BLYNK_TASK_ENABLE, the Edgent state machine, Blynk.run(), the
+ * Edgent timer and the console run in a task pinned to BLYNK_TASK_CORE.
+ * loop() stays on the Arduino core, so a slow sensor read no longer delays
+ * heartbeats. The two sides only meet in two single-producer/single-consumer
+ * queues:
+ *
+ *   BLYNK_WRITE(Vx) handlers declared after BlynkEdgent.h run on the app core,
+ *   from BlynkEdgent.run(). Call it often.
+ *
+ *   BlynkEdgent.virtualWrite() queues a write, the task sends it
+ *   (coalesced, see WriteCoalesce.h). It returns false, and the write is
+ *   dropped, if the queue is full or the write is longer than
+ *   BLYNK_TASK_MSG_SIZE.
+ *   Do not call Blynk.* directly from loop() or the handlers.
+ *
+ * BLYNK_CONNECTED() and the other Blynk callbacks still run in the task.
+ * BLYNK_WRITE_DEFAULT() is used for the hand-over and is not available.
+ *
+ * "sys task" shows queue latencies, "sys task ping" measures a round-trip
+ * from the task through the app core and back.
+ */
+
+#if defined(BLYNK_TASK_ENABLE)
+
+#if CONFIG_FREERTOS_UNICORE
+  #error "BLYNK_TASK_ENABLE needs a dual-core ESP32"
+#endif
+
+#include <atomic>
+
+#define BLYNK_TASK_QUEUE      16        // messages each way
+#define BLYNK_TASK_MSG_SIZE   64        // encoded values of one write
+#define BLYNK_TASK_STACK      8192      // TLS handshakes need most of it
+#define BLYNK_TASK_PING       0xFFFF    // pseudo pin of the loopback message
+
+template <typename T, uint32_t N>
+class SpscQueue {
+public:
+  // Producer side: fill the returned slot, then commit()
+  T* reserve() {
+    const uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == N) {
+      return NULL;
+    }
+    return &items[h % N];
+  }
+
+  void commit() {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  // Consumer side: use the returned slot, then pop()
+  T* peek() {
+    const uint32_t t = tail.load(std::memory_order_relaxed);
+    if (head.load(std::memory_order_acquire) == t) {
+      return NULL;
+    }
+    return &items[t % N];
+  }
+
+  void pop() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+private:
+  std::atomic<uint32_t> head { 0 };
+  std::atomic<uint32_t> tail { 0 };
+  T items[N];
+};
+
+struct BlynkTaskMsg {
+  uint32_t queued;                      // micros()
+  uint16_t pin;
+  uint16_t len;
+  char     data[BLYNK_TASK_MSG_SIZE];
+};
+
+struct BlynkTaskLatency {
+  uint32_t count;
+  uint32_t total;                       // us
+  uint32_t max;                         // us
+
+  void add(uint32_t us) {
+    count++;
+    total += us;
+    if (us > max) {
+      max = us;
+    }
+  }
+};
+
+static SpscQueue<BlynkTaskMsg, BLYNK_TASK_QUEUE> blynkTaskOut;   // app -> task
+static SpscQueue<BlynkTaskMsg, BLYNK_TASK_QUEUE> blynkTaskIn;    // task -> app
+
+static struct {
+  BlynkTaskLatency out;                 // queued by the app until sent
+  BlynkTaskLatency in;                  // received until handled
+  BlynkTaskLatency ping;                // task -> app -> task
+  uint32_t         outDropped;          // written by the app
+  uint32_t         inDropped;           // written by the task
+} blynkTaskStats;
+
+static TaskHandle_t       blynkTask = NULL;
+static WidgetWriteHandler blynkTaskHandlers[256];
+
+// Registers a handler declared with BLYNK_WRITE()
+struct BlynkTaskHandler {
+  BlynkTaskHandler(uint8_t pin, WidgetWriteHandler handler) {
+    blynkTaskHandlers[pin] = handler;
+  }
+};
+
+// Runs in the task: hands the write over to the app core
+BLYNK_WRITE_DEFAULT()
+{
+  BlynkTaskMsg* msg = blynkTaskIn.reserve();
+  if (!msg || param.getLength() > sizeof(msg->data)) {
+    blynkTaskStats.inDropped++;
+    return;
+  }
+  msg->queued = micros();
+  msg->pin    = request.pin;
+  msg->len    = param.getLength();
+  memcpy(msg->data, param.getBuffer(), msg->len);
+  blynkTaskIn.commit();
+}
+
+// BLYNK_WRITE() of the app, see the end of BlynkEdgent.h.
+// Handlers of Edgent itself (OTA, console) stay in the task
+#define BLYNK_TASK_WRITE(pin)     BLYNK_TASK_WRITE_2(pin)
+#define BLYNK_TASK_WRITE_2(pin) \
+  static void BlynkTaskWrite ## pin (BlynkReq BLYNK_UNUSED &request, const BlynkParam BLYNK_UNUSED &param); \
+  static const BlynkTaskHandler blynkTaskHandler ## pin (pin, BlynkTaskWrite ## pin); \
+  static void BlynkTaskWrite ## pin (BlynkReq BLYNK_UNUSED &request, const BlynkParam BLYNK_UNUSED &param)
+
+template <typename... Args>
+bool blynk_task_write(int pin, Args... values)
+{
+  BlynkTaskMsg* msg = blynkTaskOut.reserve();
+  if (!msg) {
+    blynkTaskStats.outDropped++;
+    return false;
+  }
+  BlynkParam cmd(msg->data, 0, sizeof(msg->data));
+  cmd.add("vw");
+  cmd.add(pin);
+  cmd.add_multi(values...);
+  if (!write_coalesce_encoded(msg->data, cmd.getLength(), sizeof(msg->data), 2 + sizeof...(values))) {
+    blynkTaskStats.outDropped++;        // Too long for a message, not committed
+    return false;
+  }
+  msg->queued = micros();
+  msg->pin    = pin;
+  msg->len    = cmd.getLength() - 1;
+  blynkTaskOut.commit();
+  return true;
+}
+
+// Task side: hands the queued writes to the coalescing layer
+static
+void blynk_task_send()
+{
+  while (BlynkTaskMsg* msg = blynkTaskOut.peek()) {
+    const uint32_t now = micros();
+    if (msg->pin == BLYNK_TASK_PING) {
+      blynkTaskStats.ping.add(now - msg->queued);
+      DEBUG_PRINT(String("Task round-trip: ") + (now - msg->queued) + " us");
+    } else {
+      write_coalesce_put(msg->pin, msg->data, msg->len);
+      blynkTaskStats.out.add(now - msg->queued);
+    }
+    blynkTaskOut.pop();
+  }
+}
+
+// App side: calls the handlers of the received writes
+static
+void blynk_task_dispatch()
+{
+  while (BlynkTaskMsg* msg = blynkTaskIn.peek()) {
+    if (msg->pin == BLYNK_TASK_PING) {
+      // Bounce it back, keeping the original time
+      if (BlynkTaskMsg* reply = blynkTaskOut.reserve()) {
+        *reply = *msg;
+        blynkTaskOut.commit();
+      }
+    } else {
+      blynkTaskStats.in.add(micros() - msg->queued);
+      if (WidgetWriteHandler handler = blynkTaskHandlers[msg->pin & 0xFF]) {
+        ProfileScope profile(PROF_HANDLERS);
+        BlynkReq req = { (uint8_t)msg->pin };
+        BlynkParam param(msg->data, msg->len);
+        handler(req, param);
+      }
+    }
+    blynkTaskIn.pop();
+  }
+}
+
+// Task side, i.e. from the console
+static
+void blynk_task_ping()
+{
+  if (BlynkTaskMsg* msg = blynkTaskIn.reserve()) {
+    msg->queued = micros();
+    msg->pin    = BLYNK_TASK_PING;
+    msg->len    = 0;
+    blynkTaskIn.commit();
+  }
+}
+
+static
+void blynk_task_start(void (*step)(void*), void* arg)
+{
+  static struct {
+    void (*step)(void*);
+    void* arg;
+  } ctx = { step, arg };
+
+  xTaskCreatePinnedToCore([](void*) {
+    for (;;) {
+      ctx.step(ctx.arg);
+      blynk_task_send();
+      vTaskDelay(1); // Lets the idle task feed the watchdog
+    }
+  }, "blynk", BLYNK_TASK_STACK, NULL, 1, &blynkTask, BLYNK_TASK_CORE);
+}
+
+static
+void blynk_task_print_stats(Stream& out)
+{
+  const BlynkTaskLatency* lat[] = { &blynkTaskStats.out, &blynkTaskStats.in, &blynkTaskStats.ping };
+  const char* names[] = { "out ", "in  ", "ping" };
+  out.println(String("Blynk task on core ") + BLYNK_TASK_CORE + ", app on core " + CONFIG_ARDUINO_RUNNING_CORE +
+              ", stack left " + uxTaskGetStackHighWaterMark(blynkTask));
+  for (int i = 0; i < 3; i++) {
+    out.println(String(" ") + names[i] + ": " + lat[i]->count + " msgs, avg " +
+                (lat[i]->count ? lat[i]->total / lat[i]->count : 0) + " us, max " + lat[i]->max + " us");
+  }
+  out.println(String(" dropped: ") + blynkTaskStats.outDropped + " out, " + blynkTaskStats.inDropped + " in");
+}
+
+#endif
@@ -0,0 +1,235 @@
+
+/*
+ * Captive portal DNS responder.
+ *
+ * Runs in its own task on a blocking UDP socket, so bursts of connectivity
+ * checks from a joining phone are answered right away, not once per loop
+ * iteration. Every wakeup drains all queued queries. Replies are built in
+ * place from a precomputed answer record.
+ *
+ * "max wait" is the longest time from a wakeup to a reply, the last query of
+ * a burst waits for all before it. test/dns_burst.py measures the latency a
+ * client sees.
+ */
+
+#include <lwip/sockets.h>
+
+#define CAPTIVE_DNS_PORT        53
+#define CAPTIVE_DNS_TTL         300
+#define CAPTIVE_DNS_BUFF_SIZE   512
+
+struct CaptiveDnsStats {
+  uint32_t  queries;
+  uint32_t  answered;
+  uint32_t  failed;
+  uint32_t  maxBurst;   // Queries handled in one wakeup
+  uint32_t  maxTime;    // Longest turnaround, us
+  uint32_t  maxWait;    // Longest from the wakeup to a reply, i.e. the last of a burst, us
+};
+
+static CaptiveDnsStats captiveDnsStats;
+static uint8_t         captiveDnsAnswer[16];  // A record, the name points to the question
+static char            captiveDnsDomain[64];  // "*" answers every name
+
+static
+void captive_dns_prepare(const IPAddress& ip, const char* domain)
+{
+  const uint8_t answer[] = {
+    0xC0, 0x0C,                                 // Name: pointer to the question
+    0x00, 0x01,                                 // Type: A
+    0x00, 0x01,                                 // Class: IN
+    (CAPTIVE_DNS_TTL >> 24) & 0xFF, (CAPTIVE_DNS_TTL >> 16) & 0xFF,
+    (CAPTIVE_DNS_TTL >> 8)  & 0xFF, (CAPTIVE_DNS_TTL)       & 0xFF,
+    0x00, 0x04,                                 // Data length
+    ip[0], ip[1], ip[2], ip[3]
+  };
+  memcpy(captiveDnsAnswer, answer, sizeof(captiveDnsAnswer));
+  strncpy(captiveDnsDomain, domain, sizeof(captiveDnsDomain)-1);
+  memset(&captiveDnsStats, 0, sizeof(captiveDnsStats));
+}
+
+static
+bool captive_dns_matches(const char* name)
+{
+  if (captiveDnsDomain[0] == '*') {
+    return true;
+  }
+  if (0 == strncasecmp(name, "www.", 4)) {
+    name += 4;
+  }
+  return 0 == strcasecmp(name, captiveDnsDomain);
+}
+
+// Turns the query in buff into a reply, in place.
+// Returns the reply length, or 0 if the packet should be dropped
+static
+size_t captive_dns_reply(uint8_t* buff, size_t len)
+{
+  if (len < 12) {
+    return 0;
+  }
+  const uint8_t flags = buff[2];
+  if (flags & 0x80) {
+    return 0;                                   // Not a query
+  }
+
+  // Answer counts are filled in below, other sections are never sent
+  memset(buff + 6, 0, 6);
+
+  const uint16_t qdcount = (buff[4] << 8) | buff[5];
+  if ((flags & 0x78) || qdcount != 1) {
+    buff[2] = 0x80 | (flags & 0x79);            // QR, keep opcode and RD
+    buff[3] = 4;                                // NOTIMP
+    buff[4] = buff[5] = 0;
+    return 12;
+  }
+
+  char   name[128];
+  size_t nameLen = 0;
+  size_t pos = 12;
+  while (pos < len && buff[pos]) {
+    const uint8_t labelLen = buff[pos++];
+    if ((labelLen & 0xC0) || pos + labelLen > len) {
+      return 0;
+    }
+    if (nameLen + labelLen + 2 > sizeof(name)) {
+      return 0;
+    }
+    if (nameLen) {
+      name[nameLen++] = '.';
+    }
+    memcpy(name + nameLen, buff + pos, labelLen);
+    nameLen += labelLen;
+    pos += labelLen;
+  }
+  name[nameLen] = '\0';
+  pos += 1 + 4;                                 // Root label, type, class
+  if (pos > len || pos + sizeof(captiveDnsAnswer) > CAPTIVE_DNS_BUFF_SIZE) {
+    return 0;
+  }
+  const uint16_t qtype = (buff[pos-4] << 8) | buff[pos-3];
+
+  buff[2] = 0x84 | (flags & 0x01);              // QR, AA, keep RD
+  buff[3] = 0;
+  if (!captive_dns_matches(name)) {
+    buff[3] = 2;                                // SERVFAIL
+    captiveDnsStats.failed++;
+  } else if (qtype == 1 || qtype == 255) {      // A or ANY
+    memcpy(buff + pos, captiveDnsAnswer, sizeof(captiveDnsAnswer));
+    pos += sizeof(captiveDnsAnswer);
+    buff[7] = 1;
+    captiveDnsStats.answered++;
+  }
+  // Other types (i.e. AAAA) get an empty answer, so clients fall back to A quickly
+  return pos;
+}
+
+static
+void captive_dns_account(uint32_t woke, uint32_t started, uint32_t burst)
+{
+  const uint32_t now = micros();
+  captiveDnsStats.queries++;
+  captiveDnsStats.maxTime  = BlynkMax(captiveDnsStats.maxTime, now - started);
+  captiveDnsStats.maxWait  = BlynkMax(captiveDnsStats.maxWait, now - woke);
+  captiveDnsStats.maxBurst = BlynkMax(captiveDnsStats.maxBurst, burst);
+}
+
+static
+void captive_dns_print_stats()
+{
+  DEBUG_PRINT(String("DNS: ") + captiveDnsStats.queries + " queries, " +
+              captiveDnsStats.answered + " answered, " +
+              captiveDnsStats.failed + " failed, max burst " +
+              captiveDnsStats.maxBurst + ", max " +
+              captiveDnsStats.maxTime + " us, max wait " +
+              captiveDnsStats.maxWait + " us");
+}
+
+static volatile bool captiveDnsRunning = false;  // the task keeps serving
+static volatile bool captiveDnsAlive   = false;  // the task has not exited yet
+
+static
+void captive_dns_task(void*)
+{
+  static uint8_t buff[CAPTIVE_DNS_BUFF_SIZE];
+
+  const int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(CAPTIVE_DNS_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    DEBUG_PRINT("DNS: cannot bind");
+    captiveDnsRunning = false;
+  } else {
+    // Wake up periodically to notice captive_dns_stop()
+    struct timeval tv = { 0, 100000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  while (captiveDnsRunning) {
+    int flags = 0;
+    uint32_t woke = 0;
+    for (uint32_t burst = 1; ; burst++) {
+      struct sockaddr_in from;
+      socklen_t fromLen = sizeof(from);
+      const int len = recvfrom(sock, buff, sizeof(buff), flags,
+                               (struct sockaddr*)&from, &fromLen);
+      if (len <= 0) {
+        break;
+      }
+      flags = MSG_DONTWAIT; // Drain whatever else is queued
+
+      const uint32_t t = micros();
+      if (burst == 1) {
+        woke = t;
+      }
+      const size_t reply = captive_dns_reply(buff, len);
+      if (reply) {
+        sendto(sock, buff, reply, 0, (struct sockaddr*)&from, fromLen);
+      }
+      captive_dns_account(woke, t, burst);
+    }
+  }
+
+  if (sock >= 0) {
+    close(sock);
+  }
+  captiveDnsAlive = false;
+  vTaskDelete(NULL);
+}
+
+static
+void captive_dns_start(const IPAddress& ip, const char* domain)
+{
+  if (captiveDnsAlive) {
+    return;
+  }
+  captive_dns_prepare(ip, domain);
+  captiveDnsRunning = true;
+  captiveDnsAlive   = true;   // Before the task starts, it may exit right away
+  if (pdPASS != xTaskCreate(captive_dns_task, "dns", 3072, NULL, 2, NULL)) {
+    DEBUG_PRINT("DNS: cannot start the task");
+    captiveDnsRunning = captiveDnsAlive = false;
+  }
+}
+
+static
+void captive_dns_run()
+{
+  // Served by captive_dns_task
+}
+
+static
+void captive_dns_stop()
+{
+  captiveDnsRunning = false;
+  // The socket times out every 100 ms. A restart must not find the old task
+  while (captiveDnsAlive) {
+    delay(10);
+  }
+  captive_dns_print_stats();
+}
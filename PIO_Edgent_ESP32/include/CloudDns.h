@@ -0,0 +1,223 @@
+
+/*
+ * Resolved cloud address cache, for faster (re)connects.
+ *
+ * With CLOUD_DNS_CACHE_ENABLE, Blynk connects through CloudClientSecure,
+ * which takes the server address from a small cache in no-init RAM (kept
+ * across reboots, lost on power-off). A stale entry is still used right away
+ * while a background task resolves the host again.
+ *
+ * lwIP returns a single A record per lookup, so distinct addresses seen over
+ * time are kept and tried in turn when a connect fails. TLS still gets the
+ * host name, for SNI and certificate verification.
+ */
+
+#if defined(CLOUD_DNS_CACHE_ENABLE)
+
+#define CLOUD_DNS_CACHE_ADDRS   4
+#define CLOUD_DNS_CACHE_TTL     3600    // s, lwIP does not report the record TTL
+
+struct CloudDnsCache {
+  uint32_t magic;
+  uint32_t host;                          // CRC32 of the host name
+  uint32_t addrs[CLOUD_DNS_CACHE_ADDRS];  // last working address first
+  uint32_t count;
+  uint32_t boot;                          // resetCount.total when resolved
+  uint32_t resolvedAt;                    // uptime, s
+  uint32_t crc;
+};
+
+BLYNK_NOINIT_ATTR
+static CloudDnsCache cloudDnsCache;
+
+static SemaphoreHandle_t cloudDnsLock = xSemaphoreCreateMutex();
+static volatile bool     cloudDnsRefreshing = false;
+static char              cloudDnsHost[64];
+
+#define CLOUD_DNS_MAGIC     0x3a9c51e7
+
+static
+uint32_t cloud_dns_hash(const char* host)
+{
+  return BlynkCRC32(host, strlen(host));
+}
+
+static
+uint32_t cloud_dns_crc()
+{
+  return BlynkCRC32(&cloudDnsCache, offsetof(CloudDnsCache, crc));
+}
+
+// Copies the cached addresses of this host, returns their number
+static
+int cloud_dns_get(const char* host, IPAddress* addrs)
+{
+  int count = 0;
+  xSemaphoreTake(cloudDnsLock, portMAX_DELAY);
+  if (cloudDnsCache.magic == CLOUD_DNS_MAGIC &&
+      cloudDnsCache.crc   == cloud_dns_crc() &&
+      cloudDnsCache.host  == cloud_dns_hash(host))
+  {
+    count = BlynkMin(cloudDnsCache.count, (uint32_t)CLOUD_DNS_CACHE_ADDRS);
+    for (int i = 0; i < count; i++) {
+      addrs[i] = cloudDnsCache.addrs[i];
+    }
+  }
+  xSemaphoreGive(cloudDnsLock);
+  return count;
+}
+
+// Resolved during this boot and not older than the TTL
+static
+bool cloud_dns_fresh()
+{
+  return cloudDnsCache.boot == systemStats.resetCount.total &&
+         systemUptime() / 1000 - cloudDnsCache.resolvedAt < CLOUD_DNS_CACHE_TTL;
+}
+
+// The next connect refreshes the entry
+static
+void cloud_dns_expire()
+{
+  xSemaphoreTake(cloudDnsLock, portMAX_DELAY);
+  cloudDnsCache.resolvedAt = systemUptime() / 1000 - CLOUD_DNS_CACHE_TTL;   // wraps like the check
+  cloudDnsCache.crc = cloud_dns_crc();
+  xSemaphoreGive(cloudDnsLock);
+}
+
+// Puts the address first, keeps the others as fallbacks
+static
+void cloud_dns_store(const char* host, IPAddress ip, bool resolved)
+{
+  IPAddress addrs[CLOUD_DNS_CACHE_ADDRS];
+  int count = cloud_dns_get(host, addrs);
+
+  xSemaphoreTake(cloudDnsLock, portMAX_DELAY);
+  cloudDnsCache.magic = CLOUD_DNS_MAGIC;
+  cloudDnsCache.host  = cloud_dns_hash(host);
+  cloudDnsCache.addrs[0] = ip;
+  int n = 1;
+  for (int i = 0; i < count && n < CLOUD_DNS_CACHE_ADDRS; i++) {
+    if ((uint32_t)addrs[i] != (uint32_t)ip) {
+      cloudDnsCache.addrs[n++] = addrs[i];
+    }
+  }
+  cloudDnsCache.count = n;
+  if (resolved || !count) {
+    cloudDnsCache.boot = systemStats.resetCount.total;
+    cloudDnsCache.resolvedAt = systemUptime() / 1000;
+  }
+  cloudDnsCache.crc = cloud_dns_crc();
+  xSemaphoreGive(cloudDnsLock);
+}
+
+static
+bool cloud_dns_resolve(const char* host, IPAddress& ip)
+{
+  const uint32_t t = millis();
+  if (!WiFi.hostByName(host, ip)) {
+    DEBUG_PRINT(String("DNS ") + host + " failed in " + (millis() - t) + " ms");
+    return false;
+  }
+  DEBUG_PRINT(String("DNS ") + host + ": " + ip.toString() + " in " + (millis() - t) + " ms");
+  cloud_dns_store(host, ip, true);
+  return true;
+}
+
+// Resolves the host in the background, the result is used next time
+static
+void cloud_dns_refresh(const char* host)
+{
+  if (cloudDnsRefreshing) {
+    return;
+  }
+  CopyString(host, cloudDnsHost);
+  cloudDnsRefreshing = true;
+  if (pdPASS != xTaskCreate([](void*) {
+        IPAddress ip;
+        cloud_dns_resolve(cloudDnsHost, ip);
+        cloudDnsRefreshing = false;
+        vTaskDelete(NULL);
+      }, "dns_refresh", 3072, NULL, 1, NULL))
+  {
+    cloudDnsRefreshing = false;
+  }
+}
+
+class CloudClientSecure : public WiFiClientSecure {
+public:
+  using WiFiClientSecure::connect;
+
+  int connect(const char* host, uint16_t port) override {
+    IPAddress addrs[CLOUD_DNS_CACHE_ADDRS];
+    int count = cloud_dns_get(host, addrs);
+    bool resolved = false;
+    if (!count) {
+      if (!cloud_dns_resolve(host, addrs[0])) {
+        return 0;
+      }
+      count = 1;
+      resolved = true;
+    } else if (!cloud_dns_fresh()) {
+      DEBUG_PRINT(String("Using cached ") + addrs[0].toString() + ", refreshing DNS");
+      cloud_dns_refresh(host);
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (connectTo(addrs[i], port, host)) {
+        if (i > 0) {
+          cloud_dns_store(host, addrs[i], false);
+        }
+        return 1;
+      }
+    }
+    if (resolved) {
+      return 0;
+    }
+
+    // Every cached address failed, the cloud may have moved:
+    // resolve now rather than retrying them until the TTL
+    IPAddress ip;
+    if (!cloud_dns_resolve(host, ip)) {
+      cloud_dns_expire();
+      return 0;
+    }
+    for (int i = 0; i < count; i++) {
+      if ((uint32_t)addrs[i] == (uint32_t)ip) {
+        return 0; // Already tried
+      }
+    }
+    return connectTo(ip, port, host);
+  }
+
+private:
+  bool connectTo(IPAddress ip, uint16_t port, const char* host) {
+    const uint32_t t = millis();
+    // The host name is still used for SNI and certificate checks
+    if (1 == WiFiClientSecure::connect(ip, port, host, _CA_cert, _cert, _private_key)) {
+      DEBUG_PRINT(String("TCP+TLS ") + ip.toString() + " in " + (millis() - t) + " ms");
+      return true;
+    }
+    DEBUG_PRINT(String("TCP+TLS ") + ip.toString() + " failed in " + (millis() - t) + " ms");
+    return false;
+  }
+};
+
+static CloudClientSecure cloudClient;
+
+static
+void cloud_client_init()
+{
+  _blynkTransport.setClient(&cloudClient);
+}
+
+#else
+
+static WiFiClientSecure& cloudClient = _blynkWifiClient;
+
+static
+void cloud_client_init()
+{
+}
+
+#endif
@@ -0,0 +1,135 @@
+
+/*
+ * AES-256-GCM sealing of the ConfigStore record.
+ *
+ * This is obfuscation, not protection against a flash dump: the key is an
+ * HMAC of the eFuse MAC with a fixed salt, and the MAC is public (it is on
+ * the air). Anyone with the dump and the MAC can derive the key. It keeps
+ * the credentials out of a plain read of the flash, and the GCM tag rejects
+ * a damaged record. To protect them, use flash encryption, whose key stays
+ * in eFuse. mbedTLS uses the AES peripheral on ESP32.
+ */
+
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+
+#define CONFIG_SEALED_MAGIC     0x626C6E45
+
+struct ConfigSealed {
+  uint32_t  magic;
+  uint8_t   iv[12];
+  uint8_t   tag[16];
+  uint8_t   data[sizeof(ConfigStore)];
+} __attribute__((packed));
+
+static
+bool config_crypt_key(uint8_t key[32])
+{
+  static const char salt[] = "blynk.edgent.config";
+  const uint64_t chipId = ESP.getEfuseMac();
+
+  return 0 == mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                              (const uint8_t*)salt, sizeof(salt)-1,
+                              (const uint8_t*)&chipId, sizeof(chipId),
+                              key);
+}
+
+static
+bool config_seal(const ConfigStore& in, ConfigSealed& out)
+{
+  uint8_t key[32];
+  if (!config_crypt_key(key)) {
+    return false;
+  }
+
+  out.magic = CONFIG_SEALED_MAGIC;
+  esp_fill_random(out.iv, sizeof(out.iv));
+
+  mbedtls_gcm_context gcm;
+  mbedtls_gcm_init(&gcm);
+  int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
+  if (ret == 0) {
+    ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, sizeof(in),
+                                    out.iv, sizeof(out.iv),
+                                    (const uint8_t*)&out.magic, sizeof(out.magic),
+                                    (const uint8_t*)&in, out.data,
+                                    sizeof(out.tag), out.tag);
+  }
+  mbedtls_gcm_free(&gcm);
+  memset(key, 0, sizeof(key));
+  return ret == 0;
+}
+
+static
+bool config_unseal(const ConfigSealed& in, ConfigStore& out)
+{
+  if (in.magic != CONFIG_SEALED_MAGIC) {
+    return false;
+  }
+
+  uint8_t key[32];
+  if (!config_crypt_key(key)) {
+    return false;
+  }
+
+  mbedtls_gcm_context gcm;
+  mbedtls_gcm_init(&gcm);
+  int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
+  if (ret == 0) {
+    ret = mbedtls_gcm_auth_decrypt(&gcm, sizeof(out),
+                                   in.iv, sizeof(in.iv),
+                                   (const uint8_t*)&in.magic, sizeof(in.magic),
+                                   in.tag, sizeof(in.tag),
+                                   in.data, (uint8_t*)&out);
+  }
+  mbedtls_gcm_free(&gcm);
+  memset(key, 0, sizeof(key));
+  return ret == 0;
+}
+
+/*
+ * Compares load/save latency of the plaintext and the sealed record.
+ * Uses a scratch NVS key, so the stored configuration is not touched.
+ */
+static
+void config_benchmark(Stream& out, const int iterations = 20)
+{
+  Preferences prefs;
+  if (!prefs.begin("blynk", false)) {
+    out.println(F("Cannot open NVS"));
+    return;
+  }
+
+  ConfigStore  plain = configStore;
+  ConfigSealed sealed;
+  uint32_t tPlainSave = 0, tPlainLoad = 0;
+  uint32_t tSealSave  = 0, tSealLoad  = 0;
+  bool ok = true;
+
+  for (int i = 0; i < iterations; i++) {
+    uint32_t t = micros();
+    prefs.putBytes("bench", &plain, sizeof(plain));
+    tPlainSave += micros() - t;
+
+    t = micros();
+    prefs.getBytes("bench", &plain, sizeof(plain));
+    tPlainLoad += micros() - t;
+
+    t = micros();
+    ok &= config_seal(plain, sealed);
+    prefs.putBytes("bench", &sealed, sizeof(sealed));
+    tSealSave += micros() - t;
+
+    t = micros();
+    prefs.getBytes("bench", &sealed, sizeof(sealed));
+    ok &= config_unseal(sealed, plain);
+    tSealLoad += micros() - t;
+  }
+  prefs.remove("bench");
+
+  out.printf(" Iterations:  %d (%s)\n", iterations, ok ? "OK" : "FAILED");
+  out.printf(" Plain load:  %lu us\n", (unsigned long)(tPlainLoad / iterations));
+  out.printf(" Plain save:  %lu us\n", (unsigned long)(tPlainSave / iterations));
+  out.printf(" AES load:    %lu us\n", (unsigned long)(tSealLoad  / iterations));
+  out.printf(" AES save:    %lu us\n", (unsigned long)(tSealSave  / iterations));
+}
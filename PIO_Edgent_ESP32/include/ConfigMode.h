@@ -1,9 +1,17 @@
 
 #include <WiFiClient.h>
-#include <WebServer.h>
-#include <DNSServer.h>
+#if defined(WIFI_ASYNC_PORTAL_ENABLE)
+  #include <ESPAsyncWebServer.h>
+  #include <StreamString.h>
+#else
+  #include <WebServer.h>
+#endif
 #include <Update.h>
 
+#include "CaptiveDns.h"
+#include "Backoff.h"
+#include "CloudDns.h"
+
 static const char configForm[] PROGMEM = R"html(
 <!DOCTYPE HTML>
 <html><head>
@@ -50,12 +58,20 @@ static const char configForm[] PROGMEM = R"html(
 </body></html>
 )html";
 
+#if defined(WIFI_ASYNC_PORTAL_ENABLE)
+AsyncWebServer server(80);
+#else
 WebServer server(80);
-DNSServer dnsServer;
-const byte DNS_PORT = 53;
+#endif
 
 static int connectNetRetries    = WIFI_CLOUD_MAX_RETRIES;
 static int connectBlynkRetries  = WIFI_CLOUD_MAX_RETRIES;
+static Backoff netBackoff(WIFI_NET_BACKOFF_BASE, WIFI_NET_BACKOFF_CAP);
+static Backoff cloudBackoff(WIFI_CLOUD_BACKOFF_BASE, WIFI_CLOUD_BACKOFF_CAP);
+static volatile uint32_t portalEnteredAt = 0;
+static volatile uint32_t stateStartedAt = 0;   // 0 until the current state did its setup
+static bool portalActive = false;       // AP, DNS and HTTP server are up
+static volatile bool portalValidating = false;  // STA join attempted with the portal still up
 
 static const char serverUpdateForm[] PROGMEM = R"html(
 <html><body>
@@ -112,39 +128,240 @@ String getWiFiNetworkBSSID() {
   return WiFi.BSSIDstr();
 }
 
+#include "JsonWriter.h"
+#include "PortalAssets.h"
+#include "ScanCache.h"
+#include "PortalEvents.h"
+#include "PortalUpdate.h"
+
+// The checks of portalApplyConfig(), which has no effect if they fail
+template <typename GetArg>
+static bool portalConfigValid(GetArg arg)
+{
+  const String ssidManual = arg("ssidManual");
+  const String ssid = (ssidManual != "") ? ssidManual : arg("ssid");
+  return arg("blynk").length() == 32 && ssid.length() > 0;
+}
+
+template <typename GetArg>
+static bool portalApplyConfig(GetArg arg, String& content)
+{
+  DEBUG_PRINT("Applying configuration...");
+  String ssid = arg("ssid");
+  String ssidManual = arg("ssidManual");
+  String pass = arg("pass");
+  if (ssidManual != "") {
+    ssid = ssidManual;
+  }
+  String token = arg("blynk");
+  String host  = arg("host");
+  String port  = arg("port_ssl");
+
+  String ip   = arg("ip");
+  String mask = arg("mask");
+  String gw   = arg("gw");
+  String dns  = arg("dns");
+  String dns2 = arg("dns2");
+
+  bool forceSave  = arg("save").toInt();
+
+  DEBUG_PRINT(String("WiFi SSID: ") + ssid + " Pass: " + pass);
+  DEBUG_PRINT(String("Blynk cloud: ") + token + " @ " + host + ":" + port);
+
+  if (portalConfigValid(arg)) {
+    configStore = configDefault;
+    CopyString(ssid, configStore.wifiSSID);
+    CopyString(pass, configStore.wifiPass);
+    CopyString(token, configStore.cloudToken);
+    if (host.length()) {
+      CopyString(host,  configStore.cloudHost);
+    }
+    if (port.length()) {
+      configStore.cloudPort = port.toInt();
+    }
+
+    IPAddress addr;
+
+    if (ip.length() && addr.fromString(ip)) {
+      configStore.staticIP = addr;
+      configStore.setFlag(CONFIG_FLAG_STATIC_IP, true);
+    } else {
+      configStore.setFlag(CONFIG_FLAG_STATIC_IP, false);
+    }
+    if (mask.length() && addr.fromString(mask)) {
+      configStore.staticMask = addr;
+    }
+    if (gw.length() && addr.fromString(gw)) {
+      configStore.staticGW = addr;
+    }
+    if (dns.length() && addr.fromString(dns)) {
+      configStore.staticDNS = addr;
+    }
+    if (dns2.length() && addr.fromString(dns2)) {
+      configStore.staticDNS2 = addr;
+    }
+
+    if (forceSave) {
+      configStore.setFlag(CONFIG_FLAG_VALID, true);
+      config_save();
+
+      content = R"json({"status":"ok","msg":"Configuration saved"})json";
+    } else {
+      content = R"json({"status":"ok","msg":"Trying to connect..."})json";
+    }
+
+    connectNetRetries = connectBlynkRetries = 1;
+    netBackoff.reset();
+    cloudBackoff.reset();
+    return true;
+  } else {
+    DEBUG_PRINT("Configuration invalid");
+    content = R"json({"status":"error","msg":"Configuration invalid"})json";
+    return false;
+  }
+}
+
+static
+void portalWriteBoardInfo(JsonWriter& json)
+{
+  DEBUG_PRINT("Sending board info...");
+  const char* tmpl = BLYNK_TEMPLATE_ID;
+
+  json.beginObject()
+        .member("board", BLYNK_TEMPLATE_NAME)
+        .member("tmpl_id", tmpl ? tmpl : "Unknown")
+        .member("fw_type", BLYNK_FIRMWARE_TYPE)
+        .member("fw_ver", BLYNK_FIRMWARE_VERSION)
+        .member("uid", systemGetDeviceUID())
+        .member("ssid", systemGetDeviceName())
+        .member("bssid", getWiFiApBSSID())
+        .member("mac", getWiFiMacAddress())
+        .member("last_error", configStore.last_error)
+        .member("wifi_scan", true)
+        .member("static_ip", true)
+      .endObject();
+}
+
+// Called once a new configuration is accepted by /config
+static
+void portalSwitchToSTA()
+{
+#if defined(WIFI_AP_STA_VALIDATE_ENABLE)
+  portalValidating = true;
+  BlynkState::set(MODE_CONNECTING_NET, REASON_CONFIG);
+#else
+  BlynkState::set(MODE_SWITCH_TO_STA, REASON_CONFIG);
+#endif
+}
+
+#if defined(WIFI_AP_STA_VALIDATE_ENABLE)
+// Progress of the credential check, polled by the phone after /config
+static
+void portalWriteConfigStatus(JsonWriter& json)
+{
+  const char* status;
+  if (!portalValidating) {
+    status = configStore.last_error ? "failed" : "idle";
+  } else if (BlynkState::is(MODE_CONNECTING_NET)) {
+    status = "connecting_net";
+  } else if (BlynkState::is(MODE_CONNECTING_CLOUD)) {
+    status = "connecting_cloud";
+  } else {
+    status = "connected";
+  }
+  json.beginObject()
+        .member("status", status)
+        .member("last_error", configStore.last_error)
+      .endObject();
+}
+#endif
+
+#if defined(WIFI_ASYNC_PORTAL_ENABLE)
+
+#include "ConfigModeAsync.h"
+
+#else
+
+// Answers 304 if the client already has this version
+static
+bool portalNotModified(const String& etag)
+{
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Cache-Control", "no-cache");
+  if (server.header("If-None-Match") == etag) {
+    server.send(304);
+    return true;
+  }
+  return false;
+}
+
+#ifdef BLYNK_FS
+static
+void portalServeAsset(const PortalAsset& asset)
+{
+  if (portalNotModified(asset.etag)) {
+    return;
+  }
+  File file = BLYNK_FS.open(asset.file, FILE_READ);
+  if (!file) {
+    server.send(404);
+    return;
+  }
+  // Adds Content-Encoding: gzip for *.gz files
+  server.streamFile(file, asset.type);
+}
+#endif
+
 static
 void handleRoot() {
+  if (portalNotModified(portalFormETag())) {
+    return;
+  }
   server.send(200, "text/html", configForm);
 }
 
-void enterConfigMode()
+// Reports the time from entering config mode to the first HTTP request.
+// Never handles anything itself, so it is registered before all others
+class PortalFirstRequest : public RequestHandler {
+public:
+  bool canHandle(HTTPMethod method, String uri) override {
+    if (portalEnteredAt) {
+      DEBUG_PRINT(String("First request after ") + (millis() - portalEnteredAt) + " ms: " + uri);
+      portalEnteredAt = 0;
+    }
+    return false;
+  }
+};
+
+static
+void portalBegin()
 {
-  WiFi.mode(WIFI_OFF);
-  delay(100);
-  WiFi.mode(WIFI_AP);
-  delay(2000);
-  WiFi.softAPConfig(WIFI_AP_IP, WIFI_AP_IP, WIFI_AP_Subnet);
-  WiFi.softAP(systemGetDeviceName().c_str());
-  delay(500);
+  static PortalFirstRequest* firstRequest = NULL;
+  if (!firstRequest) {
+    firstRequest = new PortalFirstRequest();
+    server.addHandler(firstRequest);
+  }
+
+  static const char* headers[] = { "If-None-Match", "Content-Length" };
+  server.collectHeaders(headers, 2);
 
-  // Set up DNS Server
-  dnsServer.setTTL(300); // Time-to-live 300s
-  dnsServer.setErrorReplyCode(DNSReplyCode::ServerFailure); // Return code for non-accessible domains
 #ifdef WIFI_CAPTIVE_PORTAL_ENABLE
-  dnsServer.start(DNS_PORT, "*", WiFi.softAPIP()); // Point all to our IP
   server.onNotFound(handleRoot);
-#else
-  dnsServer.start(DNS_PORT, CONFIG_AP_URL, WiFi.softAPIP());
-  DEBUG_PRINT(String("AP URL:  ") + CONFIG_AP_URL);
 #endif
 
+  server.on("/update/progress", HTTP_GET, []() {
+    server.sendHeader("Cache-Control", "no-store");
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    portal_update_write_progress(json);
+  });
   server.on("/update", HTTP_GET, []() {
     server.sendHeader("Connection", "close");
     server.send(200, "text/html", serverUpdateForm);
   });
   server.on("/update", HTTP_POST, []() {
     server.sendHeader("Connection", "close");
-    if (!Update.hasError()) {
+    if (portal_update_ok()) {
       server.send(200, "text/plain", "OK");
     } else {
       server.send(500, "text/plain", "FAIL");
@@ -154,184 +371,58 @@ void enterConfigMode()
     HTTPUpload& upload = server.upload();
     if (upload.status == UPLOAD_FILE_START) {
       DEBUG_PRINT(String("Update: ") + upload.filename);
-      //WiFiUDP::stop();
-
-      if (!Update.begin(UPDATE_SIZE_UNKNOWN)) { //start with max available size
-        DEBUG_PRINT(Update.errorString());
-      }
+      portal_update_begin(server.header("Content-Length").toInt(), server.arg("sha256"));
     } else if (upload.status == UPLOAD_FILE_WRITE) {
       /* flashing firmware to ESP*/
-      if (Update.write(upload.buf, upload.currentSize) != upload.currentSize) {
-        DEBUG_PRINT(Update.errorString());
-      }
-#ifdef BLYNK_PRINT
-      BLYNK_PRINT.print(".");
-#endif
+      portal_update_write(upload.buf, upload.currentSize);
     } else if (upload.status == UPLOAD_FILE_END) {
-#ifdef BLYNK_PRINT
-      BLYNK_PRINT.println();
-#endif
-      DEBUG_PRINT("Finishing...");
-      if (Update.end(true)) { //true to set the size to the current progress
-        DEBUG_PRINT("Update Success. Rebooting");
-      } else {
-        DEBUG_PRINT(Update.errorString());
-      }
+      portal_update_end();
+    } else if (upload.status == UPLOAD_FILE_ABORTED) {
+      portal_update_fail("Upload aborted");
     }
   });
   server.on("/config", []() {
-    DEBUG_PRINT("Applying configuration...");
-    String ssid = server.arg("ssid");
-    String ssidManual = server.arg("ssidManual");
-    String pass = server.arg("pass");
-    if (ssidManual != "") {
-      ssid = ssidManual;
-    }
-    String token = server.arg("blynk");
-    String host  = server.arg("host");
-    String port  = server.arg("port_ssl");
-
-    String ip   = server.arg("ip");
-    String mask = server.arg("mask");
-    String gw   = server.arg("gw");
-    String dns  = server.arg("dns");
-    String dns2 = server.arg("dns2");
-
-    bool forceSave  = server.arg("save").toInt();
-
     String content;
-
-    DEBUG_PRINT(String("WiFi SSID: ") + ssid + " Pass: " + pass);
-    DEBUG_PRINT(String("Blynk cloud: ") + token + " @ " + host + ":" + port);
-
-    if (token.length() == 32 && ssid.length() > 0) {
-      configStore = configDefault;
-      CopyString(ssid, configStore.wifiSSID);
-      CopyString(pass, configStore.wifiPass);
-      CopyString(token, configStore.cloudToken);
-      if (host.length()) {
-        CopyString(host,  configStore.cloudHost);
-      }
-      if (port.length()) {
-        configStore.cloudPort = port.toInt();
-      }
-
-      IPAddress addr;
-
-      if (ip.length() && addr.fromString(ip)) {
-        configStore.staticIP = addr;
-        configStore.setFlag(CONFIG_FLAG_STATIC_IP, true);
-      } else {
-        configStore.setFlag(CONFIG_FLAG_STATIC_IP, false);
-      }
-      if (mask.length() && addr.fromString(mask)) {
-        configStore.staticMask = addr;
-      }
-      if (gw.length() && addr.fromString(gw)) {
-        configStore.staticGW = addr;
-      }
-      if (dns.length() && addr.fromString(dns)) {
-        configStore.staticDNS = addr;
-      }
-      if (dns2.length() && addr.fromString(dns2)) {
-        configStore.staticDNS2 = addr;
-      }
-
-      if (forceSave) {
-        configStore.setFlag(CONFIG_FLAG_VALID, true);
-        config_save();
-
-        content = R"json({"status":"ok","msg":"Configuration saved"})json";
-      } else {
-        content = R"json({"status":"ok","msg":"Trying to connect..."})json";
-      }
+    if (portalApplyConfig([](const char* name) { return server.arg(name); }, content)) {
       server.send(200, "application/json", content);
-
-      connectNetRetries = connectBlynkRetries = 1;
-      BlynkState::set(MODE_SWITCH_TO_STA);
+      portalSwitchToSTA();
     } else {
-      DEBUG_PRINT("Configuration invalid");
-      content = R"json({"status":"error","msg":"Configuration invalid"})json";
       server.send(500, "application/json", content);
     }
   });
   server.on("/board_info.json", []() {
     // Configuring starts with board info request (may impact indication)
-    BlynkState::set(MODE_CONFIGURING);
-
-    DEBUG_PRINT("Sending board info...");
-    const char* tmpl = BLYNK_TEMPLATE_ID;
-
-    char buff[512];
-    snprintf(buff, sizeof(buff),
-      R"json({"board":"%s","tmpl_id":"%s","fw_type":"%s","fw_ver":"%s","uid":"%s","ssid":"%s","bssid":"%s","mac":"%s","last_error":%d,"wifi_scan":true,"static_ip":true})json",
-      BLYNK_TEMPLATE_NAME,
-      tmpl ? tmpl : "Unknown",
-      BLYNK_FIRMWARE_TYPE,
-      BLYNK_FIRMWARE_VERSION,
-      systemGetDeviceUID().c_str(),
-      systemGetDeviceName().c_str(),
-      getWiFiApBSSID().c_str(),
-      getWiFiMacAddress().c_str(),
-      configStore.last_error
-    );
-    server.send(200, "application/json", buff);
+    if (BlynkState::is(MODE_WAIT_CONFIG)) {
+      BlynkState::set(MODE_CONFIGURING);
+    }
+
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    portalWriteBoardInfo(json);
+  });
+  portal_events_begin();
+#if defined(WIFI_AP_STA_VALIDATE_ENABLE)
+  server.on("/config_status.json", []() {
+    server.sendHeader("Cache-Control", "no-store");
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    portalWriteConfigStatus(json);
   });
+#endif
   server.on("/wifi_scan.json", []() {
-    DEBUG_PRINT("Scanning networks...");
-    int wifi_nets = WiFi.scanNetworks(true, true);
-    const uint32_t t = millis();
-    while (wifi_nets < 0 &&
-           millis() - t < 20000)
-    {
-      delay(20);
-      wifi_nets = WiFi.scanComplete();
+    WatchdogScope scope(WDT_PHASE_SCAN);
+    if (server.arg("refresh").toInt()) {
+      scanCache.requested = true;
     }
-    DEBUG_PRINT(String("Found networks: ") + wifi_nets);
-
-    if (wifi_nets > 0) {
-      // Sort networks
-      int indices[wifi_nets];
-      for (int i = 0; i < wifi_nets; i++) {
-        indices[i] = i;
-      }
-      for (int i = 0; i < wifi_nets; i++) {
-        for (int j = i + 1; j < wifi_nets; j++) {
-          if (WiFi.RSSI(indices[j]) > WiFi.RSSI(indices[i])) {
-            std::swap(indices[i], indices[j]);
-          }
-        }
-      }
-
-      wifi_nets = BlynkMin(15, wifi_nets); // Show top 15 networks
-
-      // TODO: skip empty names
-      String result = "[\n";
-
-      char buff[256];
-      for (int i = 0; i < wifi_nets; i++){
-        int id = indices[i];
-
-        String ssid = WiFi.SSID(id);
-        ssid.replace("\"", "\\\"");
-
-        snprintf(buff, sizeof(buff),
-          R"json(  {"ssid":"%s","bssid":"%s","rssi":%i,"sec":"%s","ch":%i})json",
-          ssid.c_str(),
-          WiFi.BSSIDstr(id).c_str(),
-          WiFi.RSSI(id),
-          wifiSecToStr(WiFi.encryptionType(id)),
-          WiFi.channel(id)
-        );
-
-        result += buff;
-        if (i != wifi_nets-1) result += ",\n";
-      }
-      WiFi.scanDelete();
-      server.send(200, "application/json", result + "\n]");
-    } else {
-      server.send(200, "application/json", "[]");
+    if (!scanCache.valid) {
+      // Only the very first scan is waited for
+      scan_cache_wait(20000);
     }
+    server.sendHeader("Age", scan_cache_age());
+    server.sendHeader("Cache-Control", "no-store");
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    scan_cache_write(json);
   });
   server.on("/reset", []() {
     BlynkState::set(MODE_RESET_CONFIG);
@@ -343,10 +434,12 @@ void enterConfigMode()
   });
 
 #ifdef BLYNK_FS
-  if (BLYNK_FS.exists("/index.html")) {
-    server.serveStatic("/img/favicon.png", BLYNK_FS, "/img/favicon.png");
-    server.serveStatic("/img/logo.png", BLYNK_FS, "/img/logo.png");
-    server.serveStatic("/", BLYNK_FS, "/index.html");
+  if (portalAssetsInit()) {
+    for (const PortalAsset& asset : portalAssets) {
+      if (asset.etag.length()) {
+        server.on(asset.uri, HTTP_GET, [&asset]() { portalServeAsset(asset); });
+      }
+    }
   } else
 #endif
   { /* if no BLYNK_FS or index.html not found */
@@ -354,60 +447,207 @@ void enterConfigMode()
   }
 
   server.begin();
+}
+
+static
+void portalRun()
+{
+  delay(10);
+  server.handleClient();
+  portal_events_run();
+}
+
+static
+void portalEnd()
+{
+  server.stop();
+}
+
+#endif
+
+static
+void portalShutdown()
+{
+  portal_events_end();
+  portalEnd();
+  scan_cache_end();
+  captive_dns_stop();
+  portalActive = false;
+}
+
+// Keeps the portal responsive while the STA join is being checked
+static
+void portalValidateRun()
+{
+  if (portalValidating) {
+    portalRun();
+    captive_dns_run();
+  }
+}
+
+// Wrong credentials: drop the STA side and go back to the (still running) portal
+static
+void portalValidateFailed(int error)
+{
+  DEBUG_PRINT("Configuration check failed");
+  config_set_last_error(error);
+  WiFi.disconnect();
+  WiFi.enableSTA(false);
+  portalValidating = false;
+  BlynkState::set(MODE_WAIT_CONFIG);
+}
+
+// Cloud login succeeded: let the phone fetch the result, then close the AP
+static
+void portalValidateDone()
+{
+  const uint32_t t = millis();
+  while (millis() - t < WIFI_AP_STA_LINGER_TIME && BlynkState::is(MODE_RUNNING)) {
+    portalRun();
+    captive_dns_run();
+    Blynk.run();
+    app_loop();
+  }
+  portalValidating = false;
+  portalShutdown();
+  WiFi.softAPdisconnect(true);
+}
+
+static
+void portalStart()
+{
+  const uint32_t entered = millis();
+  portalEnteredAt = entered;
+
+  WiFi.mode(WIFI_OFF);
+  WiFi.mode(WIFI_AP);
+  // softAPConfig only works once the AP interface is up
+  if (!WiFi.waitStatusBits(AP_STARTED_BIT, WIFI_AP_START_TIMEOUT)) {
+    DEBUG_PRINT("AP start timeout");
+  }
+  WiFi.softAPConfig(WIFI_AP_IP, WIFI_AP_IP, WIFI_AP_Subnet);
+  WiFi.softAP(systemGetDeviceName().c_str());
+
+  // Set up DNS Server
+#ifdef WIFI_CAPTIVE_PORTAL_ENABLE
+  captive_dns_start(WiFi.softAPIP(), "*"); // Point all to our IP
+#else
+  captive_dns_start(WiFi.softAPIP(), CONFIG_AP_URL);
+  DEBUG_PRINT(String("AP URL:  ") + CONFIG_AP_URL);
+#endif
+
+  portalBegin();
+  scan_cache_start();
+  portalActive = true;
+  DEBUG_PRINT(String("Portal ready in ") + (millis() - entered) + " ms");
+}
+
+void enterConfigMode()
+{
+  if (!portalActive) {
+    portalStart();
+  } else {
+    DEBUG_PRINT("Back to portal"); // after a failed credential check
+  }
 
   while (BlynkState::is(MODE_WAIT_CONFIG) || BlynkState::is(MODE_CONFIGURING)) {
-    delay(10);
-    dnsServer.processNextRequest();
-    server.handleClient();
+    watchdog_feed();
+    WatchdogScope scope(WDT_PHASE_PORTAL);
+    portalRun();
+    captive_dns_run();
+    scan_cache_run();
     app_loop();
     if (BlynkState::is(MODE_CONFIGURING) && WiFi.softAPgetStationNum() == 0) {
       BlynkState::set(MODE_WAIT_CONFIG);
     }
   }
+}
 
-  server.stop();
+// Exit hook of WAIT_CONFIG and CONFIGURING. The portal stays up while
+// the new credentials are checked (WIFI_AP_STA_VALIDATE_ENABLE)
+void exitConfigMode()
+{
+  if (portalActive && !portalValidating) {
+    portalShutdown();
+  }
 }
 
-void enterConnectNet() {
-  BlynkState::set(MODE_CONNECTING_NET);
-  DEBUG_PRINT(String("Connecting to WiFi: ") + configStore.wifiSSID);
+// Connection states are polled by Edgent::run(). The first call after a
+// state change does the setup, later calls only check progress and return
+static
+bool stateEnter()
+{
+  if (stateStartedAt) {
+    return false;
+  }
+  stateStartedAt = millis() | 1;
+  return true;
+}
 
-  // Needed for setHostname to work
-  WiFi.enableSTA(false);
+// Runs the setup of the current state again (next retry)
+static
+void stateRestart()
+{
+  stateStartedAt = 0;
+}
 
-  String hostname = systemGetDeviceName();
-  hostname.replace(" ", "-");
-  WiFi.setHostname(hostname.c_str());
-
-  if (configStore.getFlag(CONFIG_FLAG_STATIC_IP)) {
-    if (!WiFi.config(configStore.staticIP,
-                    configStore.staticGW,
-                    configStore.staticMask,
-                    configStore.staticDNS,
-                    configStore.staticDNS2)
-    ) {
-      DEBUG_PRINT("Failed to configure Static IP");
-      config_set_last_error(BLYNK_PROV_ERR_CONFIG);
-      BlynkState::set(MODE_ERROR);
-      return;
-    }
+static
+uint32_t stateElapsed()
+{
+  return millis() - stateStartedAt;
+}
+
+void enterConnectNet() {
+  if (netBackoff.waiting()) {
+    delay(10); // Nothing to do until the scheduled attempt
+    return;
   }
 
-  WiFi.begin(configStore.wifiSSID, configStore.wifiPass);
+  if (stateEnter()) {
+    DEBUG_PRINT(String("Connecting to WiFi: ") + configStore.wifiSSID);
 
-  unsigned long timeoutMs = millis() + WIFI_NET_CONNECT_TIMEOUT;
-  while ((timeoutMs > millis()) && (WiFi.status() != WL_CONNECTED))
-  {
-    delay(10);
-    app_loop();
+    // Needed for setHostname to work
+    WiFi.enableSTA(false);
+
+    String hostname = systemGetDeviceName();
+    hostname.replace(" ", "-");
+    WiFi.setHostname(hostname.c_str());
+
+    if (configStore.getFlag(CONFIG_FLAG_STATIC_IP)) {
+      if (!WiFi.config(configStore.staticIP,
+                      configStore.staticGW,
+                      configStore.staticMask,
+                      configStore.staticDNS,
+                      configStore.staticDNS2)
+      ) {
+        DEBUG_PRINT("Failed to configure Static IP");
+        if (portalValidating) {
+          portalValidateFailed(BLYNK_PROV_ERR_CONFIG);
+          return;
+        }
+        config_set_last_error(BLYNK_PROV_ERR_CONFIG);
+        BlynkState::set(MODE_ERROR);
+        return;
+      }
+    }
 
-    if (!BlynkState::is(MODE_CONNECTING_NET)) {
-      WiFi.disconnect();
-      return;
+    const ScanRecord* net = portalValidating ? scan_cache_find(configStore.wifiSSID) : NULL;
+    if (net) {
+      // Join the scanned AP directly. The SoftAP follows to its channel
+      WiFi.begin(configStore.wifiSSID, configStore.wifiPass, net->channel, net->bssid);
+    } else if (!deep_sleep_resume_net()) {
+      WiFi.begin(configStore.wifiSSID, configStore.wifiPass);
     }
+    return;
   }
 
-  if (WiFi.status() == WL_CONNECTED) {
+  portalValidateRun();
+
+  // Sleeps until the station gets its IP, but no longer than 10 ms
+  WiFi.waitStatusBits(STA_HAS_IP_BIT, 10);
+  const wl_status_t status = WiFi.status();
+
+  if (status == WL_CONNECTED) {
     IPAddress localip = WiFi.localIP();
     if (configStore.getFlag(CONFIG_FLAG_STATIC_IP)) {
       BLYNK_LOG_IP("Using Static IP: ", localip);
@@ -416,46 +656,77 @@ void enterConnectNet() {
     }
 
     connectNetRetries = WIFI_CLOUD_MAX_RETRIES;
+    netBackoff.reset();
     BlynkState::set(MODE_CONNECTING_CLOUD);
+    return;
+  }
+
+  // Report wrong credentials right away instead of waiting for the timeout
+  const bool rejected = portalValidating &&
+                        (status == WL_CONNECT_FAILED || status == WL_NO_SSID_AVAIL);
+  if (!rejected && stateElapsed() < WIFI_NET_CONNECT_TIMEOUT) {
+    return;
+  }
+
+  if (portalValidating) {
+    portalValidateFailed(BLYNK_PROV_ERR_NETWORK);
   } else if (--connectNetRetries <= 0) {
     config_set_last_error(BLYNK_PROV_ERR_NETWORK);
-    BlynkState::set(MODE_ERROR);
+    BlynkState::set(MODE_ERROR, REASON_NET_FAILED);
+  } else {
+    WiFi.disconnect(); // Stop the driver from retrying on its own
+    DEBUG_PRINT(String("Next WiFi attempt in ") + netBackoff.fail() + " ms");
+    stateRestart();
   }
 }
 
 void enterConnectCloud() {
-  BlynkState::set(MODE_CONNECTING_CLOUD);
+  if (cloudBackoff.waiting()) {
+    if (WiFi.status() != WL_CONNECTED) {
+      BlynkState::set(MODE_CONNECTING_NET, REASON_NET_LOST);
+    }
+    delay(10);
+    return;
+  }
 
-  Blynk.config(configStore.cloudToken, configStore.cloudHost, configStore.cloudPort);
-  Blynk.connect(0);
+  if (stateEnter()) {
+    Blynk.config(configStore.cloudToken, configStore.cloudHost, configStore.cloudPort);
+    Blynk.connect(0);
+    return;
+  }
+
+  Blynk.run();
+  portalValidateRun();
+  if (!BlynkState::is(MODE_CONNECTING_CLOUD)) {
+    Blynk.disconnect();
+    return;
+  }
 
-  unsigned long timeoutMs = millis() + WIFI_CLOUD_CONNECT_TIMEOUT;
-  while ((timeoutMs > millis()) &&
-        (WiFi.status() == WL_CONNECTED) &&
-        (!Blynk.isTokenInvalid()) &&
-        (Blynk.connected() == false))
+  const bool timeout = (stateElapsed() >= WIFI_CLOUD_CONNECT_TIMEOUT);
+  if (!timeout &&
+      (WiFi.status() == WL_CONNECTED) &&
+      (!Blynk.isTokenInvalid()) &&
+      (Blynk.connected() == false))
   {
-    delay(10);
-    Blynk.run();
-    app_loop();
-    if (!BlynkState::is(MODE_CONNECTING_CLOUD)) {
-      Blynk.disconnect();
-      return;
-    }
+    return;
   }
 
-  if (millis() > timeoutMs) {
+  if (timeout) {
     DEBUG_PRINT("Timeout");
   }
 
-  if (Blynk.isTokenInvalid()) {
+  if (Blynk.isTokenInvalid() && portalValidating) {
+    Blynk.disconnect();
+    portalValidateFailed(BLYNK_PROV_ERR_TOKEN);
+  } else if (Blynk.isTokenInvalid()) {
     config_set_last_error(BLYNK_PROV_ERR_TOKEN);
-    BlynkState::set(MODE_WAIT_CONFIG); // TODO: retry after timeout
+    BlynkState::set(MODE_WAIT_CONFIG, REASON_TOKEN); // TODO: retry after timeout
   } else if (WiFi.status() != WL_CONNECTED) {
-    BlynkState::set(MODE_CONNECTING_NET);
+    BlynkState::set(MODE_CONNECTING_NET, REASON_NET_LOST);
   } else if (Blynk.connected()) {
     BlynkState::set(MODE_RUNNING);
     connectBlynkRetries = WIFI_CLOUD_MAX_RETRIES;
+    cloudBackoff.reset();
 
     if (0 != strcmp(configStore.version, BLYNK_FIRMWARE_VERSION)) {
       Blynk.logEvent("sys_ota", String("Firmware updated to ") + BLYNK_FIRMWARE_VERSION);
@@ -472,18 +743,32 @@ void enterConnectCloud() {
       Blynk.sendInternal("meta", "set", "Hotspot Name", systemGetDeviceName());
       Blynk.sendInternal("meta", "set", "Network",      configStore.wifiSSID);
     }
+
+    if (portalValidating) {
+      portalValidateDone();
+    }
+  } else if (portalValidating) {
+    Blynk.disconnect();
+    portalValidateFailed(BLYNK_PROV_ERR_CLOUD);
   } else if (--connectBlynkRetries <= 0) {
     config_set_last_error(BLYNK_PROV_ERR_CLOUD);
-    BlynkState::set(MODE_ERROR);
+    BlynkState::set(MODE_ERROR, REASON_CLOUD_FAILED);
+  } else {
+    Blynk.disconnect();
+    DEBUG_PRINT(String("Next cloud attempt in ") + cloudBackoff.fail() + " ms");
+    stateRestart();
   }
 }
 
 void enterSwitchToSTA() {
-  BlynkState::set(MODE_SWITCH_TO_STA);
-
-  DEBUG_PRINT("Switching to STA...");
+  if (stateEnter()) {
+    DEBUG_PRINT("Switching to STA...");
+    return;
+  }
+  if (stateElapsed() < 1000) {
+    return;
+  }
 
-  delay(1000);
   WiFi.mode(WIFI_OFF);
   delay(100);
   WiFi.mode(WIFI_STA);
@@ -492,16 +777,10 @@ void enterSwitchToSTA() {
 }
 
 void enterError() {
-  BlynkState::set(MODE_ERROR);
-
-  unsigned long timeoutMs = millis() + 10000;
-  while (timeoutMs > millis() || g_buttonPressed)
-  {
-    delay(10);
-    app_loop();
-    if (!BlynkState::is(MODE_ERROR)) {
-      return;
-    }
+  stateEnter();
+  if (stateElapsed() < 10000 || g_buttonPressed) {
+    delay(10); // Nothing to do, let the CPU sleep
+    return;
   }
   DEBUG_PRINT("Restarting after error.");
   systemReboot();
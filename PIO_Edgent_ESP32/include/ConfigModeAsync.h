@@ -0,0 +1,308 @@
+
+/*
+ * Event-driven provisioning portal, based on ESPAsyncWebServer.
+ *
+ * Requests are served from the AsyncTCP task, so several clients can fetch
+ * the page, images and scan results at the same time. Handlers must not
+ * block, and anything that touches edgentTimer, configStore or flash is
+ * handed to the main loop.
+ */
+
+static volatile uint32_t portalRebootDelay = 0;
+
+// /config writes configStore and flash and changes the state, so it is
+// applied by the main loop. The request only copies the arguments
+static const char* const PortalConfigArgs[] = {
+  "ssid", "ssidManual", "pass", "blynk", "host", "port_ssl",
+  "ip", "mask", "gw", "dns", "dns2", "save"
+};
+
+#define PORTAL_CONFIG_ARGS    (sizeof(PortalConfigArgs) / sizeof(PortalConfigArgs[0]))
+
+enum PortalConfigState : uint8_t {
+  PORTAL_CONFIG_IDLE,
+  PORTAL_CONFIG_PENDING,                // set by the request
+  PORTAL_CONFIG_DONE                    // set by the main loop, content is ready
+};
+
+static struct {
+  volatile PortalConfigState state;
+  String   args[PORTAL_CONFIG_ARGS];
+  String   content;
+  bool     accepted;                    // switch to STA once the response is taken
+  uint32_t doneAt;
+} portalConfig;
+
+static
+String portalConfigArg(const char* name)
+{
+  for (size_t i = 0; i < PORTAL_CONFIG_ARGS; i++) {
+    if (!strcmp(name, PortalConfigArgs[i])) {
+      return portalConfig.args[i];
+    }
+  }
+  return String();
+}
+
+// Answers 304 if the client already has this version
+static
+bool portalNotModified(AsyncWebServerRequest* request, const String& etag)
+{
+  AsyncWebHeader* header = request->getHeader("If-None-Match");
+  if (header && header->value() == etag) {
+    AsyncWebServerResponse* response = request->beginResponse(304);
+    response->addHeader("ETag", etag);
+    response->addHeader("Cache-Control", "no-cache");
+    request->send(response);
+    return true;
+  }
+  return false;
+}
+
+#ifdef BLYNK_FS
+static
+void portalServeAsset(AsyncWebServerRequest* request, const PortalAsset& asset)
+{
+  if (portalNotModified(request, asset.etag)) {
+    return;
+  }
+  AsyncWebServerResponse* response = request->beginResponse(BLYNK_FS, asset.file, asset.type);
+  if (asset.file.endsWith(".gz")) {
+    response->addHeader("Content-Encoding", "gzip");
+  }
+  response->addHeader("ETag", asset.etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+#endif
+
+static
+void handleRoot(AsyncWebServerRequest* request) {
+  const String& etag = portalFormETag();
+  if (portalNotModified(request, etag)) {
+    return;
+  }
+  AsyncWebServerResponse* response = request->beginResponse_P(200, "text/html", configForm);
+  response->addHeader("ETag", etag);
+  response->addHeader("Cache-Control", "no-cache");
+  request->send(response);
+}
+
+// Waits for the first scan result, without blocking the AsyncTCP task.
+// The scan itself is driven by scan_cache_run() in the main loop
+static
+AsyncWebServerResponse* portalScanResponse(AsyncWebServerRequest* request)
+{
+  const uint32_t started = millis();
+  std::shared_ptr<StreamString> body = std::make_shared<StreamString>();
+
+  return request->beginChunkedResponse("application/json",
+    [body, started](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      if (!body->length()) {
+        if (!scanCache.valid && millis() - started < 20000) {
+          return RESPONSE_TRY_AGAIN;
+        }
+        JsonWriter json(*body);
+        scan_cache_write(json);
+      }
+      if (index >= body->length()) {
+        return 0;
+      }
+      const size_t len = BlynkMin(maxLen, body->length() - index);
+      memcpy(buffer, body->c_str() + index, len);
+      return len;
+    });
+}
+
+// Waits for the main loop to apply the configuration
+static
+AsyncWebServerResponse* portalConfigResponse(AsyncWebServerRequest* request)
+{
+  std::shared_ptr<String> body = std::make_shared<String>();
+
+  return request->beginChunkedResponse("application/json",
+    [body](uint8_t* buffer, size_t maxLen, size_t index) -> size_t {
+      if (!body->length()) {
+        if (portalConfig.state != PORTAL_CONFIG_DONE) {
+          return RESPONSE_TRY_AGAIN;
+        }
+        *body = portalConfig.content;
+        portalConfig.state = PORTAL_CONFIG_IDLE;
+      }
+      if (index >= body->length()) {
+        return 0;
+      }
+      const size_t len = BlynkMin(maxLen, body->length() - index);
+      memcpy(buffer, body->c_str() + index, len);
+      return len;
+    });
+}
+
+// Reports the time from entering config mode to the first HTTP request.
+// Never handles anything itself, so it is registered before all others
+class PortalFirstRequest : public AsyncWebHandler {
+public:
+  bool canHandle(AsyncWebServerRequest* request) override {
+    if (portalEnteredAt) {
+      DEBUG_PRINT(String("First request after ") + (millis() - portalEnteredAt) + " ms: " + request->url());
+      portalEnteredAt = 0;
+    }
+    return false;
+  }
+};
+
+static
+void portalBegin()
+{
+  static bool configured = false;
+  if (configured) {
+    server.begin();
+    return;
+  }
+
+  server.addHandler(new PortalFirstRequest());
+
+#ifdef WIFI_CAPTIVE_PORTAL_ENABLE
+  server.onNotFound(handleRoot);
+#endif
+
+  // Registered before "/update", which also matches its subpaths
+  server.on("/update/progress", HTTP_GET, [](AsyncWebServerRequest* request) {
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    JsonWriter json(*response);
+    portal_update_write_progress(json);
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+  });
+  server.on("/update", HTTP_GET, [](AsyncWebServerRequest* request) {
+    AsyncWebServerResponse* response = request->beginResponse_P(200, "text/html", serverUpdateForm);
+    response->addHeader("Connection", "close");
+    request->send(response);
+  });
+  server.on("/update", HTTP_POST, [](AsyncWebServerRequest* request) {
+    const bool ok = portal_update_ok();
+    AsyncWebServerResponse* response = request->beginResponse(ok ? 200 : 500, "text/plain", ok ? "OK" : "FAIL");
+    response->addHeader("Connection", "close");
+    request->send(response);
+    portalRebootDelay = 1000;
+  }, [](AsyncWebServerRequest* request, const String& filename, size_t index, uint8_t* data, size_t len, bool final) {
+    if (index == 0) {
+      DEBUG_PRINT(String("Update: ") + filename);
+      portal_update_begin(request->contentLength(), request->arg("sha256"));
+    }
+    if (len) {
+      /* flashing firmware to ESP*/
+      portal_update_write(data, len);
+    }
+    if (final) {
+      portal_update_end();
+    }
+  });
+  server.on("/config", [](AsyncWebServerRequest* request) {
+    if (!portalConfigValid([request](const char* name) { return request->arg(name); })) {
+      request->send(500, "application/json", R"json({"status":"error","msg":"Configuration invalid"})json");
+      return;
+    }
+    if (portalConfig.state == PORTAL_CONFIG_PENDING) {
+      request->send(503, "application/json", R"json({"status":"error","msg":"Busy"})json");
+      return;
+    }
+    for (size_t i = 0; i < PORTAL_CONFIG_ARGS; i++) {
+      portalConfig.args[i] = request->arg(PortalConfigArgs[i]);
+    }
+    portalConfig.state = PORTAL_CONFIG_PENDING;
+    request->send(portalConfigResponse(request));
+  });
+  server.on("/board_info.json", [](AsyncWebServerRequest* request) {
+    // Configuring starts with board info request (may impact indication)
+    if (BlynkState::is(MODE_WAIT_CONFIG)) {
+      BlynkState::set(MODE_CONFIGURING);
+    }
+
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    JsonWriter json(*response);
+    portalWriteBoardInfo(json);
+    request->send(response);
+  });
+  portal_events_begin();
+#if defined(WIFI_AP_STA_VALIDATE_ENABLE)
+  server.on("/config_status.json", [](AsyncWebServerRequest* request) {
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    JsonWriter json(*response);
+    portalWriteConfigStatus(json);
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+  });
+#endif
+  server.on("/wifi_scan.json", [](AsyncWebServerRequest* request) {
+    if (request->arg("refresh").toInt()) {
+      scanCache.requested = true;
+    }
+    if (!scanCache.valid) {
+      scanCache.requested = !scanCache.running;
+      request->send(portalScanResponse(request));
+      return;
+    }
+    AsyncResponseStream* response = request->beginResponseStream("application/json");
+    JsonWriter json(*response);
+    scan_cache_write(json);
+    response->addHeader("Age", scan_cache_age());
+    response->addHeader("Cache-Control", "no-store");
+    request->send(response);
+  });
+  server.on("/reset", [](AsyncWebServerRequest* request) {
+    BlynkState::set(MODE_RESET_CONFIG);
+    request->send(200, "application/json", R"json({"status":"ok","msg":"Configuration reset"})json");
+  });
+  server.on("/reboot", [](AsyncWebServerRequest* request) {
+    portalRebootDelay = 50;
+    request->send(200, "application/json", R"json({"status":"ok","msg":"Rebooting"})json");
+  });
+
+#ifdef BLYNK_FS
+  if (portalAssetsInit()) {
+    for (const PortalAsset& asset : portalAssets) {
+      if (asset.etag.length()) {
+        server.on(asset.uri, HTTP_GET, [&asset](AsyncWebServerRequest* request) {
+          portalServeAsset(request, asset);
+        });
+      }
+    }
+  } else
+#endif
+  { /* if no BLYNK_FS or index.html not found */
+    server.on("/", HTTP_GET, handleRoot);
+  }
+
+  configured = true;
+  server.begin();
+}
+
+static
+void portalRun()
+{
+  // HTTP is served in the background, only DNS and timers are polled here
+  delay(1);
+  if (portalRebootDelay) {
+    edgentTimer.setTimeout(portalRebootDelay, systemReboot);
+    portalRebootDelay = 0;
+  }
+  if (portalConfig.state == PORTAL_CONFIG_PENDING) {
+    portalConfig.accepted = portalApplyConfig(portalConfigArg, portalConfig.content);
+    portalConfig.doneAt   = millis();
+    portalConfig.state    = PORTAL_CONFIG_DONE;
+  } else if (portalConfig.accepted &&
+             (portalConfig.state == PORTAL_CONFIG_IDLE || millis() - portalConfig.doneAt > 2000))
+  {
+    // The response is on its way (or the client is gone)
+    portalConfig.accepted = false;
+    portalSwitchToSTA();
+  }
+  portal_events_run();
+}
+
+static
+void portalEnd()
+{
+  server.end();
+}
@@ -105,15 +105,35 @@ static bool config_load_blnkopt()
 
 #include <Preferences.h>
 
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+  #include "ConfigCrypt.h"
+#endif
+
+static bool configIsPlaintext = false;
+
 void config_load()
 {
   Preferences prefs;
   if (prefs.begin("blynk", true)) { // read-only
     memset(&configStore, 0, sizeof(configStore));
-    prefs.getBytes("config", &configStore, sizeof(configStore));
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+    if (prefs.getBytesLength("config") == sizeof(ConfigSealed)) {
+      ConfigSealed sealed;
+      prefs.getBytes("config", &sealed, sizeof(sealed));
+      if (!config_unseal(sealed, configStore)) {
+        DEBUG_PRINT("Config decryption failed");
+        memset(&configStore, 0, sizeof(configStore));
+      }
+    } else
+#endif
+    {
+      prefs.getBytes("config", &configStore, sizeof(configStore));
+      configIsPlaintext = true;
+    }
     if (configStore.magic != configDefault.magic) {
       DEBUG_PRINT("Using default config.");
       configStore = configDefault;
+      configIsPlaintext = false;
     }
   } else {
     DEBUG_PRINT("Config read failed");
@@ -124,7 +144,17 @@ bool config_save()
 {
   Preferences prefs;
   if (prefs.begin("blynk", false)) { // writeable
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+    ConfigSealed sealed;
+    if (!config_seal(configStore, sealed)) {
+      DEBUG_PRINT("Config encryption failed");
+      return false;
+    }
+    prefs.putBytes("config", &sealed, sizeof(sealed));
+#else
     prefs.putBytes("config", &configStore, sizeof(configStore));
+#endif
+    configIsPlaintext = false;
     DEBUG_PRINT("Configuration stored to flash");
     return true;
   } else {
@@ -135,7 +165,16 @@ bool config_save()
 
 bool config_init()
 {
+  const uint32_t t = micros();
   config_load();
+  DEBUG_PRINT(String("Config loaded in ") + (micros() - t) + " us");
+
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+  if (configIsPlaintext) {
+    DEBUG_PRINT("Encrypting stored config");
+    config_save();
+  }
+#endif
   return true;
 }
 
@@ -6,8 +6,9 @@ BlynkConsole    edgentConsole;
 void console_init()
 {
 #ifdef BLYNK_PRINT
-  edgentConsole.begin(BLYNK_PRINT);
+  remoteConsoleStream.begin(&BLYNK_PRINT);
 #endif
+  edgentConsole.begin(remoteConsoleStream);
 
   edgentConsole.print("\n>");
 
@@ -17,15 +18,16 @@ void console_init()
   });
 
   edgentConsole.addCommand("devinfo", []() {
-    edgentConsole.printf(
-        R"json({"name":"%s","board":"%s","tmpl_id":"%s","fw_type":"%s","fw_ver":"%s","uid":"%s"})json" "\n",
-        systemGetDeviceName().c_str(),
-        BLYNK_TEMPLATE_NAME,
-        BLYNK_TEMPLATE_ID,
-        BLYNK_FIRMWARE_TYPE,
-        BLYNK_FIRMWARE_VERSION,
-        systemGetDeviceUID().c_str()
-    );
+    JsonWriter json(edgentConsole.getStream());
+    json.beginObject()
+          .member("name", systemGetDeviceName())
+          .member("board", BLYNK_TEMPLATE_NAME)
+          .member("tmpl_id", BLYNK_TEMPLATE_ID)
+          .member("fw_type", BLYNK_FIRMWARE_TYPE)
+          .member("fw_ver", BLYNK_FIRMWARE_VERSION)
+          .member("uid", systemGetDeviceUID())
+        .endObject();
+    edgentConsole.print("\n");
   });
 
   edgentConsole.addCommand("connect", [](int argc, const char** argv) {
@@ -57,8 +59,16 @@ void console_init()
       BlynkState::set(MODE_WAIT_CONFIG);
     } else if (0 == strcmp(argv[0], "erase")) {
       BlynkState::set(MODE_RESET_CONFIG);
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+    } else if (0 == strcmp(argv[0], "bench")) {
+      config_benchmark(edgentConsole.getStream());
+#endif
     } else {
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+      edgentConsole.getStream().println(F("Available commands: start, erase, bench"));
+#else
       edgentConsole.getStream().println(F("Available commands: start, erase"));
+#endif
     }
   });
 
@@ -171,11 +181,11 @@ void console_init()
     } else if (tool == "nodelay") {
       const String cmd = param[1].asStr();
       if (!param[1].isValid() || cmd == "show") {
-        edgentConsole.printf("TCP nodelay: %s\n", _blynkWifiClient.getNoDelay() ? "on" : "off");
+        edgentConsole.printf("TCP nodelay: %s\n", cloudClient.getNoDelay() ? "on" : "off");
       } else if (cmd == "on") {
-        _blynkWifiClient.setNoDelay(true);
+        cloudClient.setNoDelay(true);
       } else if (cmd == "off") {
-        _blynkWifiClient.setNoDelay(false);
+        cloudClient.setNoDelay(false);
       }
     } else if (tool == "cpufreq") {
       const String cmd = param[1].asStr();
@@ -189,16 +199,109 @@ void console_init()
           setCpuFrequencyMhz(freq);
         }
       }
+#if defined(DEEP_SLEEP_ENABLE)
+    } else if (tool == "sleep") {
+      edgentConsole.printf("Deep sleep: %lu wake-ups, %lu fast, %lu failed\n",
+                           deepSleepStats.wakes, deepSleepStats.resumed, deepSleepStats.failed);
+      for (int i = 0; i < DEEP_SLEEP_PHASE_MAX; i++) {
+        edgentConsole.printf(" %-6s %6lu ms\n", DeepSleepPhaseStr[i], deepSleepStats.last[i]);
+      }
+#endif
+#if defined(BLYNK_TASK_ENABLE)
+    } else if (tool == "task") {
+      const String cmd = param[1].asStr();
+      if (cmd == "ping") {
+        blynk_task_ping();
+      } else {
+        blynk_task_print_stats(edgentConsole.getStream());
+      }
+#endif
+    } else if (tool == "writes") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        write_coalesce_clear_stats();
+      } else {
+        write_coalesce_print(edgentConsole.getStream());
+      }
+#if defined(OFFLINE_BUFFER_ENABLE)
+    } else if (tool == "offline") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        offline_buffer_clear();
+      } else if (cmd == "bench") {
+        offline_buffer_benchmark(edgentConsole.getStream());
+      } else {
+        offline_buffer_print(edgentConsole.getStream());
+      }
+#endif
+#if defined(WATCHDOG_ENABLE)
+    } else if (tool == "wdt") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        watchdog_clear();
+      } else {
+        watchdog_print(edgentConsole.getStream());
+      }
+#endif
+#if defined(LOOP_PROFILER_ENABLE)
+    } else if (tool == "perf") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        profiler_clear();
+      } else if (cmd == "send") {
+        profiler_send();
+      } else {
+        profiler_print(edgentConsole.getStream());
+      }
+#endif
+    } else if (tool == "remote") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        remote_console_clear();
+      } else {
+        remote_console_print(edgentConsole.getStream());
+      }
+    } else if (tool == "states") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        state_trace_clear();
+      } else {
+        state_trace_print(edgentConsole.getStream());
+      }
     } else if (tool == "drop_stats") {
       systemStats.clear();
     } else {
-      edgentConsole.getStream().println(F("Available commands: coredump [show|clear], partitions, powersave [show|on|off], nodelay [show|on|off], cpufreq [show|N(MHz), drop_stats]"));
+      Stream& out = edgentConsole.getStream();
+      out.print(F("Available commands: coredump [show|clear], partitions, powersave [show|on|off], nodelay [show|on|off], cpufreq [show|N(MHz)]"));
+#if defined(DEEP_SLEEP_ENABLE)
+      out.print(F(", sleep"));
+#endif
+#if defined(BLYNK_TASK_ENABLE)
+      out.print(F(", task [show|ping]"));
+#endif
+      out.print(F(", writes [show|clear]"));
+#if defined(OFFLINE_BUFFER_ENABLE)
+      out.print(F(", offline [show|clear|bench]"));
+#endif
+#if defined(WATCHDOG_ENABLE)
+      out.print(F(", wdt [show|clear]"));
+#endif
+#if defined(LOOP_PROFILER_ENABLE)
+      out.print(F(", perf [show|clear|send]"));
+#endif
+      out.println(F(", remote [show|clear], states [show|clear], drop_stats"));
     }
   });
 
 #ifdef BLYNK_FS
 
+  // Hashes come from the index (see FileIndex.h), "ls -v" computes them again
   edgentConsole.addCommand("ls", [](int argc, const char** argv) {
+    const bool verify = (argc >= 1) && !strcmp(argv[0], "-v");
+    if (verify) {
+      argc--;
+      argv++;
+    }
     const char* path = (argc < 1) ? "/" : argv[0];
     File rootDir = BLYNK_FS.open(path);
     while (File f = rootDir.openNextFile()) {
@@ -208,15 +311,24 @@ void console_init()
       String fn = f.path();
 #endif
 
-      MD5Builder md5;
-      md5.begin();
-      md5.addStream(f, f.size());
-      md5.calculate();
-      String md5str = md5.toString();
+      uint8_t md5[16];
+      char    md5str[9] = "";
+      if (!f.isDirectory()) {
+        if (verify) {
+          file_index_hash(fn, f, md5);
+        }
+        if (verify || file_index_get(fn, f, md5)) {
+          snprintf(md5str, sizeof(md5str), "%02x%02x%02x%02x", md5[0], md5[1], md5[2], md5[3]);
+        } else {
+          strcpy(md5str, "-"); // Not indexed, or changed since
+        }
+      }
 
       edgentConsole.printf("%8d %-24s %s\n",
-                            f.size(), fn.c_str(),
-                            md5str.substring(0,8).c_str());
+                            f.size(), fn.c_str(), md5str);
+    }
+    if (verify) {
+      file_index_save();
     }
   });
 
@@ -226,6 +338,7 @@ void console_init()
     for (int i=0; i<argc; i++) {
       const char* fn = argv[i];
       if (BLYNK_FS.remove(fn)) {
+        file_index_remove(fn);
         edgentConsole.printf("Removed %s\n", fn);
       } else {
         edgentConsole.printf("Removing %s failed\n", fn);
@@ -238,6 +351,8 @@ void console_init()
 
     if (!BLYNK_FS.rename(argv[0], argv[1])) {
       edgentConsole.print("Rename failed\n");
+    } else {
+      file_index_rename(argv[0], argv[1]);
     }
   });
 
@@ -250,8 +365,9 @@ void console_init()
     }
 
     if (File f = BLYNK_FS.open(argv[0], FILE_READ)) {
-      while (f.available()) {
-        edgentConsole.print((char)f.read());
+      uint8_t buf[256];
+      while (size_t n = f.read(buf, sizeof(buf))) {
+        edgentConsole.getStream().write(buf, n);
       }
       edgentConsole.print("\n");
     } else {
@@ -266,16 +382,48 @@ void console_init()
       if (!f.print(argv[0])) {
         edgentConsole.print("Cannot write file\n");
       }
+      f.close();
+      file_index_update(argv[1]);
     } else {
       edgentConsole.print("Cannot open file\n");
     }
   });
 
+  // Block transfer, see FileTransfer.h
+  edgentConsole.addCommand("get", [](int argc, const char** argv) {
+    if (argc < 1) {
+      file_transfer_abort();
+      return;
+    }
+    file_transfer_get(edgentConsole.getStream(), argv[0], (argc > 1) ? strtoul(argv[1], NULL, 10) : 0);
+  });
+
+  edgentConsole.addCommand("ack", [](int argc, const char** argv) {
+    if (argc != 1) return;
+
+    file_transfer_ack(strtoul(argv[0], NULL, 10));
+  });
+
+  edgentConsole.addCommand("put", [](int argc, const char** argv) {
+    if (argc != 3) {
+      file_transfer_abort();
+      return;
+    }
+    file_transfer_put(edgentConsole.getStream(), argv[0], strtoul(argv[1], NULL, 10), strtoul(argv[2], NULL, 16));
+  });
+
+  edgentConsole.addCommand("d", [](int argc, const char** argv) {
+    if (argc != 3) return;
+
+    file_transfer_data(edgentConsole.getStream(), strtoul(argv[0], NULL, 10), strtoul(argv[1], NULL, 16), argv[2]);
+  });
+
 #endif
 
 }
 
 BLYNK_WRITE(InternalPinDBG) {
+  remote_console_begin();
   String cmd = String(param.asStr()) + "\n";
   edgentConsole.runCommand((char*)cmd.c_str());
 }
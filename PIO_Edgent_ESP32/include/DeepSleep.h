@@ -0,0 +1,242 @@
+
+/*
+ * Duty-cycle mode for battery devices.
+ *
+ * With DEEP_SLEEP_ENABLE, a provisioned device connects, stays online for
+ * DEEP_SLEEP_AWAKE_TIME (or until BlynkEdgent.sleep() is called, i.e. once
+ * the readings are sent) and then deep sleeps for DEEP_SLEEP_PERIOD.
+ *
+ * Before sleeping, the config and the link details (BSSID, channel, DHCP
+ * lease) are kept in RTC memory, so a timer wake-up does not read the config
+ * from flash, scan for the AP or wait for DHCP. If that fast path fails, the
+ * usual one is taken. The portal, OTA and a held button keep the device awake.
+ *
+ * Wake-up timings are kept in RTC memory too, see "sys sleep".
+ */
+
+#if defined(DEEP_SLEEP_ENABLE)
+
+#include <esp_sleep.h>
+
+#define DEEP_SLEEP_FLUSH_TIME   100     // ms for the TCP stack to send the last data
+#define DEEP_SLEEP_MAGIC        0x5d1e3b07
+
+enum DeepSleepPhase {
+  DEEP_SLEEP_PHASE_BEGIN,     // BlynkEdgent.begin() done
+  DEEP_SLEEP_PHASE_NET,       // got an IP
+  DEEP_SLEEP_PHASE_CLOUD,     // connected to Blynk
+  DEEP_SLEEP_PHASE_SLEEP,     // going to sleep
+
+  DEEP_SLEEP_PHASE_MAX
+};
+
+static const char* DeepSleepPhaseStr[DEEP_SLEEP_PHASE_MAX] = {
+  "begin",
+  "wifi",
+  "cloud",
+  "sleep"
+};
+
+// Zeroed at power-on, kept in deep sleep
+struct DeepSleepResume {
+  uint32_t    magic;
+  ConfigStore config;
+  uint8_t     bssid[6];
+  uint8_t     channel;
+  uint32_t    ip;
+  uint32_t    gateway;
+  uint32_t    mask;
+  uint32_t    dns;
+  uint32_t    crc;
+};
+
+RTC_DATA_ATTR
+static DeepSleepResume deepSleepResume;
+
+struct DeepSleepStats {
+  uint32_t magic;
+  uint32_t wakes;                           // timer wake-ups
+  uint32_t resumed;                         // ... that took the fast path
+  uint32_t failed;                          // ... that gave up connecting
+  uint32_t last[DEEP_SLEEP_PHASE_MAX];      // ms since start-up, last wake-up
+};
+
+BLYNK_NOINIT_ATTR
+static DeepSleepStats deepSleepStats;
+
+static uint32_t      deepSleepPhases[DEEP_SLEEP_PHASE_MAX];   // this wake-up
+static uint32_t      deepSleepConnecting = 0;   // when connecting started
+static bool          deepSleepResumed = false;
+static uint8_t       deepSleepNetTries = 0;
+static volatile bool deepSleepRequested = false;
+
+static
+uint32_t deep_sleep_resume_crc()
+{
+  return BlynkCRC32(&deepSleepResume, offsetof(DeepSleepResume, crc));
+}
+
+// After a timer wake-up, takes the config from RTC memory instead of flash
+static
+bool deep_sleep_resume_config()
+{
+  if (deepSleepStats.magic != DEEP_SLEEP_MAGIC) {
+    memset(&deepSleepStats, 0, sizeof(deepSleepStats));
+    deepSleepStats.magic = DEEP_SLEEP_MAGIC;
+  }
+  if (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_TIMER) {
+    return false;
+  }
+  deepSleepStats.wakes++;
+
+  if (deepSleepResume.magic != DEEP_SLEEP_MAGIC ||
+      deepSleepResume.crc   != deep_sleep_resume_crc())
+  {
+    return false;
+  }
+  configStore = deepSleepResume.config;
+  deepSleepResumed = true;
+  deepSleepStats.resumed++;
+  DEBUG_PRINT("Resuming from deep sleep");
+  return true;
+}
+
+// Joins the last AP with the last lease. Only tried once,
+// the AP or the lease may have changed while sleeping
+static
+bool deep_sleep_resume_net()
+{
+  if (!deepSleepResumed) {
+    return false;
+  }
+  const bool dhcp = !configStore.getFlag(CONFIG_FLAG_STATIC_IP);
+  if (deepSleepNetTries++) {
+    DEBUG_PRINT("Fast reconnect failed, scanning");
+    deepSleepResumed = false;
+    if (dhcp) {
+      WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Back to DHCP
+    }
+    return false;
+  }
+
+  if (dhcp) {
+    WiFi.config(deepSleepResume.ip,
+                deepSleepResume.gateway,
+                deepSleepResume.mask,
+                deepSleepResume.dns);
+  }
+  WiFi.begin(configStore.wifiSSID, configStore.wifiPass,
+             deepSleepResume.channel, deepSleepResume.bssid);
+  return true;
+}
+
+static
+void deep_sleep_phase(DeepSleepPhase phase)
+{
+  if (!deepSleepPhases[phase]) {
+    deepSleepPhases[phase] = millis();
+  }
+}
+
+static
+void deep_sleep_start(bool connected)
+{
+  const uint8_t* bssid = WiFi.BSSID();
+  if (connected && bssid) {
+    // What the next wake-up needs to reconnect quickly
+    deepSleepResume.magic   = DEEP_SLEEP_MAGIC;
+    deepSleepResume.config  = configStore;
+    memcpy(deepSleepResume.bssid, bssid, sizeof(deepSleepResume.bssid));
+    deepSleepResume.channel = WiFi.channel();
+    deepSleepResume.ip      = WiFi.localIP();
+    deepSleepResume.gateway = WiFi.gatewayIP();
+    deepSleepResume.mask    = WiFi.subnetMask();
+    deepSleepResume.dns     = WiFi.dnsIP();
+    deepSleepResume.crc     = deep_sleep_resume_crc();
+
+    // Send what is still queued and close the connection cleanly
+    write_coalesce_flush(true);
+    Blynk.run();
+    Blynk.disconnect();
+    delay(DEEP_SLEEP_FLUSH_TIME);
+  } else {
+    // Take the usual path next time, the network may have changed
+    deepSleepResume.magic = 0;
+    deepSleepStats.failed++;
+  }
+
+  offline_buffer_sync(); // RAM is lost in deep sleep
+  deep_sleep_phase(DEEP_SLEEP_PHASE_SLEEP);
+  memcpy(deepSleepStats.last, deepSleepPhases, sizeof(deepSleepStats.last));
+  DEBUG_PRINT(String("Awake for ") + deepSleepPhases[DEEP_SLEEP_PHASE_SLEEP] + " ms, sleeping for " + DEEP_SLEEP_PERIOD + " s");
+  esp_deep_sleep((uint64_t)DEEP_SLEEP_PERIOD * 1000000ULL);
+}
+
+static
+void deep_sleep_request()
+{
+  deepSleepRequested = true;
+}
+
+// Called after each Edgent::run(), decides when to go to sleep
+static
+void deep_sleep_run()
+{
+  deep_sleep_phase(DEEP_SLEEP_PHASE_BEGIN);
+
+  if (!configStore.getFlag(CONFIG_FLAG_VALID) || g_buttonPressed) {
+    deepSleepConnecting = 0;
+    return; // Not provisioned yet, or the config may be reset
+  }
+
+  switch (BlynkState::get()) {
+  case MODE_CONNECTING_NET:
+    break;
+  case MODE_CONNECTING_CLOUD:
+    deep_sleep_phase(DEEP_SLEEP_PHASE_NET);
+    break;
+  case MODE_RUNNING:
+    deep_sleep_phase(DEEP_SLEEP_PHASE_NET);
+    deep_sleep_phase(DEEP_SLEEP_PHASE_CLOUD);
+    if (deepSleepRequested ||
+        millis() - deepSleepPhases[DEEP_SLEEP_PHASE_CLOUD] >= DEEP_SLEEP_AWAKE_TIME)
+    {
+      deep_sleep_start(true);
+    }
+    return;
+  case MODE_ERROR:
+    deep_sleep_start(false); // Try again after the period, not after a reboot
+    return;
+  default:
+    deepSleepConnecting = 0; // Portal, OTA or reset in progress
+    return;
+  }
+
+  if (!deepSleepConnecting) {
+    deepSleepConnecting = millis();
+  } else if (millis() - deepSleepConnecting >= DEEP_SLEEP_CONNECT_TIMEOUT) {
+    DEBUG_PRINT("Could not connect, going to sleep");
+    deep_sleep_start(false);
+  }
+}
+
+#else
+
+static
+bool deep_sleep_resume_config()
+{
+  return false;
+}
+
+static
+bool deep_sleep_resume_net()
+{
+  return false;
+}
+
+static
+void deep_sleep_run()
+{
+}
+
+#endif
@@ -0,0 +1,288 @@
+
+/*
+ * Binary-safe file transfer over the console (Serial or InternalPinDBG).
+ *
+ * Files move in blocks of up to FILE_TRANSFER_BLOCK bytes, base64 encoded,
+ * one console line each, with the CRC32 (zlib) of the block:
+ *
+ *   get <path> [offset]          #get <size>
+ *                                #d <offset> <crc32> <base64>   (repeated)
+ *                                #end <size> <crc32 from offset to the end>
+ *   ack <offset>                 everything before offset was received
+ *
+ *   put <path> <size> <crc32>    #ok 0
+ *   d <offset> <crc32> <base64>  #ok <offset> every FILE_TRANSFER_WINDOW blocks
+ *                                #err <offset> to go back there
+ *                                #done <crc32> after the last block
+ *
+ * A download is sent from app_loop(), at most FILE_TRANSFER_WINDOW blocks
+ * ahead of the last ack, and goes back to it after FILE_TRANSFER_TIMEOUT.
+ * The CRC in #end is computed while sending, a large file is not read twice.
+ * An upload is written to <path>.part, which replaces the file only if the
+ * CRC of the whole file matches. The old file is kept as <path>.bak until
+ * the rename succeeds. "get" or "put" alone aborts.
+ *
+ * Over Serial, the RX buffer must hold a window of "d" lines.
+ * Over InternalPinDBG, blocks are only sent when the remote console buffer
+ * has room for them (see RemoteConsole.h).
+ */
+
+#ifdef BLYNK_FS
+
+#define FILE_TRANSFER_BLOCK     144       // bytes, 192 in base64: "d" lines fit the console buffer
+#define FILE_TRANSFER_WINDOW    4         // blocks in flight
+#define FILE_TRANSFER_TIMEOUT   3000      // ms without an ack before sending again
+#define FILE_TRANSFER_RETRIES   5
+
+static struct {
+  File     file;
+  String   path;
+  bool     getting;
+  bool     putting;
+  uint32_t size;
+  uint32_t crc;                         // get: of the bytes sent so far, put: expected
+  uint32_t offset;                      // get: next to send, put: next expected
+  uint32_t acked;                       // get
+  uint32_t crcOffset;                   // get: end of the bytes in crc
+  uint32_t progressAt;                  // get: millis() of the last ack
+  uint8_t  retries;
+  uint32_t received;                    // put: CRC so far
+  uint32_t blocks;                      // put: since the last ack
+} fileTransfer;
+
+static const char FileTransferB64[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static
+size_t file_transfer_encode(const uint8_t* in, size_t len, char* out)
+{
+  char* p = out;
+  for (size_t i = 0; i < len; i += 3) {
+    const uint32_t v = (in[i] << 16) |
+                       ((i + 1 < len) ? in[i + 1] << 8 : 0) |
+                       ((i + 2 < len) ? in[i + 2] : 0);
+    *p++ = FileTransferB64[(v >> 18) & 0x3F];
+    *p++ = FileTransferB64[(v >> 12) & 0x3F];
+    *p++ = (i + 1 < len) ? FileTransferB64[(v >> 6) & 0x3F] : '=';
+    *p++ = (i + 2 < len) ? FileTransferB64[v & 0x3F] : '=';
+  }
+  *p = '\0';
+  return p - out;
+}
+
+// Returns the decoded length, or -1
+static
+int file_transfer_decode(const char* in, uint8_t* out, size_t size)
+{
+  uint32_t v = 0;
+  int      bits = 0;
+  size_t   len = 0;
+  for (; *in && *in != '='; in++) {
+    const char* c = strchr(FileTransferB64, *in);
+    if (!c) {
+      return -1;
+    }
+    v = (v << 6) | (c - FileTransferB64);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (len == size) {
+        return -1;
+      }
+      out[len++] = (v >> bits) & 0xFF;
+    }
+  }
+  return len;
+}
+
+static
+void file_transfer_abort()
+{
+  if (fileTransfer.putting) {
+    fileTransfer.file.close();
+    BLYNK_FS.remove(fileTransfer.path + ".part");
+  } else if (fileTransfer.getting) {
+    fileTransfer.file.close();
+  }
+  fileTransfer.getting = false;
+  fileTransfer.putting = false;
+}
+
+static
+void file_transfer_get(Print& out, const char* path, uint32_t offset)
+{
+  file_transfer_abort();
+  fileTransfer.file = BLYNK_FS.open(path, FILE_READ);
+  if (!fileTransfer.file || fileTransfer.file.isDirectory()) {
+    out.print("#err cannot open\n");
+    return;
+  }
+
+  fileTransfer.size       = fileTransfer.file.size();
+  fileTransfer.crc        = 0;
+  fileTransfer.offset     = BlynkMin(offset, fileTransfer.size);
+  fileTransfer.acked      = fileTransfer.offset;
+  fileTransfer.crcOffset  = fileTransfer.offset;
+  fileTransfer.progressAt = millis();
+  fileTransfer.retries    = 0;
+  fileTransfer.getting    = true;
+  fileTransfer.file.seek(fileTransfer.offset);
+  out.printf("#get %lu\n", (unsigned long)fileTransfer.size);
+}
+
+static
+void file_transfer_ack(uint32_t offset)
+{
+  if (fileTransfer.getting && offset > fileTransfer.acked && offset <= fileTransfer.offset) {
+    fileTransfer.acked      = offset;
+    fileTransfer.progressAt = millis();
+    fileTransfer.retries    = 0;
+  }
+}
+
+// Sends the next window of a download, called from app_loop()
+static
+void file_transfer_run(Print& out)
+{
+  if (!fileTransfer.getting) {
+    return;
+  }
+  if (fileTransfer.acked >= fileTransfer.size) {
+    out.printf("#end %lu %08lx\n", (unsigned long)fileTransfer.size, (unsigned long)fileTransfer.crc);
+    file_transfer_abort();
+    return;
+  }
+  if (millis() - fileTransfer.progressAt >= FILE_TRANSFER_TIMEOUT) {
+    if (++fileTransfer.retries > FILE_TRANSFER_RETRIES) {
+      out.print("#err timeout\n");
+      file_transfer_abort();
+      return;
+    }
+    fileTransfer.offset     = fileTransfer.acked;   // Go back N
+    fileTransfer.progressAt = millis();
+    fileTransfer.file.seek(fileTransfer.offset);
+  }
+
+  char line[32 + (FILE_TRANSFER_BLOCK + 2) / 3 * 4];
+  while (fileTransfer.offset < fileTransfer.size &&
+         fileTransfer.offset - fileTransfer.acked < FILE_TRANSFER_WINDOW * FILE_TRANSFER_BLOCK &&
+         out.availableForWrite() >= (int)sizeof(line))      // the remote console has room
+  {
+    uint8_t buf[FILE_TRANSFER_BLOCK];
+    const int n = fileTransfer.file.read(buf, BlynkMin((uint32_t)sizeof(buf), fileTransfer.size - fileTransfer.offset));
+    if (n <= 0) {
+      out.print("#err read\n");
+      file_transfer_abort();
+      return;
+    }
+    if (fileTransfer.offset == fileTransfer.crcOffset) {   // Not a resend
+      fileTransfer.crc = BlynkCRC32(buf, n, fileTransfer.crc);
+      fileTransfer.crcOffset += n;
+    }
+    int len = snprintf(line, sizeof(line), "#d %lu %08lx ",
+                       (unsigned long)fileTransfer.offset, (unsigned long)BlynkCRC32(buf, n));
+    len += file_transfer_encode(buf, n, line + len);
+    line[len++] = '\n';
+    out.write((const uint8_t*)line, len);
+    fileTransfer.offset += n;
+  }
+}
+
+// Replaces the file with the upload if the CRC matches
+static
+void file_transfer_finish(Print& out)
+{
+  fileTransfer.file.close();
+  fileTransfer.putting = false;
+  const String part = fileTransfer.path + ".part";
+  if (fileTransfer.received != fileTransfer.crc) {
+    BLYNK_FS.remove(part);
+    out.printf("#err crc %08lx\n", (unsigned long)fileTransfer.received);
+    return;
+  }
+  // Not every file system renames over an existing file
+  const String bak = fileTransfer.path + ".bak";
+  const bool replacing = BLYNK_FS.exists(fileTransfer.path);
+  BLYNK_FS.remove(bak);
+  if (replacing && !BLYNK_FS.rename(fileTransfer.path, bak)) {
+    BLYNK_FS.remove(part);
+    out.print("#err rename\n");
+    return;
+  }
+  if (!BLYNK_FS.rename(part, fileTransfer.path)) {
+    if (replacing) {
+      BLYNK_FS.rename(bak, fileTransfer.path);
+    }
+    BLYNK_FS.remove(part);
+    out.print("#err rename\n");
+    return;
+  }
+  BLYNK_FS.remove(bak);
+  file_index_update(fileTransfer.path);
+  out.printf("#done %08lx\n", (unsigned long)fileTransfer.received);
+}
+
+static
+void file_transfer_put(Print& out, const char* path, uint32_t size, uint32_t crc)
+{
+  file_transfer_abort();
+  fileTransfer.path = path;
+  fileTransfer.file = BLYNK_FS.open(fileTransfer.path + ".part", FILE_WRITE);
+  if (!fileTransfer.file) {
+    out.print("#err cannot open\n");
+    return;
+  }
+  fileTransfer.size     = size;
+  fileTransfer.crc      = crc;
+  fileTransfer.offset   = 0;
+  fileTransfer.received = 0;
+  fileTransfer.blocks   = 0;
+  fileTransfer.putting  = true;
+  if (!size) {
+    file_transfer_finish(out);
+  } else {
+    out.print("#ok 0\n");
+  }
+}
+
+static
+void file_transfer_data(Print& out, uint32_t offset, uint32_t crc, const char* data)
+{
+  if (!fileTransfer.putting) {
+    out.print("#err no upload\n");
+    return;
+  }
+  uint8_t buf[FILE_TRANSFER_BLOCK * 2];
+  const int n = file_transfer_decode(data, buf, sizeof(buf));
+  if (offset != fileTransfer.offset || n <= 0 ||
+      offset + n > fileTransfer.size || crc != BlynkCRC32(buf, n))
+  {
+    out.printf("#err %lu\n", (unsigned long)fileTransfer.offset);
+    return;
+  }
+  if (fileTransfer.file.write(buf, n) != (size_t)n) {
+    out.print("#err write\n");
+    file_transfer_abort();
+    return;
+  }
+  fileTransfer.received = BlynkCRC32(buf, n, fileTransfer.received);
+  fileTransfer.offset += n;
+
+  if (fileTransfer.offset < fileTransfer.size) {
+    if (++fileTransfer.blocks % FILE_TRANSFER_WINDOW == 0) {
+      out.printf("#ok %lu\n", (unsigned long)fileTransfer.offset);
+    }
+    return;
+  }
+
+  file_transfer_finish(out);
+}
+
+#else
+
+static
+void file_transfer_run(Print& out)
+{
+}
+
+#endif
@@ -23,13 +23,11 @@ BLYNK_WRITE(InternalPinOTA) {
     // Disconnect, not to interfere with OTA process
     Blynk.disconnect();
 
-    BlynkState::set(MODE_OTA_UPGRADE);
+    BlynkState::set(MODE_OTA_UPGRADE, REASON_OTA);
   });
 }
 
 void enterOTA() {
-  BlynkState::set(MODE_OTA_UPGRADE);
-
   DEBUG_PRINT(String("Firmware update URL: ") + overTheAirURL);
 
   HTTPClient http;
@@ -71,6 +69,10 @@ void enterOTA() {
   BLYNK_FS.end();
 #endif
 
+  Update.onProgress([](size_t, size_t) {
+    watchdog_feed(); // A stalled download still resets the device
+  });
+
   Client& client = http.getStream();
   int written = Update.writeStream(client);
   if (written != contentLength) {
@@ -0,0 +1,474 @@
+
+/*
+ * Store-and-forward of virtual pin writes made while offline.
+ *
+ * With OFFLINE_BUFFER_ENABLE, the pins BlynkEdgent.virtualWrite() would send
+ * while the cloud is not reachable (connecting, OTA) are appended to BLYNK_FS
+ * instead, with the time they were written. Back in MODE_RUNNING they are
+ * replayed in timestamped groups, at most OFFLINE_REPLAY_RATE per second,
+ * and live writes keep going out in between.
+ *
+ * The log is a series of numbered segment files of one flash sector each.
+ * A segment is only ever appended to, in OFFLINE_PENDING_SIZE chunks, and
+ * removed as a whole once replayed. When OFFLINE_BUFFER_SEGMENTS are full,
+ * the oldest one is dropped. Records carry a CRC, a damaged tail is skipped.
+ *
+ * A record keeps the unix time if the clock is set, or the uptime, which is
+ * converted on replay if the clock is set by then, in the same boot. Edgent
+ * only starts SNTP with OFFLINE_BUFFER_SNTP_ENABLE, else the sketch has to
+ * set the clock (or the writes are replayed with the time of replay).
+ * A record torn by a failed append or a reset ends its segment, the next
+ * records go to a new one. The policies of writePolicy() apply offline too,
+ * use them to bound the flash usage.
+ * See "sys offline".
+ */
+
+#if defined(OFFLINE_BUFFER_ENABLE)
+
+#if !defined(BLYNK_FS)
+  #error "OFFLINE_BUFFER_ENABLE needs BLYNK_USE_LITTLEFS or BLYNK_USE_SPIFFS"
+#endif
+
+#include <time.h>
+#include <sys/time.h>
+
+#define OFFLINE_DIR             "/offline"
+#define OFFLINE_SEGMENT_SIZE    4096      // one flash sector
+#define OFFLINE_RECORD_SIZE     64        // encoded write, as WRITE_COALESCE_SIZE
+#define OFFLINE_PENDING_SIZE    512       // appended to a segment at once
+#define OFFLINE_PENDING_TIME    10000     // ms before a partial chunk is appended
+#define OFFLINE_NTP_SERVER      "pool.ntp.org"
+#define OFFLINE_TIME_UPTIME     0x01      // time is the uptime of boot, not unix time
+
+struct OfflineRecord {
+  uint32_t crc;                         // CRC32 of the rest of the record
+  uint64_t time;                        // ms
+  uint16_t boot;                        // resetCount.total, low bits
+  uint8_t  flags;
+  uint8_t  len;                         // of the encoded write that follows
+} __attribute__((packed));
+
+static struct {
+  bool     ready;
+  uint32_t first;                       // oldest segment
+  uint32_t last;                        // segment being appended to
+  uint32_t lastSize;
+  uint32_t replayPos;                   // in the first segment
+  uint32_t replayAt;                    // millis() of the next batch
+  uint32_t pendingSince;                // millis()
+  uint16_t pendingLen;
+  uint16_t pendingCount;
+  uint8_t  pending[OFFLINE_PENDING_SIZE];
+} offlineBuffer;
+
+static struct {
+  uint32_t stored;
+  uint32_t replayed;
+  uint32_t dropped;                     // too long, or the append failed
+  uint32_t rotated;                     // segments dropped unsent
+  uint32_t corrupt;                     // segments with a damaged record
+  uint32_t appends;                     // flash writes
+  uint32_t bytes;
+} offlineStats;
+
+static
+String offline_segment_path(uint32_t n)
+{
+  return String(OFFLINE_DIR "/") + n;
+}
+
+static
+uint32_t offline_segment_number(const String& path)
+{
+  return path.substring(path.lastIndexOf('/') + 1).toInt();
+}
+
+static
+bool offline_buffer_ready()
+{
+  return offlineBuffer.ready;
+}
+
+static
+bool offline_buffer_empty()
+{
+  return offlineBuffer.first == offlineBuffer.last && !offlineBuffer.lastSize;
+}
+
+// Unix time in ms, 0 until SNTP has set the clock
+static
+uint64_t offline_buffer_time()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < 1600000000) {
+    return 0;
+  }
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static
+size_t offline_record_encode(uint8_t* out, const char* cmd, size_t len)
+{
+  OfflineRecord rec;
+  rec.time  = offline_buffer_time();
+  rec.boot  = systemStats.resetCount.total;
+  rec.flags = 0;
+  rec.len   = len;
+  if (!rec.time) {
+    rec.time   = systemUptime();
+    rec.flags |= OFFLINE_TIME_UPTIME;
+  }
+  memcpy(out, &rec, sizeof(rec));
+  memcpy(out + sizeof(rec), cmd, len);
+  rec.crc = BlynkCRC32(out + sizeof(rec.crc), sizeof(rec) - sizeof(rec.crc) + len);
+  memcpy(out, &rec.crc, sizeof(rec.crc));
+  return sizeof(rec) + len;
+}
+
+// Reads the next record, false at the end of the file or on a damaged one
+static
+bool offline_record_read(File& f, OfflineRecord& rec, char* cmd)
+{
+  uint8_t buf[sizeof(OfflineRecord) + OFFLINE_RECORD_SIZE];
+  if (f.read(buf, sizeof(rec)) != sizeof(rec)) {
+    return false;
+  }
+  memcpy(&rec, buf, sizeof(rec));
+  if (rec.len > OFFLINE_RECORD_SIZE ||
+      f.read(buf + sizeof(rec), rec.len) != rec.len ||
+      rec.crc != BlynkCRC32(buf + sizeof(rec.crc), sizeof(rec) - sizeof(rec.crc) + rec.len))
+  {
+    return false;
+  }
+  memcpy(cmd, buf + sizeof(rec), rec.len);
+  return true;
+}
+
+// Unix time in ms to replay the record with, 0 if it cannot be known
+static
+uint64_t offline_record_time(const OfflineRecord& rec)
+{
+  if (!(rec.flags & OFFLINE_TIME_UPTIME)) {
+    return rec.time;
+  }
+  const uint64_t now = offline_buffer_time();
+  if (!now || rec.boot != (uint16_t)systemStats.resetCount.total) {
+    return 0;
+  }
+  return now - (systemUptime() - rec.time);
+}
+
+// Starts a new segment, dropping the oldest one if all are in use
+static
+void offline_buffer_next_segment()
+{
+  offlineBuffer.last++;
+  offlineBuffer.lastSize = 0;
+  if (offlineBuffer.last - offlineBuffer.first >= OFFLINE_BUFFER_SEGMENTS) {
+    BLYNK_FS.remove(offline_segment_path(offlineBuffer.first));
+    offlineBuffer.first++;
+    offlineBuffer.replayPos = 0;
+    offlineStats.rotated++;
+  }
+}
+
+// Size of the complete records at the start of a segment
+static
+uint32_t offline_segment_end(uint32_t n)
+{
+  File f = BLYNK_FS.open(offline_segment_path(n), FILE_READ);
+  OfflineRecord rec;
+  char     cmd[OFFLINE_RECORD_SIZE];
+  uint32_t end = 0;
+  while (f && offline_record_read(f, rec, cmd)) {
+    end = f.position();
+  }
+  return end;
+}
+
+static
+void offline_buffer_init()
+{
+  if (!BLYNK_FS.totalBytes()) {
+    return; // Not mounted
+  }
+#if defined(OFFLINE_BUFFER_SNTP_ENABLE)
+  configTime(0, 0, OFFLINE_NTP_SERVER);
+#endif
+
+  BLYNK_FS.mkdir(OFFLINE_DIR);
+  bool found = false;
+  File dir = BLYNK_FS.open(OFFLINE_DIR);
+  while (File f = dir.openNextFile()) {
+    const uint32_t n = offline_segment_number(f.name());
+    if (!found || n < offlineBuffer.first) {
+      offlineBuffer.first = n;
+    }
+    if (!found || n >= offlineBuffer.last) {
+      offlineBuffer.last = n;
+      offlineBuffer.lastSize = f.size();
+    }
+    found = true;
+  }
+  if (found && offline_segment_end(offlineBuffer.last) != offlineBuffer.lastSize) {
+    offline_buffer_next_segment(); // Torn by a reset while appending
+  }
+  offlineBuffer.ready = true;
+  if (found) {
+    DEBUG_PRINT(String("Offline buffer: ") + (offlineBuffer.last - offlineBuffer.first + 1) + " segments to replay");
+  }
+}
+
+// Appends the chunk kept in RAM to the last segment
+static
+void offline_buffer_sync()
+{
+  if (!offlineBuffer.pendingLen) {
+    return;
+  }
+  if (offlineBuffer.lastSize + offlineBuffer.pendingLen > OFFLINE_SEGMENT_SIZE) {
+    offline_buffer_next_segment();
+  }
+
+  size_t written = 0;
+  if (File f = BLYNK_FS.open(offline_segment_path(offlineBuffer.last), FILE_APPEND)) {
+    written = f.write(offlineBuffer.pending, offlineBuffer.pendingLen);
+    f.close();
+  }
+  if (written == offlineBuffer.pendingLen) {
+    offlineStats.appends++;
+    offlineStats.bytes += written;
+    offlineBuffer.lastSize += written;
+  } else {
+    offlineStats.dropped += offlineBuffer.pendingCount;
+    if (written) {
+      // Replay stops at the torn record, don't append after it
+      offline_buffer_next_segment();
+    }
+  }
+  offlineBuffer.pendingLen = 0;
+  offlineBuffer.pendingCount = 0;
+}
+
+// Takes an encoded write, as write_coalesce_put()
+static
+bool offline_buffer_append(const char* cmd, size_t len)
+{
+  if (!offlineBuffer.ready) {
+    return false;
+  }
+  if (len > OFFLINE_RECORD_SIZE) {
+    offlineStats.dropped++;
+    return false;
+  }
+  if (offlineBuffer.pendingLen + sizeof(OfflineRecord) + len > sizeof(offlineBuffer.pending)) {
+    offline_buffer_sync();
+  }
+  if (!offlineBuffer.pendingLen) {
+    offlineBuffer.pendingSince = millis();
+  }
+  offlineBuffer.pendingLen += offline_record_encode(offlineBuffer.pending + offlineBuffer.pendingLen, cmd, len);
+  offlineBuffer.pendingCount++;
+  offlineStats.stored++;
+  return true;
+}
+
+// Sends the next batch, called while connected
+static
+void offline_buffer_replay()
+{
+  if ((int32_t)(millis() - offlineBuffer.replayAt) < 0) {
+    return;
+  }
+  offlineBuffer.replayAt = millis() + 1000;
+  offline_buffer_sync();
+  if (offline_buffer_empty()) {
+    return;
+  }
+
+  File f = BLYNK_FS.open(offline_segment_path(offlineBuffer.first), FILE_READ);
+  if (f) {
+    f.seek(offlineBuffer.replayPos);
+  }
+
+  OfflineRecord rec;
+  char     cmd[OFFLINE_RECORD_SIZE];
+  uint64_t groupTime = 0;
+  bool     grouped = false;
+  for (int budget = OFFLINE_REPLAY_RATE; f && budget > 0 && f.position() < f.size(); budget--) {
+    if (!offline_record_read(f, rec, cmd)) {
+      DEBUG_PRINT(String("Offline segment ") + offlineBuffer.first + " damaged at " + offlineBuffer.replayPos);
+      offlineStats.corrupt++;
+      offlineBuffer.replayPos = f.size();
+      break;
+    }
+    // Writes of the same flush share a group, and a timestamp
+    const uint64_t t = offline_record_time(rec);
+    if (!grouped || t != groupTime) {
+      if (grouped) {
+        Blynk.endGroup();
+      }
+      if (t) {
+        Blynk.beginGroup(t);
+      } else {
+        Blynk.beginGroup();
+      }
+      groupTime = t;
+      grouped = true;
+    }
+    Blynk.sendCmd(BLYNK_CMD_HARDWARE, 0, cmd, rec.len);
+    offlineBuffer.replayPos = f.position();
+    offlineStats.replayed++;
+  }
+  if (grouped) {
+    Blynk.endGroup();
+  }
+
+  if (!f || offlineBuffer.replayPos >= f.size()) {
+    f.close();
+    BLYNK_FS.remove(offline_segment_path(offlineBuffer.first));
+    if (offlineBuffer.first == offlineBuffer.last) {
+      offlineBuffer.lastSize = 0;
+      DEBUG_PRINT("Offline buffer replayed");
+    } else {
+      offlineBuffer.first++;
+    }
+    offlineBuffer.replayPos = 0;
+  }
+}
+
+// Called on every Edgent step
+static
+void offline_buffer_run()
+{
+  if (!offlineBuffer.ready) {
+    return;
+  }
+  if (Blynk.connected()) {
+    if (BlynkState::is(MODE_RUNNING)) {
+      offline_buffer_replay();
+    }
+  } else if (offlineBuffer.pendingLen &&
+             millis() - offlineBuffer.pendingSince >= OFFLINE_PENDING_TIME)
+  {
+    offline_buffer_sync();
+  }
+}
+
+static
+void offline_buffer_clear()
+{
+  for (uint32_t n = offlineBuffer.first; n != offlineBuffer.last + 1; n++) {
+    BLYNK_FS.remove(offline_segment_path(n));
+  }
+  offlineBuffer.first = offlineBuffer.last = 0;
+  offlineBuffer.lastSize = 0;
+  offlineBuffer.replayPos = 0;
+  offlineBuffer.pendingLen = 0;
+  offlineBuffer.pendingCount = 0;
+  memset(&offlineStats, 0, sizeof(offlineStats));
+}
+
+static
+void offline_buffer_print(Stream& out)
+{
+  if (!offlineBuffer.ready) {
+    out.println(F("Offline buffer: no file system"));
+    return;
+  }
+  const uint32_t segments = offline_buffer_empty() ? 0 : offlineBuffer.last - offlineBuffer.first + 1;
+  out.println(String("Offline buffer: ") + segments + " of " + OFFLINE_BUFFER_SEGMENTS + " segments" +
+              ", replaying at " + offlineBuffer.replayPos +
+              ", " + offlineBuffer.pendingLen + " bytes in RAM" +
+              ", clock " + (offline_buffer_time() ? "set" : "not set"));
+  out.println(String("Records: ") + offlineStats.stored + " stored, " + offlineStats.replayed + " replayed, " +
+              offlineStats.dropped + " dropped");
+  out.println(String("Segments: ") + offlineStats.rotated + " rotated out, " + offlineStats.corrupt + " damaged");
+  out.println(String("Flash: ") + offlineStats.appends + " appends, " + offlineStats.bytes + " bytes");
+}
+
+// Append and read back throughput, without the network
+static
+void offline_buffer_benchmark(Stream& out, const int records = 500)
+{
+  const char* path = OFFLINE_DIR "_bench";
+  char mem[OFFLINE_RECORD_SIZE];
+  BlynkParam cmd(mem, 0, sizeof(mem));
+  cmd.add("vw");
+  cmd.add(10);
+  cmd.add(23.45);
+  const size_t len = cmd.getLength() - 1;
+  const size_t size = sizeof(OfflineRecord) + len;
+
+  uint8_t chunk[OFFLINE_PENDING_SIZE];
+  size_t  chunkLen = 0;
+  size_t  bytes = 0;
+  BLYNK_FS.remove(path);
+
+  uint32_t t = micros();
+  for (int i = 0; i < records; i++) {
+    chunkLen += offline_record_encode(chunk + chunkLen, mem, len);
+    if (i == records - 1 || chunkLen + size > sizeof(chunk)) {
+      if (File f = BLYNK_FS.open(path, FILE_APPEND)) {
+        bytes += f.write(chunk, chunkLen);
+        f.close();
+      }
+      chunkLen = 0;
+    }
+  }
+  const uint32_t tWrite = BlynkMax(micros() - t, 1UL);
+
+  int read = 0;
+  t = micros();
+  if (File f = BLYNK_FS.open(path, FILE_READ)) {
+    OfflineRecord rec;
+    char data[OFFLINE_RECORD_SIZE];
+    while (offline_record_read(f, rec, data)) {
+      read++;
+    }
+    f.close();
+  }
+  const uint32_t tRead = BlynkMax(micros() - t, 1UL);
+  BLYNK_FS.remove(path);
+
+  out.printf(" Records:  %d x %u bytes (%s)\n", records, size, (read == records) ? "OK" : "FAILED");
+  out.printf(" Append:   %lu records/s, %lu KB/s\n",
+             (unsigned long)(records * 1000000ULL / tWrite),
+             (unsigned long)(bytes * 1000000ULL / 1024 / tWrite));
+  out.printf(" Read:     %lu records/s, %lu KB/s\n",
+             (unsigned long)(read * 1000000ULL / tRead),
+             (unsigned long)(bytes * 1000000ULL / 1024 / tRead));
+  out.printf(" Replay:   %d records/s (rate limit)\n", OFFLINE_REPLAY_RATE);
+}
+
+#else
+
+static
+bool offline_buffer_ready()
+{
+  return false;
+}
+
+static
+void offline_buffer_init()
+{
+}
+
+static
+void offline_buffer_sync()
+{
+}
+
+static
+bool offline_buffer_append(const char* cmd, size_t len)
+{
+  return false;
+}
+
+static
+void offline_buffer_run()
+{
+}
+
+#endif
@@ -0,0 +1,186 @@
+
+/*
+ * Provisioning progress as Server-Sent Events.
+ *
+ * GET /events keeps the connection open and gets an event on every
+ * BlynkState change, so the phone does not have to poll:
+ *
+ *   id: 3
+ *   event: state
+ *   data: {"state":"CONNECTING_NET","last_error":0}
+ *
+ * Try it from a PC connected to the AP: curl -N http://192.168.4.1/events
+ *
+ * BlynkState::set() may run in an ISR or in the AsyncTCP task, so it only
+ * queues the new state; events are sent from the main loop.
+ */
+
+#define PORTAL_EVENTS_QUEUE         8
+#define PORTAL_EVENTS_MAX_CLIENTS   2
+#define PORTAL_EVENTS_PING_INTERVAL 15000
+
+static volatile uint8_t  portalEventQueue[PORTAL_EVENTS_QUEUE];
+static volatile uint32_t portalEventHead = 0;   // written by BlynkState::set()
+static uint32_t          portalEventTail = 0;   // main loop only
+static uint32_t          portalEventId   = 0;
+
+static
+void portal_events_push(State m)
+{
+  portalEventQueue[portalEventHead % PORTAL_EVENTS_QUEUE] = m;
+  portalEventHead = portalEventHead + 1;
+}
+
+static
+void portal_events_format(char* buff, size_t len, uint8_t m)
+{
+  snprintf(buff, len, R"json({"state":"%s","last_error":%d})json",
+           StateStr[BlynkMin(m, (uint8_t)MODE_MAX_VALUE)], (int)configStore.last_error);
+}
+
+#if defined(WIFI_ASYNC_PORTAL_ENABLE)
+
+static AsyncEventSource portalEvents("/events");
+
+static
+void portal_events_begin()
+{
+  portalEvents.onConnect([](AsyncEventSourceClient* client) {
+    // Start with the current state
+    char data[64];
+    portal_events_format(data, sizeof(data), BlynkState::get());
+    client->send(data, "state", portalEventId, 2000);
+  });
+  server.addHandler(&portalEvents);
+}
+
+static
+void portal_events_send(const char* data)
+{
+  portalEvents.send(data, "state", portalEventId);
+}
+
+static
+void portal_events_ping()
+{
+  // Disconnects are noticed by AsyncTCP itself
+}
+
+static
+void portal_events_close()
+{
+  portalEvents.close();
+}
+
+#else
+
+static WiFiClient portalEventClients[PORTAL_EVENTS_MAX_CLIENTS];
+static uint32_t   portalEventPinged = 0;
+
+static
+void portal_events_write(WiFiClient& client, uint32_t id, const char* data)
+{
+  char frame[112];
+  snprintf(frame, sizeof(frame), "id: %lu\nevent: state\ndata: %s\n\n", (unsigned long)id, data);
+  client.print(frame);
+}
+
+// The connection is taken over from the web server and kept open
+static
+void portal_events_subscribe()
+{
+  WiFiClient* slot = NULL;
+  for (WiFiClient& c : portalEventClients) {
+    if (!c.connected()) {
+      slot = &c;
+      break;
+    }
+  }
+  if (!slot) {
+    server.send(503, "text/plain", "Too many subscribers");
+    return;
+  }
+
+  WiFiClient client = server.client();
+  client.setNoDelay(true);
+  client.print(F("HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/event-stream\r\n"
+                 "Cache-Control: no-store\r\n"
+                 "Connection: keep-alive\r\n"
+                 "Access-Control-Allow-Origin: *\r\n"
+                 "\r\n"
+                 "retry: 2000\n\n"));
+
+  // Start with the current state
+  char data[64];
+  portal_events_format(data, sizeof(data), BlynkState::get());
+  portal_events_write(client, portalEventId, data);
+
+  *slot = client;
+}
+
+static
+void portal_events_begin()
+{
+  server.on("/events", HTTP_GET, portal_events_subscribe);
+}
+
+static
+void portal_events_send(const char* data)
+{
+  for (WiFiClient& c : portalEventClients) {
+    if (c.connected()) {
+      portal_events_write(c, portalEventId, data);
+    }
+  }
+}
+
+// Comment lines keep idle connections alive and reveal dead ones
+static
+void portal_events_ping()
+{
+  if (millis() - portalEventPinged < PORTAL_EVENTS_PING_INTERVAL) {
+    return;
+  }
+  portalEventPinged = millis();
+  for (WiFiClient& c : portalEventClients) {
+    if (c.connected()) {
+      c.print(": ping\n\n");
+    }
+  }
+}
+
+static
+void portal_events_close()
+{
+  for (WiFiClient& c : portalEventClients) {
+    c.stop();
+  }
+}
+
+#endif
+
+// Sends queued state changes, called from the portal loop
+static
+void portal_events_run()
+{
+  while (portalEventTail != portalEventHead) {
+    if (portalEventHead - portalEventTail > PORTAL_EVENTS_QUEUE) {
+      portalEventTail = portalEventHead - PORTAL_EVENTS_QUEUE; // Overrun, keep the latest
+    }
+    char data[64];
+    portal_events_format(data, sizeof(data), portalEventQueue[portalEventTail % PORTAL_EVENTS_QUEUE]);
+    portalEventTail++;
+    portalEventId++;
+    portal_events_send(data);
+  }
+  portal_events_ping();
+}
+
+// Flushes the last transitions before the portal goes away
+static
+void portal_events_end()
+{
+  portal_events_run();
+  portal_events_close();
+}
@@ -0,0 +1,173 @@
+
+/*
+ * Firmware upload through the portal (POST /update).
+ *
+ * The size announced in Content-Length is checked against the OTA partition
+ * before anything gets erased, and the image is hashed (SHA-256) while it is
+ * written. GET /update/progress reports bytes, rate and ETA; with
+ * ?sha256=<hex> on the upload URL, an image with another hash is not activated.
+ */
+
+#include <esp_ota_ops.h>
+#include <mbedtls/md.h>
+
+// Upper bound of the multipart framing (boundaries, part headers) around the image
+#define PORTAL_UPDATE_MULTIPART_MAX   1024
+
+enum PortalUpdateState {
+  PORTAL_UPDATE_IDLE,
+  PORTAL_UPDATE_WRITING,
+  PORTAL_UPDATE_DONE,
+  PORTAL_UPDATE_FAILED
+};
+
+struct PortalUpdate {
+  volatile PortalUpdateState state;
+  uint32_t          total;        // Content-Length, a bit more than the image
+  volatile uint32_t written;
+  uint32_t          started;
+  uint32_t          finished;
+  uint8_t           logged;       // last logged progress, in 10% steps
+  const char*       error;
+  char              expected[65];
+  char              sha256[65];
+};
+
+static PortalUpdate         portalUpdate;
+static mbedtls_md_context_t portalUpdateHash;
+
+static
+void portal_update_fail(const char* error)
+{
+  DEBUG_PRINT(String("Update failed: ") + error);
+  if (portalUpdate.state == PORTAL_UPDATE_WRITING) {
+    mbedtls_md_free(&portalUpdateHash);
+    Update.abort();
+  }
+  portalUpdate.error = error;
+  portalUpdate.finished = millis();
+  portalUpdate.state = PORTAL_UPDATE_FAILED;
+}
+
+static
+bool portal_update_begin(size_t contentLength, const String& sha256)
+{
+  portalUpdate.total    = contentLength;
+  portalUpdate.written  = 0;
+  portalUpdate.started  = millis();
+  portalUpdate.finished = 0;
+  portalUpdate.logged   = 0;
+  portalUpdate.error    = NULL;
+  portalUpdate.sha256[0] = '\0';
+  CopyString(sha256, portalUpdate.expected);
+  portalUpdate.state = PORTAL_UPDATE_IDLE;
+
+  const esp_partition_t* part = esp_ota_get_next_update_partition(NULL);
+  if (!part) {
+    portal_update_fail("No OTA partition");
+    return false;
+  }
+  DEBUG_PRINT(String("Update size: ") + contentLength + " / " + part->size);
+  if (contentLength > PORTAL_UPDATE_MULTIPART_MAX &&
+      contentLength - PORTAL_UPDATE_MULTIPART_MAX > part->size)
+  {
+    portal_update_fail("Image does not fit the OTA partition");
+    return false;
+  }
+
+  if (!Update.begin(UPDATE_SIZE_UNKNOWN)) { // Erases sector by sector while writing
+    portal_update_fail(Update.errorString());
+    return false;
+  }
+  mbedtls_md_init(&portalUpdateHash);
+  mbedtls_md_setup(&portalUpdateHash, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 0);
+  mbedtls_md_starts(&portalUpdateHash);
+  portalUpdate.state = PORTAL_UPDATE_WRITING;
+  return true;
+}
+
+// Bytes per second since the upload started
+static
+uint32_t portal_update_rate()
+{
+  const uint32_t end = portalUpdate.finished ? portalUpdate.finished : millis();
+  const uint32_t elapsed = end - portalUpdate.started;
+  return elapsed ? (uint64_t)portalUpdate.written * 1000 / elapsed : 0;
+}
+
+static
+void portal_update_write(const uint8_t* data, size_t len)
+{
+  if (portalUpdate.state != PORTAL_UPDATE_WRITING) {
+    return; // Rejected or failed, the rest of the body is dropped
+  }
+  if (Update.write((uint8_t*)data, len) != len) {
+    portal_update_fail(Update.errorString());
+    return;
+  }
+  watchdog_feed(); // The whole upload runs in one handleClient() of the sync portal
+  mbedtls_md_update(&portalUpdateHash, data, len);
+  portalUpdate.written += len;
+
+  if (portalUpdate.total) {
+    const uint8_t step = BlynkMin(10ULL, (uint64_t)portalUpdate.written * 10 / portalUpdate.total);
+    if (step > portalUpdate.logged) {
+      portalUpdate.logged = step;
+      DEBUG_PRINT(String("Update: ") + (step * 10) + "%, " + (portal_update_rate() / 1024) + " KB/s");
+    }
+  }
+}
+
+static
+void portal_update_end()
+{
+  if (portalUpdate.state != PORTAL_UPDATE_WRITING) {
+    return;
+  }
+  uint8_t digest[32];
+  mbedtls_md_finish(&portalUpdateHash, digest);
+  for (size_t i = 0; i < sizeof(digest); i++) {
+    snprintf(portalUpdate.sha256 + i * 2, 3, "%02x", digest[i]);
+  }
+  DEBUG_PRINT(String("Update SHA-256: ") + portalUpdate.sha256);
+
+  if (portalUpdate.expected[0] && strcasecmp(portalUpdate.expected, portalUpdate.sha256)) {
+    portal_update_fail("SHA-256 mismatch");
+    return;
+  }
+
+  DEBUG_PRINT("Finishing...");
+  if (!Update.end(true)) { //true to set the size to the current progress
+    portal_update_fail(Update.errorString());
+    return;
+  }
+  mbedtls_md_free(&portalUpdateHash);
+  portalUpdate.finished = millis();
+  portalUpdate.state = PORTAL_UPDATE_DONE;
+  DEBUG_PRINT(String("Update Success in ") + (portalUpdate.finished - portalUpdate.started) + " ms. Rebooting");
+}
+
+static
+bool portal_update_ok()
+{
+  return portalUpdate.state == PORTAL_UPDATE_DONE;
+}
+
+static
+void portal_update_write_progress(JsonWriter& json)
+{
+  static const char* states[] = { "idle", "writing", "done", "failed" };
+  const uint32_t rate = portal_update_rate();
+  const uint32_t left = (portalUpdate.total > portalUpdate.written) ? portalUpdate.total - portalUpdate.written : 0;
+  const bool writing = (portalUpdate.state == PORTAL_UPDATE_WRITING);
+
+  json.beginObject()
+        .member("state", states[portalUpdate.state])
+        .member("bytes", (unsigned long)portalUpdate.written)
+        .member("total", (unsigned long)portalUpdate.total)
+        .member("rate", (unsigned long)rate)
+        .member("eta", (unsigned long)((writing && rate) ? left / rate : 0))
+        .member("sha256", portalUpdate.sha256[0] ? portalUpdate.sha256 : (const char*)NULL)
+        .member("error", portalUpdate.error)
+      .endObject();
+}
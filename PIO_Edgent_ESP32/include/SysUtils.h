@@ -21,6 +21,8 @@
 
 #if defined(BLYNK_NOINIT_ATTR)
   // OK, use it
+#elif defined(ESP32) && defined(DEEP_SLEEP_ENABLE)
+  #define BLYNK_NOINIT_ATTR RTC_NOINIT_ATTR // Also kept in deep sleep
 #elif defined(ESP32)
   #define BLYNK_NOINIT_ATTR __NOINIT_ATTR //RTC_NOINIT_ATTR
 #elif defined(ESP8266) || defined(ARDUINO_ARCH_SAMD)
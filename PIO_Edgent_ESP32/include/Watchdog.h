@@ -0,0 +1,249 @@
+
+/*
+ * Supervision of the Edgent loop with the task watchdog.
+ *
+ * With WATCHDOG_ENABLE, the task running BlynkEdgent.run() (or the Blynk
+ * task) is added to the task WDT, which resets the device if it is not fed
+ * for WATCHDOG_TIMEOUT seconds: a stuck Blynk.run(), a stalled OTA download
+ * or a busy portal handler no longer need a power cycle.
+ *
+ * Each phase of the loop runs in a WatchdogScope. A phase that takes longer
+ * than its budget is counted as slow, with the worst time seen. The innermost
+ * phase is kept in no-init RAM, so after a watchdog reset the next boot knows
+ * where it hung, and reports it on the next cloud connect ("sys_wdt" event).
+ * See "sys wdt".
+ */
+
+// Phases 0 .. MODE_MAX_VALUE-1 are the run hooks of the states
+enum WatchdogPhase : uint8_t {
+  WDT_PHASE_LOOP = MODE_MAX_VALUE,  // outside BlynkEdgent.run(), i.e. loop()
+  WDT_PHASE_APP,                    // Edgent timer and console
+  WDT_PHASE_BLYNK,                  // Blynk.run()
+  WDT_PHASE_PORTAL,                 // one round of the config portal
+  WDT_PHASE_SCAN,                   // /wifi_scan.json
+
+  WDT_PHASE_MAX
+};
+
+static const char* WatchdogPhaseStr[WDT_PHASE_MAX - WDT_PHASE_LOOP] = {
+  "loop",
+  "app",
+  "Blynk.run",
+  "portal",
+  "wifi_scan"
+};
+
+// ms, 0 for none
+constexpr uint32_t WatchdogBudget[] = {
+  /* WAIT_CONFIG      */ 0,         // the portal, see WDT_PHASE_PORTAL
+  /* CONFIGURING      */ 0,
+  /* CONNECTING_NET   */ 1000,
+  /* CONNECTING_CLOUD */ 15000,     // DNS and TLS handshake
+  /* RUNNING          */ 2000,
+  /* OTA_UPGRADE      */ 0,         // the whole download, fed on progress
+  /* SWITCH_TO_STA    */ 1000,
+  /* RESET_CONFIG     */ 5000,      // erases flash
+  /* ERROR            */ 1000,
+  /* loop             */ 0,
+  /* app              */ 500,
+  /* Blynk.run        */ 2000,
+  /* portal           */ 2000,
+  /* wifi_scan        */ 20000,     // the first scan is waited for
+};
+
+static_assert(sizeof(WatchdogBudget) / sizeof(WatchdogBudget[0]) == WDT_PHASE_MAX,
+              "A budget is needed for every phase");
+
+static inline
+const char* watchdog_phase_name(uint8_t phase)
+{
+  if (phase < MODE_MAX_VALUE) {
+    return StateStr[phase];
+  } else if (phase < WDT_PHASE_MAX) {
+    return WatchdogPhaseStr[phase - WDT_PHASE_LOOP];
+  }
+  return "unknown";
+}
+
+#if defined(WATCHDOG_ENABLE)
+
+#define WATCHDOG_MAGIC      (0x61d0a3c5 + sizeof(WatchdogState))
+
+struct WatchdogState {
+  uint32_t magic;
+  uint8_t  phase;                   // innermost phase running
+  uint8_t  state;                   // BlynkState at the time
+  uint64_t since;                   // uptime when the phase started, ms
+  uint32_t hungFor;                 // ms in the phase, set by the WDT interrupt
+
+  uint32_t resets;                  // by a watchdog
+  struct {
+    uint8_t  phase;
+    uint8_t  state;
+    uint16_t boot;                  // resetCount.total, low bits
+    uint32_t hungFor;               // ms, 0 if not known
+    bool     reported;
+  } last;
+
+  uint32_t slow[WDT_PHASE_MAX];     // over budget
+  uint32_t worst[WDT_PHASE_MAX];    // ms
+};
+
+BLYNK_NOINIT_ATTR
+static WatchdogState watchdogState;
+
+static TaskHandle_t watchdogTask = NULL;
+
+// Called by the task WDT interrupt before the panic (IDF 4.3+)
+extern "C" IRAM_ATTR
+void esp_task_wdt_isr_user_handler(void)
+{
+  watchdogState.hungFor = esp_timer_get_time() / 1000 - watchdogState.since;
+}
+
+class WatchdogScope {
+public:
+  explicit WatchdogScope(uint8_t phase)
+    : phase(phase)
+    , prevPhase(watchdogState.phase)
+    , prevSince(watchdogState.since)
+    , started(millis())
+  {
+    watchdogState.phase = phase;
+    watchdogState.state = BlynkState::get();
+    watchdogState.since = systemUptime();
+  }
+
+  ~WatchdogScope() {
+    const uint32_t spent = millis() - started;
+    const uint32_t budget = WatchdogBudget[phase];
+    if (budget && spent > budget) {
+      watchdogState.slow[phase]++;
+      DEBUG_PRINT(String("Slow ") + watchdog_phase_name(phase) + ": " + spent + " ms, budget " + budget + " ms");
+    }
+    if (spent > watchdogState.worst[phase]) {
+      watchdogState.worst[phase] = spent;
+    }
+    watchdogState.phase = prevPhase;
+    watchdogState.since = prevSince;
+  }
+
+private:
+  const uint8_t  phase;
+  const uint8_t  prevPhase;
+  const uint64_t prevSince;
+  const uint32_t started;
+};
+
+static
+void watchdog_init()
+{
+  if (watchdogState.magic != WATCHDOG_MAGIC) {
+    memset(&watchdogState, 0, sizeof(watchdogState));
+    watchdogState.magic = WATCHDOG_MAGIC;
+  } else {
+    const esp_reset_reason_t reason = esp_reset_reason();
+    if (reason == ESP_RST_TASK_WDT || reason == ESP_RST_INT_WDT ||
+        reason == ESP_RST_WDT || watchdogState.hungFor)
+    {
+      watchdogState.resets++;
+      watchdogState.last.phase    = watchdogState.phase;
+      watchdogState.last.state    = watchdogState.state;
+      watchdogState.last.boot     = systemStats.resetCount.total - 1;
+      watchdogState.last.hungFor  = watchdogState.hungFor;
+      watchdogState.last.reported = false;
+      DEBUG_PRINT(String("Watchdog reset in ") + watchdog_phase_name(watchdogState.phase) +
+                  " (" + StateStr[BlynkMin(watchdogState.state, (uint8_t)MODE_MAX_VALUE)] + ")");
+    }
+  }
+  watchdogState.phase   = WDT_PHASE_LOOP;
+  watchdogState.since   = systemUptime();
+  watchdogState.hungFor = 0;
+
+  // Reconfigures the WDT the Arduino core has started
+  esp_task_wdt_init(WATCHDOG_TIMEOUT, true);
+}
+
+// Called from the supervised task. The first call subscribes it,
+// calls from other tasks (the async portal) are ignored
+static
+void watchdog_feed()
+{
+  const TaskHandle_t task = xTaskGetCurrentTaskHandle();
+  if (!watchdogTask) {
+    watchdogTask = task;
+    esp_task_wdt_add(watchdogTask);
+  } else if (task != watchdogTask) {
+    return;
+  }
+  esp_task_wdt_reset();
+}
+
+// Sends the last watchdog reset once, called when connected
+static
+void watchdog_report()
+{
+  if (!watchdogState.resets || watchdogState.last.reported) {
+    return;
+  }
+  String msg = String("Watchdog reset in ") + watchdog_phase_name(watchdogState.last.phase) +
+               " (" + StateStr[BlynkMin(watchdogState.last.state, (uint8_t)MODE_MAX_VALUE)] + ")";
+  if (watchdogState.last.hungFor) {
+    msg += String(" after ") + watchdogState.last.hungFor + " ms";
+  }
+  Blynk.logEvent("sys_wdt", msg);
+  watchdogState.last.reported = true;
+}
+
+static
+void watchdog_clear()
+{
+  watchdogState.resets = 0;
+  memset(&watchdogState.last,  0, sizeof(watchdogState.last));
+  memset(&watchdogState.slow,  0, sizeof(watchdogState.slow));
+  memset(&watchdogState.worst, 0, sizeof(watchdogState.worst));
+}
+
+static
+void watchdog_print(Stream& out)
+{
+  out.println(String("Task WDT: ") + WATCHDOG_TIMEOUT + " s, " + watchdogState.resets + " resets");
+  if (watchdogState.resets) {
+    out.println(String("Last: boot ") + watchdogState.last.boot + ", in " +
+                watchdog_phase_name(watchdogState.last.phase) + " (" +
+                StateStr[BlynkMin(watchdogState.last.state, (uint8_t)MODE_MAX_VALUE)] + "), " +
+                watchdogState.last.hungFor + " ms");
+  }
+  out.println(F("Phase               budget   worst    slow"));
+  for (int p = 0; p < WDT_PHASE_MAX; p++) {
+    char line[64];
+    snprintf(line, sizeof(line), "%-16s %9lu %7lu %7lu",
+             watchdog_phase_name(p), (unsigned long)WatchdogBudget[p],
+             (unsigned long)watchdogState.worst[p], (unsigned long)watchdogState.slow[p]);
+    out.println(line);
+  }
+}
+
+#else
+
+class WatchdogScope {
+public:
+  explicit WatchdogScope(uint8_t) {}
+};
+
+static
+void watchdog_init()
+{
+}
+
+static
+void watchdog_feed()
+{
+}
+
+static
+void watchdog_report()
+{
+}
+
+#endif
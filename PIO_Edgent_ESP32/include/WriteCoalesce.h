@@ -0,0 +1,214 @@
+
+/*
+ * Coalescing of outgoing virtual pin writes.
+ *
+ * BlynkEdgent.virtualWrite() only keeps the latest value of each pin.
+ * runBlynkWithChecks() sends the changed pins at most every
+ * WRITE_COALESCE_WINDOW ms, in one group, so a sensor loop writing at 100 Hz
+ * does not run into the cloud rate limit. Per pin, writePolicy() can add:
+ *
+ *   minInterval  - ms between two sends of the pin (the latest value wins)
+ *   deadband     - a value closer than this to the last sent one is dropped
+ *
+ * While offline, the pins are kept until connected, or stored as they fall
+ * due with OFFLINE_BUFFER_ENABLE (see OfflineBuffer.h).
+ *
+ * A write longer than WRITE_COALESCE_SIZE is sent right away, also offline
+ * (where Blynk drops it). Blynk.virtualWrite() still sends right away.
+ * See "sys writes".
+ */
+
+#define WRITE_COALESCE_PINS   16        // pins tracked, others are sent right away
+#define WRITE_COALESCE_SIZE   64        // encoded "vw", pin and values
+
+struct CoalescedPin {
+  bool     used;
+  bool     dirty;
+  uint16_t pin;
+  uint8_t  len;
+  char     cmd[WRITE_COALESCE_SIZE];
+  float    sentValue;
+  uint32_t sentAt;                      // millis()
+  uint32_t minInterval;
+  float    deadband;
+};
+
+static CoalescedPin writeCoalesce[WRITE_COALESCE_PINS];
+static uint32_t     writeCoalesceFlushed = 0;
+
+static struct {
+  uint32_t writes;                      // virtualWrite() calls
+  uint32_t sent;
+  uint32_t coalesced;                   // overwritten before being sent
+  uint32_t deadband;                    // dropped as too close to the last sent value
+  uint32_t direct;                      // sent right away, no free slot or too long
+  uint32_t offline;                     // went to the offline buffer instead
+  uint32_t batches;
+} writeCoalesceStats;
+
+static
+CoalescedPin* write_coalesce_slot(int pin)
+{
+  CoalescedPin* empty = NULL;
+  for (CoalescedPin& p : writeCoalesce) {
+    if (p.used && p.pin == pin) {
+      return &p;
+    } else if (!p.used && !empty) {
+      empty = &p;
+    }
+  }
+  if (empty) {
+    memset(empty, 0, sizeof(CoalescedPin));
+    empty->used = true;
+    empty->pin  = pin;
+  }
+  return empty;
+}
+
+// First value of an encoded write, for the deadband
+static
+float write_coalesce_value(const char* cmd, size_t len)
+{
+  const char* end = cmd + len;
+  const char* v = cmd + strlen(cmd) + 1;    // skip "vw"
+  if (v < end) {
+    v += strlen(v) + 1;                     // skip the pin
+  }
+  return (v < end) ? atof(v) : 0;
+}
+
+static
+void write_coalesce_set_policy(int pin, uint32_t minInterval, float deadband)
+{
+  if (CoalescedPin* p = write_coalesce_slot(pin)) {
+    p->minInterval = minInterval;
+    p->deadband    = deadband;
+  }
+}
+
+// Takes an encoded write (as built by BlynkParam, without the last '\0')
+static
+void write_coalesce_put(int pin, const char* cmd, size_t len)
+{
+  writeCoalesceStats.writes++;
+  CoalescedPin* p = write_coalesce_slot(pin);
+  if (!p || len > sizeof(p->cmd)) {
+    writeCoalesceStats.direct++;
+    if (Blynk.connected()) {
+      Blynk.sendCmd(BLYNK_CMD_HARDWARE, 0, cmd, len);
+    } else {
+      offline_buffer_append(cmd, len);
+    }
+    return;
+  }
+  if (p->dirty) {
+    writeCoalesceStats.coalesced++;
+  }
+  memcpy(p->cmd, cmd, len);
+  p->len   = len;
+  p->dirty = true;
+}
+
+// BlynkParam silently drops a value that does not fit its buffer, and cuts
+// a number short. True if the encoded write has all its fields, uncut
+static
+bool write_coalesce_encoded(const char* buf, size_t len, size_t size, size_t fields)
+{
+  if (len >= size) {
+    return false;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    n += (buf[i] == '\0');
+  }
+  return n == fields;
+}
+
+template <typename... Args>
+void write_coalesce_add(int pin, Args... values)
+{
+  char mem[WRITE_COALESCE_SIZE + 16];
+  BlynkParam cmd(mem, 0, sizeof(mem));
+  cmd.add("vw");
+  cmd.add(pin);
+  cmd.add_multi(values...);
+  if (!write_coalesce_encoded(mem, cmd.getLength(), sizeof(mem), 2 + sizeof...(values))) {
+    // Too long to keep, Blynk encodes it in its own, larger buffer
+    writeCoalesceStats.writes++;
+    writeCoalesceStats.direct++;
+    Blynk.virtualWrite(pin, values...);
+    return;
+  }
+  write_coalesce_put(pin, (const char*)cmd.getBuffer(), cmd.getLength() - 1);
+}
+
+// Sends the pins that are due. Offline, they go to the offline buffer.
+// force sends every pending pin, ignoring the window and minInterval
+static
+void write_coalesce_flush(bool force = false)
+{
+  const bool online = Blynk.connected();
+  if (!online && !offline_buffer_ready()) {
+    return; // Keep them until connected
+  }
+  const uint32_t now = millis();
+  if (!force && now - writeCoalesceFlushed < WRITE_COALESCE_WINDOW) {
+    return;
+  }
+  writeCoalesceFlushed = now;
+
+  bool grouped = false;
+  for (CoalescedPin& p : writeCoalesce) {
+    if (!p.dirty || (!force && p.sentAt && now - p.sentAt < p.minInterval)) {
+      continue;
+    }
+    const float value = write_coalesce_value(p.cmd, p.len);
+    p.dirty = false;
+    if (p.sentAt && p.deadband > 0 && fabsf(value - p.sentValue) < p.deadband) {
+      writeCoalesceStats.deadband++;
+      continue;
+    }
+    if (!online) {
+      offline_buffer_append(p.cmd, p.len);
+      writeCoalesceStats.offline++;
+    } else {
+      if (!grouped) {
+        Blynk.beginGroup();
+        grouped = true;
+      }
+      Blynk.sendCmd(BLYNK_CMD_HARDWARE, 0, p.cmd, p.len);
+      writeCoalesceStats.sent++;
+    }
+    p.sentValue = value;
+    p.sentAt = now | 1;
+  }
+  if (grouped) {
+    Blynk.endGroup();
+    writeCoalesceStats.batches++;
+  }
+}
+
+static
+void write_coalesce_clear_stats()
+{
+  memset(&writeCoalesceStats, 0, sizeof(writeCoalesceStats));
+}
+
+static
+void write_coalesce_print(Stream& out)
+{
+  out.println(String("Writes: ") + writeCoalesceStats.writes +
+              ", sent " + writeCoalesceStats.sent +
+              " in " + writeCoalesceStats.batches + " batches" +
+              ", direct " + writeCoalesceStats.direct +
+              ", offline " + writeCoalesceStats.offline);
+  out.println(String("Suppressed: ") + (writeCoalesceStats.coalesced + writeCoalesceStats.deadband) +
+              " (coalesced " + writeCoalesceStats.coalesced +
+              ", deadband " + writeCoalesceStats.deadband + ")");
+  for (const CoalescedPin& p : writeCoalesce) {
+    if (p.used) {
+      out.println(String(" V") + p.pin + (p.dirty ? " pending" : "") +
+                  ", min interval " + p.minInterval + " ms, deadband " + p.deadband);
+    }
+  }
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""
+Latency of the captive portal DNS under a burst of queries.
+
+Join the device's SoftAP, then:
+
+    python3 test/dns_burst.py [--host 192.168.4.1] [--burst 32] [--rounds 10]
+
+Each round sends --burst A queries for distinct connectivity-check names
+back to back, like a phone joining the AP, then collects the replies.
+Prints the reply latency percentiles and the number of lost queries.
+"""
+
+import argparse
+import random
+import socket
+import struct
+import time
+
+NAMES = [
+    "connectivitycheck.gstatic.com",
+    "www.google.com",
+    "captive.apple.com",
+    "www.apple.com",
+    "www.msftconnecttest.com",
+    "clients3.google.com",
+    "detectportal.firefox.com",
+    "connectivity-check.ubuntu.com",
+]
+
+
+def query(qid, name):
+    header = struct.pack(">HHHHHH", qid, 0x0100, 1, 0, 0, 0)
+    labels = b"".join(bytes([len(p)]) + p.encode() for p in name.split("."))
+    return header + labels + b"\x00" + struct.pack(">HH", 1, 1)
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    k = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[k]
+
+
+def run_round(sock, addr, burst, timeout):
+    sent = {}
+    base = random.randrange(0, 0x10000 - burst)
+    for i in range(burst):
+        qid = base + i
+        sock.sendto(query(qid, NAMES[i % len(NAMES)]), addr)
+        sent[qid] = time.monotonic()
+
+    latencies = []
+    deadline = time.monotonic() + timeout
+    while sent and time.monotonic() < deadline:
+        sock.settimeout(max(0.001, deadline - time.monotonic()))
+        try:
+            data, _ = sock.recvfrom(512)
+        except socket.timeout:
+            break
+        if len(data) < 12:
+            continue
+        qid = struct.unpack(">H", data[:2])[0]
+        if qid in sent:
+            latencies.append((time.monotonic() - sent.pop(qid)) * 1000)
+    return latencies, len(sent)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--port", type=int, default=53)
+    parser.add_argument("--burst", type=int, default=32)
+    parser.add_argument("--rounds", type=int, default=10)
+    parser.add_argument("--timeout", type=float, default=2.0, help="s per round")
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    addr = (args.host, args.port)
+    latencies = []
+    lost = 0
+    for _ in range(args.rounds):
+        got, missing = run_round(sock, addr, args.burst, args.timeout)
+        latencies += got
+        lost += missing
+        time.sleep(0.2)
+
+    total = args.burst * args.rounds
+    print("%d rounds of %d queries: %d answered, %d lost" % (args.rounds, args.burst, len(latencies), lost))
+    print("latency ms: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f" % (
+        percentile(latencies, 50), percentile(latencies, 90),
+        percentile(latencies, 99), max(latencies or [0])))
+    return 0 if lost < total else 1
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
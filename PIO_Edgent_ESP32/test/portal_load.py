@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""
+Load test of the provisioning portal.
+
+Join the device's SoftAP, then:
+
+    python3 test/portal_load.py [--host 192.168.4.1] [--clients 4] [--time 20]
+
+Each client fetches the portal paths in turn over keep-alive connections,
+like a phone loading the page. Prints requests per second and latency
+percentiles, per path and overall. Compare the sync portal with
+WIFI_ASYNC_PORTAL_ENABLE on the same device and AP channel.
+"""
+
+import argparse
+import http.client
+import threading
+import time
+
+PATHS = [
+    "/",
+    "/board_info.json",
+    "/wifi_scan.json",
+    "/update/progress",
+]
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    k = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[k]
+
+
+def client(host, port, paths, deadline, results, errors, lock):
+    conn = None
+    i = 0
+    while time.monotonic() < deadline:
+        path = paths[i % len(paths)]
+        i += 1
+        try:
+            if conn is None:
+                conn = http.client.HTTPConnection(host, port, timeout=10)
+            started = time.monotonic()
+            conn.request("GET", path)
+            resp = conn.getresponse()
+            resp.read()
+            elapsed = (time.monotonic() - started) * 1000
+            if resp.status >= 400:
+                raise http.client.HTTPException("HTTP %d" % resp.status)
+            if resp.getheader("Connection", "").lower() == "close":
+                conn.close()
+                conn = None
+            with lock:
+                results.setdefault(path, []).append(elapsed)
+        except (OSError, http.client.HTTPException) as e:
+            with lock:
+                errors[path] = errors.get(path, 0) + 1
+            if conn is not None:
+                conn.close()
+                conn = None
+            time.sleep(0.1)
+    if conn is not None:
+        conn.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--host", default="192.168.4.1")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--clients", type=int, default=4)
+    parser.add_argument("--time", type=float, default=20, help="seconds")
+    parser.add_argument("--path", action="append", help="replaces the default paths")
+    args = parser.parse_args()
+
+    paths = args.path or PATHS
+    results = {}
+    errors = {}
+    lock = threading.Lock()
+    deadline = time.monotonic() + args.time
+    threads = [
+        threading.Thread(target=client,
+                         args=(args.host, args.port, paths[n % len(paths):] + paths[:n % len(paths)],
+                               deadline, results, errors, lock))
+        for n in range(args.clients)
+    ]
+    started = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - started
+
+    print("%d clients, %.1f s" % (args.clients, elapsed))
+    print("%-20s %7s %7s %8s %8s %8s %6s" % ("path", "count", "req/s", "p50 ms", "p99 ms", "max ms", "errors"))
+    total = []
+    for path in paths:
+        values = results.get(path, [])
+        total += values
+        print("%-20s %7d %7.1f %8.1f %8.1f %8.1f %6d" % (
+            path, len(values), len(values) / elapsed,
+            percentile(values, 50), percentile(values, 99), max(values or [0]), errors.get(path, 0)))
+    print("%-20s %7d %7.1f %8.1f %8.1f %8.1f %6d" % (
+        "all", len(total), len(total) / elapsed,
+        percentile(total, 50), percentile(total, 99), max(total or [0]), sum(errors.values())))
+
+
+if __name__ == "__main__":
+    main()
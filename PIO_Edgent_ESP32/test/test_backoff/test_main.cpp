@@ -0,0 +1,160 @@
+/*
+ * Fleet simulation of the reconnect backoff (Backoff.h), on the host:
+ *
+ *   pio test -e native
+ *
+ * FLEET_SIZE devices lose the cloud at t=0, it comes back at OUTAGE_TIME.
+ * Every device retries on its own cloudBackoff, attempts made during the
+ * outage fail after ATTEMPT_TIME. The arrival of the devices after the
+ * outage is printed as a histogram, and compared with a fixed retry period.
+ */
+
+#include <unity.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <random>
+#include <vector>
+
+template <class T>
+const T& BlynkMin(const T& a, const T& b) { return (b < a) ? b : a; }
+
+static uint32_t simNow = 0;
+uint32_t millis() { return simNow; }
+
+static std::mt19937 simRandom;
+uint32_t backoffRandom() { return simRandom(); }
+
+#include "Backoff.h"
+
+#define CLOUD_BACKOFF_BASE    5000        // as WIFI_CLOUD_BACKOFF_BASE
+#define CLOUD_BACKOFF_CAP     300000      // as WIFI_CLOUD_BACKOFF_CAP
+
+#define FLEET_SIZE            10000
+#define OUTAGE_TIME           600000      // ms
+#define ATTEMPT_TIME          2000        // ms for a failed connect
+#define BUCKET                10000       // ms of the histogram
+
+// Time the device is connected again, retrying with Backoff
+static
+uint32_t simulate_device(uint32_t* attempts)
+{
+  Backoff backoff(CLOUD_BACKOFF_BASE, CLOUD_BACKOFF_CAP);
+  uint32_t t = 0;
+  *attempts = 0;
+  while (true) {
+    simNow = t;
+    const uint32_t wait = backoff.fail();
+    TEST_ASSERT_TRUE(wait <= CLOUD_BACKOFF_CAP);
+
+    // waiting() is true until the scheduled time, then false
+    if (wait > 1) {
+      simNow = t + wait - 1;
+      TEST_ASSERT_TRUE(backoff.waiting());
+    }
+    t += wait;
+    simNow = t;
+    TEST_ASSERT_FALSE(backoff.waiting());
+
+    (*attempts)++;
+    if (t >= OUTAGE_TIME) {
+      return t;
+    }
+    t += ATTEMPT_TIME;
+  }
+}
+
+static
+uint32_t max_per_bucket(const std::vector<uint32_t>& arrivals, uint32_t bucket)
+{
+  std::vector<uint32_t> hist;
+  for (uint32_t t : arrivals) {
+    const size_t b = (t - OUTAGE_TIME) / bucket;
+    if (hist.size() <= b) {
+      hist.resize(b + 1);
+    }
+    hist[b]++;
+  }
+  uint32_t peak = 0;
+  for (uint32_t n : hist) {
+    if (n > peak) {
+      peak = n;
+    }
+  }
+  return peak;
+}
+
+void test_first_retry_is_uniform()
+{
+  simRandom.seed(1);
+  Backoff backoff(CLOUD_BACKOFF_BASE, CLOUD_BACKOFF_CAP);
+  uint64_t total = 0;
+  for (int i = 0; i < FLEET_SIZE; i++) {
+    backoff.reset();
+    const uint32_t wait = backoff.fail();
+    TEST_ASSERT_TRUE(wait <= CLOUD_BACKOFF_BASE);
+    total += wait;
+  }
+  // Mean of U[0, base] is base/2
+  TEST_ASSERT_UINT32_WITHIN(CLOUD_BACKOFF_BASE / 20, CLOUD_BACKOFF_BASE / 2, total / FLEET_SIZE);
+}
+
+void test_delay_is_capped()
+{
+  simRandom.seed(2);
+  Backoff backoff(CLOUD_BACKOFF_BASE, CLOUD_BACKOFF_CAP);
+  for (int i = 0; i < 300; i++) {
+    TEST_ASSERT_TRUE(backoff.fail() <= CLOUD_BACKOFF_CAP);
+  }
+  TEST_ASSERT_EQUAL_UINT8(255, backoff.attempts());
+}
+
+void test_fleet_after_outage()
+{
+  simRandom.seed(3);
+  std::vector<uint32_t> arrivals;
+  uint64_t attemptsTotal = 0;
+  for (int i = 0; i < FLEET_SIZE; i++) {
+    uint32_t attempts;
+    arrivals.push_back(simulate_device(&attempts));
+    attemptsTotal += attempts;
+  }
+
+  uint32_t last = 0;
+  for (uint32_t t : arrivals) {
+    last = (t > last) ? t : last;
+  }
+
+  char line[96];
+  snprintf(line, sizeof(line), "%d devices, outage %d s: %.1f attempts each, all back after %.1f s",
+           FLEET_SIZE, OUTAGE_TIME / 1000, (double)attemptsTotal / FLEET_SIZE, (last - OUTAGE_TIME) / 1000.0);
+  TEST_MESSAGE(line);
+
+  std::vector<uint32_t> hist((last - OUTAGE_TIME) / BUCKET + 1);
+  for (uint32_t t : arrivals) {
+    hist[(t - OUTAGE_TIME) / BUCKET]++;
+  }
+  for (size_t b = 0; b < hist.size(); b++) {
+    snprintf(line, sizeof(line), "+%3u s %5u %.*s", (unsigned)(b * BUCKET / 1000), hist[b],
+             (int)BlynkMin((uint32_t)60, hist[b] * 200 / FLEET_SIZE), "############################################################");
+    TEST_MESSAGE(line);
+  }
+
+  // Nobody waits longer than one failed attempt and one capped delay
+  TEST_ASSERT_TRUE(last - OUTAGE_TIME <= ATTEMPT_TIME + CLOUD_BACKOFF_CAP);
+
+  // With a fixed retry period, the whole fleet arrives in the same second.
+  // With jitter, no second gets more than 1% of it
+  const uint32_t peak = max_per_bucket(arrivals, 1000);
+  snprintf(line, sizeof(line), "Peak: %u devices in one second (fixed period: %d)", peak, FLEET_SIZE);
+  TEST_MESSAGE(line);
+  TEST_ASSERT_TRUE(peak <= FLEET_SIZE / 100);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_first_retry_is_uniform);
+  RUN_TEST(test_delay_is_capped);
+  RUN_TEST(test_fleet_after_outage);
+  return UNITY_END();
+}
@@ -0,0 +1,227 @@
+/*
+ * Portal event stream (PortalEvents.h, the WebServer one), on the host:
+ *
+ *   pio test -e native
+ *
+ * WiFiClient and the web server are stand-ins: a client keeps what is
+ * printed to it, copies share the connection like on the device.
+ * Checks the SSE framing, and what the ring of queued states sends after
+ * it overflowed.
+ */
+
+#include <unity.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define F(s)        (s)
+#define HTTP_GET    1
+
+template <class T>
+const T& BlynkMin(const T& a, const T& b) { return (b < a) ? b : a; }
+
+static uint32_t simNow = 0;
+uint32_t millis() { return simNow; }
+
+struct Connection {
+  bool        open = true;
+  std::string out;
+};
+
+class WiFiClient {
+public:
+  bool connected() { return conn && conn->open; }
+  void setNoDelay(bool) {}
+  size_t print(const char* s) { conn->out += s; return strlen(s); }
+  void stop() {
+    if (conn) {
+      conn->open = false;
+    }
+  }
+  std::shared_ptr<Connection> conn;
+};
+
+static struct {
+  void on(const char*, int, void (*handler)()) { events = handler; }
+  void send(int code, const char*, const char*) { lastCode = code; }
+  WiFiClient client() { return current; }
+
+  void (*events)() = NULL;
+  WiFiClient current;
+  int lastCode = 0;
+} server;
+
+static struct {
+  int last_error;
+} configStore;
+
+#include "BlynkState.h"
+#include "PortalEvents.h"
+
+void BlynkState::set(State m, StateReason) { state = m; }
+
+// A new client on GET /events
+static std::shared_ptr<Connection> subscribe()
+{
+  server.current.conn = std::make_shared<Connection>();
+  server.lastCode = 0;
+  server.events();
+  return server.current.conn;
+}
+
+// Events in the stream, without the HTTP header
+static std::vector<std::string> events(const std::string& out)
+{
+  std::vector<std::string> result;
+  size_t pos = out.find("\r\n\r\n");
+  pos = (pos == std::string::npos) ? 0 : pos + 4;
+  while (pos < out.size()) {
+    const size_t end = out.find("\n\n", pos);
+    TEST_ASSERT_TRUE(end != std::string::npos);
+    if (end == std::string::npos) {
+      break;
+    }
+    result.push_back(out.substr(pos, end - pos));
+    pos = end + 2;
+  }
+  return result;
+}
+
+static std::string event(uint32_t id, const char* state, int error = 0)
+{
+  char buff[128];
+  snprintf(buff, sizeof(buff), "id: %u\nevent: state\ndata: {\"state\":\"%s\",\"last_error\":%d}",
+           id, state, error);
+  return buff;
+}
+
+static void reset()
+{
+  portal_events_close();
+  portalEventHead = portalEventTail = portalEventId = 0;
+  configStore.last_error = 0;
+  BlynkState::state = MODE_WAIT_CONFIG;
+  portal_events_begin();
+}
+
+void test_subscribe_sends_header_and_state()
+{
+  reset();
+  std::shared_ptr<Connection> c = subscribe();
+
+  const std::string& out = c->out;
+  TEST_ASSERT_TRUE(out.find("HTTP/1.1 200 OK\r\n") == 0);
+  TEST_ASSERT_TRUE(out.find("Content-Type: text/event-stream\r\n") != std::string::npos);
+  TEST_ASSERT_TRUE(out.find("Cache-Control: no-store\r\n") != std::string::npos);
+
+  std::vector<std::string> e = events(out);
+  TEST_ASSERT_EQUAL_UINT32(2, e.size());
+  TEST_ASSERT_EQUAL_STRING("retry: 2000", e[0].c_str());
+  TEST_ASSERT_EQUAL_STRING(event(0, "WAIT_CONFIG").c_str(), e[1].c_str());
+}
+
+void test_state_changes_in_order()
+{
+  reset();
+  std::shared_ptr<Connection> c = subscribe();
+  c->out.clear();
+
+  portal_events_push(MODE_CONFIGURING);
+  configStore.last_error = 3;
+  portal_events_push(MODE_CONNECTING_NET);
+  TEST_ASSERT_EQUAL_UINT32(0, c->out.size());     // Only sent from the loop
+  portal_events_run();
+
+  std::vector<std::string> e = events(c->out);
+  TEST_ASSERT_EQUAL_UINT32(2, e.size());
+  TEST_ASSERT_EQUAL_STRING(event(1, "CONFIGURING", 3).c_str(), e[0].c_str());
+  TEST_ASSERT_EQUAL_STRING(event(2, "CONNECTING_NET", 3).c_str(), e[1].c_str());
+
+  c->out.clear();
+  portal_events_run();
+  TEST_ASSERT_EQUAL_UINT32(0, c->out.size());
+}
+
+void test_overflow_keeps_the_latest()
+{
+  reset();
+  std::shared_ptr<Connection> c = subscribe();
+  c->out.clear();
+
+  // More changes than the ring holds before the loop runs
+  const State seq[] = { MODE_CONFIGURING, MODE_CONNECTING_NET, MODE_CONNECTING_CLOUD, MODE_RUNNING };
+  const int pushed = PORTAL_EVENTS_QUEUE + 5;
+  for (int i = 0; i < pushed; i++) {
+    portal_events_push(seq[i % 4]);
+  }
+  portal_events_run();
+
+  std::vector<std::string> e = events(c->out);
+  TEST_ASSERT_EQUAL_UINT32(PORTAL_EVENTS_QUEUE, e.size());
+  for (int i = 0; i < PORTAL_EVENTS_QUEUE; i++) {
+    const int n = pushed - PORTAL_EVENTS_QUEUE + i;
+    TEST_ASSERT_EQUAL_STRING(event(i + 1, StateStr[seq[n % 4]]).c_str(), e[i].c_str());
+  }
+
+  // Ids go on from there, and the ring is usable again
+  c->out.clear();
+  portal_events_push(MODE_ERROR);
+  portal_events_run();
+  e = events(c->out);
+  TEST_ASSERT_EQUAL_UINT32(1, e.size());
+  TEST_ASSERT_EQUAL_STRING(event(PORTAL_EVENTS_QUEUE + 1, "ERROR").c_str(), e[0].c_str());
+}
+
+void test_late_subscriber_gets_current_state()
+{
+  reset();
+  portal_events_push(MODE_CONFIGURING);
+  portal_events_run();
+  BlynkState::state = MODE_CONFIGURING;
+
+  std::shared_ptr<Connection> c = subscribe();
+  std::vector<std::string> e = events(c->out);
+  TEST_ASSERT_EQUAL_UINT32(2, e.size());
+  TEST_ASSERT_EQUAL_STRING(event(1, "CONFIGURING").c_str(), e[1].c_str());
+}
+
+void test_subscriber_limit_and_ping()
+{
+  reset();
+  std::shared_ptr<Connection> clients[PORTAL_EVENTS_MAX_CLIENTS];
+  for (auto& c : clients) {
+    c = subscribe();
+    TEST_ASSERT_EQUAL_INT(0, server.lastCode);
+  }
+  subscribe();
+  TEST_ASSERT_EQUAL_INT(503, server.lastCode);
+
+  // A closed connection frees its slot
+  clients[0]->open = false;
+  clients[0] = subscribe();
+  TEST_ASSERT_EQUAL_INT(0, server.lastCode);
+
+  clients[1]->out.clear();
+  simNow += PORTAL_EVENTS_PING_INTERVAL;
+  portal_events_run();
+  TEST_ASSERT_EQUAL_STRING(": ping\n\n", clients[1]->out.c_str());
+
+  portal_events_end();
+  for (auto& c : clients) {
+    TEST_ASSERT_FALSE(c->open);
+  }
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_subscribe_sends_header_and_state);
+  RUN_TEST(test_state_changes_in_order);
+  RUN_TEST(test_overflow_keeps_the_latest);
+  RUN_TEST(test_late_subscriber_gets_current_state);
+  RUN_TEST(test_subscriber_limit_and_ping);
+  return UNITY_END();
+}
@@ -0,0 +1,175 @@
+/*
+ * State transitions (BlynkState.h, StateTrace.h), on the host:
+ *
+ *   pio test -e native
+ *
+ * Walks every (from, to) pair through state_trace_transition(), the check
+ * of BlynkState::set(), against the transitions listed below: the allowed
+ * ones must be accepted and traced, the others rejected and counted.
+ */
+
+#include <unity.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#define BLYNK_NOINIT_ATTR
+#define DEBUG_PRINT(...)
+#define F(s)                            (s)
+
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED    0
+#define portENTER_CRITICAL_SAFE(mux)    (void)(mux)
+#define portEXIT_CRITICAL_SAFE(mux)     (void)(mux)
+
+template <class T>
+const T& BlynkMin(const T& a, const T& b) { return (b < a) ? b : a; }
+
+class String {
+public:
+  String(const char* s = "") : s(s) {}
+  template <typename T>
+  String operator+(const T& v) const { return String((s + std::to_string(v)).c_str()); }
+  String operator+(const char* v) const { return String((s + v).c_str()); }
+private:
+  std::string s;
+};
+
+class Stream {
+public:
+  void println(const char*) {}
+  void println(const String&) {}
+};
+
+static uint64_t simUptime = 0;
+uint64_t systemUptime() { return simUptime; }
+
+static struct {
+  struct {
+    uint32_t total;
+  } resetCount;
+} systemStats;
+
+#include "BlynkState.h"
+#include "StateTrace.h"
+
+// The transitions Edgent makes, with who makes them
+static const State Allowed[][2] = {
+  { MODE_MAX_VALUE,        MODE_WAIT_CONFIG      },   // begin(), no config
+  { MODE_MAX_VALUE,        MODE_CONNECTING_NET   },   // begin(), configured
+  { MODE_MAX_VALUE,        MODE_ERROR            },
+  { MODE_WAIT_CONFIG,      MODE_CONFIGURING      },   // phone asks for board info
+  { MODE_WAIT_CONFIG,      MODE_CONNECTING_NET   },   // AP+STA check of new credentials
+  { MODE_WAIT_CONFIG,      MODE_SWITCH_TO_STA    },
+  { MODE_WAIT_CONFIG,      MODE_RESET_CONFIG     },
+  { MODE_WAIT_CONFIG,      MODE_ERROR            },
+  { MODE_CONFIGURING,      MODE_WAIT_CONFIG      },   // phone left the AP
+  { MODE_CONFIGURING,      MODE_CONNECTING_NET   },
+  { MODE_CONFIGURING,      MODE_SWITCH_TO_STA    },   // /config
+  { MODE_CONFIGURING,      MODE_RESET_CONFIG     },
+  { MODE_CONFIGURING,      MODE_ERROR            },
+  { MODE_CONNECTING_NET,   MODE_WAIT_CONFIG      },   // credentials rejected
+  { MODE_CONNECTING_NET,   MODE_CONNECTING_CLOUD },
+  { MODE_CONNECTING_NET,   MODE_SWITCH_TO_STA    },
+  { MODE_CONNECTING_NET,   MODE_RESET_CONFIG     },
+  { MODE_CONNECTING_NET,   MODE_ERROR            },   // out of retries
+  { MODE_CONNECTING_CLOUD, MODE_WAIT_CONFIG      },   // token rejected
+  { MODE_CONNECTING_CLOUD, MODE_CONNECTING_NET   },   // WiFi lost
+  { MODE_CONNECTING_CLOUD, MODE_RUNNING          },
+  { MODE_CONNECTING_CLOUD, MODE_OTA_UPGRADE      },
+  { MODE_CONNECTING_CLOUD, MODE_SWITCH_TO_STA    },
+  { MODE_CONNECTING_CLOUD, MODE_RESET_CONFIG     },
+  { MODE_CONNECTING_CLOUD, MODE_ERROR            },   // out of retries
+  { MODE_RUNNING,          MODE_WAIT_CONFIG      },
+  { MODE_RUNNING,          MODE_CONNECTING_NET   },   // WiFi lost
+  { MODE_RUNNING,          MODE_CONNECTING_CLOUD },   // cloud lost
+  { MODE_RUNNING,          MODE_OTA_UPGRADE      },
+  { MODE_RUNNING,          MODE_SWITCH_TO_STA    },
+  { MODE_RUNNING,          MODE_RESET_CONFIG     },   // button
+  { MODE_OTA_UPGRADE,      MODE_WAIT_CONFIG      },
+  { MODE_OTA_UPGRADE,      MODE_SWITCH_TO_STA    },
+  { MODE_OTA_UPGRADE,      MODE_RESET_CONFIG     },
+  { MODE_OTA_UPGRADE,      MODE_ERROR            },   // update failed
+  { MODE_SWITCH_TO_STA,    MODE_WAIT_CONFIG      },
+  { MODE_SWITCH_TO_STA,    MODE_CONNECTING_NET   },
+  { MODE_SWITCH_TO_STA,    MODE_RESET_CONFIG     },
+  { MODE_RESET_CONFIG,     MODE_WAIT_CONFIG      },
+  { MODE_RESET_CONFIG,     MODE_SWITCH_TO_STA    },
+  { MODE_ERROR,            MODE_WAIT_CONFIG      },
+  { MODE_ERROR,            MODE_SWITCH_TO_STA    },
+  { MODE_ERROR,            MODE_RESET_CONFIG     },
+};
+
+static bool expected(unsigned from, unsigned to)
+{
+  for (const auto& t : Allowed) {
+    if (t[0] == from && t[1] == to) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void test_every_transition()
+{
+  state_trace_clear();
+  uint32_t accepted = 0;
+  uint32_t rejected = 0;
+  char line[96];
+
+  for (unsigned from = 0; from <= MODE_MAX_VALUE; from++) {
+    for (unsigned to = 0; to <= MODE_MAX_VALUE; to++) {
+      if (from == to) {
+        continue; // BlynkState::set() ignores it
+      }
+      simUptime += 1000;
+      const bool ok = state_trace_transition((State)from, (State)to, REASON_NONE);
+      snprintf(line, sizeof(line), "%s => %s", StateStr[from], StateStr[to]);
+      if (expected(from, to)) {
+        TEST_ASSERT_TRUE_MESSAGE(ok, line);
+        accepted++;
+        const StateTraceEntry& e = stateTrace.entries[(stateTrace.head - 1) % STATE_TRACE_SIZE];
+        TEST_ASSERT_TRUE_MESSAGE(e.from == from && e.to == to, line);
+      } else {
+        TEST_ASSERT_FALSE_MESSAGE(ok, line);
+        rejected++;
+      }
+      TEST_ASSERT_EQUAL_UINT32(accepted, stateTrace.head);
+      TEST_ASSERT_EQUAL_UINT32(rejected, stateTrace.rejected);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(sizeof(Allowed) / sizeof(Allowed[0]), accepted);
+}
+
+void test_init_is_never_a_target()
+{
+  for (unsigned from = 0; from <= MODE_MAX_VALUE; from++) {
+    TEST_ASSERT_FALSE(state_transition_allowed(from, MODE_MAX_VALUE));
+  }
+}
+
+void test_reason_and_time_are_traced()
+{
+  simUptime = 0;
+  state_trace_clear();
+  simUptime = 5000;
+  TEST_ASSERT_TRUE(state_trace_transition(MODE_RUNNING, MODE_CONNECTING_CLOUD, REASON_CLOUD_LOST));
+  simUptime = 7500;
+  TEST_ASSERT_TRUE(state_trace_transition(MODE_CONNECTING_CLOUD, MODE_RUNNING, REASON_NONE));
+
+  const StateTraceEntry& e = stateTrace.entries[0];
+  TEST_ASSERT_EQUAL_UINT32(5000, e.time);
+  TEST_ASSERT_EQUAL_UINT32(REASON_CLOUD_LOST, e.reason);
+  TEST_ASSERT_EQUAL_UINT32(2500, stateTrace.timeIn[MODE_CONNECTING_CLOUD]);
+  TEST_ASSERT_EQUAL_UINT32(1, stateTrace.visits[MODE_RUNNING]);
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_every_transition);
+  RUN_TEST(test_init_is_never_a_target);
+  RUN_TEST(test_reason_and_time_are_traced);
+  return UNITY_END();
+}
@@ -0,0 +1,186 @@
+/*
+ * Write coalescing (WriteCoalesce.h), on the host:
+ *
+ *   pio test -e native
+ *
+ * BlynkParam and Blynk are stand-ins that encode like Blynk 1.3.2:
+ * a string that does not fit is dropped, a number is cut short.
+ * The commands Blynk would send are recorded in sent.
+ */
+
+#include <unity.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define WRITE_COALESCE_WINDOW   100
+#define BLYNK_MAX_SENDBYTES     128
+#define BLYNK_CMD_HARDWARE      20
+
+static uint32_t simNow = 0;
+uint32_t millis() { return simNow; }
+
+class String {
+public:
+  String(const char* s = "") : s(s) {}
+  template <typename T>
+  String operator+(const T& v) const {
+    std::ostringstream out;
+    out << s << v;
+    return String(out.str().c_str());
+  }
+  String operator+(const String& v) const { return String((s + v.s).c_str()); }
+  const char* c_str() const { return s.c_str(); }
+private:
+  std::string s;
+};
+
+class Stream {
+public:
+  void println(const String&) {}
+};
+
+class BlynkParam {
+public:
+  BlynkParam(void* addr, size_t length, size_t buffsize)
+    : buff((char*)addr), len(length), buff_size(buffsize) {}
+
+  const void* getBuffer() const { return buff; }
+  size_t getLength() const { return len; }
+
+  void add(const void* b, size_t l) {
+    if (len + l > buff_size) {
+      return;
+    }
+    memcpy(buff + len, b, l);
+    len += l;
+  }
+  void add(const char* str) { add(str, strlen(str) + 1); }
+  void add(int value)       { len += snprintf(buff + len, buff_size - len, "%i", value) + 1; }
+  void add(float value)     { len += snprintf(buff + len, buff_size - len, "%2.3f", value) + 1; }
+
+  template <typename T>
+  void add_multi(T last) { add(last); }
+  template <typename T, typename... Args>
+  void add_multi(T head, Args... tail) { add(head); add_multi(tail...); }
+
+private:
+  char*  buff;
+  size_t len;
+  size_t buff_size;
+};
+
+static std::vector<std::string> sent;
+
+static struct {
+  bool connected() { return true; }
+  void beginGroup() {}
+  void endGroup() {}
+  void sendCmd(uint8_t, uint16_t, const char* data, size_t len) { sent.push_back(std::string(data, len)); }
+
+  template <typename... Args>
+  void virtualWrite(int pin, Args... values) {
+    char mem[BLYNK_MAX_SENDBYTES];
+    BlynkParam cmd(mem, 0, sizeof(mem));
+    cmd.add("vw");
+    cmd.add(pin);
+    cmd.add_multi(values...);
+    sendCmd(BLYNK_CMD_HARDWARE, 0, (const char*)cmd.getBuffer(), cmd.getLength() - 1);
+  }
+} Blynk;
+
+bool offline_buffer_ready() { return false; }
+bool offline_buffer_append(const char*, size_t) { return false; }
+
+#include "WriteCoalesce.h"
+
+static std::string encoded(int pin, const char* value)
+{
+  std::string cmd("vw");
+  cmd += '\0';
+  cmd += std::to_string(pin);
+  cmd += '\0';
+  cmd += value;
+  return cmd;
+}
+
+static void reset()
+{
+  memset(writeCoalesce, 0, sizeof(writeCoalesce));
+  write_coalesce_clear_stats();
+  sent.clear();
+  simNow += 1000;
+}
+
+void test_latest_value_wins()
+{
+  reset();
+  write_coalesce_add(1, "a");
+  write_coalesce_add(1, "b");
+  TEST_ASSERT_EQUAL_UINT32(0, sent.size());
+  write_coalesce_flush();
+  TEST_ASSERT_EQUAL_UINT32(1, sent.size());
+  TEST_ASSERT_TRUE(sent[0] == encoded(1, "b"));
+  TEST_ASSERT_EQUAL_UINT32(1, writeCoalesceStats.coalesced);
+}
+
+void test_long_string_is_sent_whole()
+{
+  reset();
+  const std::string text(100, 'x');
+  write_coalesce_add(5, text.c_str());
+
+  // Not kept cut short in a slot, sent right away as Blynk encodes it
+  TEST_ASSERT_EQUAL_UINT32(1, sent.size());
+  TEST_ASSERT_TRUE(sent[0] == encoded(5, text.c_str()));
+  TEST_ASSERT_EQUAL_UINT32(1, writeCoalesceStats.direct);
+  write_coalesce_flush();
+  TEST_ASSERT_EQUAL_UINT32(1, sent.size());
+}
+
+void test_long_string_after_a_value()
+{
+  reset();
+  const std::string text(100, 'y');
+  write_coalesce_add(6, 42, text.c_str());
+
+  std::string expected = encoded(6, "42");
+  expected += '\0';
+  expected += text;
+  TEST_ASSERT_EQUAL_UINT32(1, sent.size());
+  TEST_ASSERT_TRUE(sent[0] == expected);
+}
+
+void test_over_slot_size_is_sent_whole()
+{
+  // Fits the encoding buffer, not the slot
+  reset();
+  const std::string text(WRITE_COALESCE_SIZE, 'z');
+  write_coalesce_add(7, text.c_str());
+  TEST_ASSERT_EQUAL_UINT32(1, sent.size());
+  TEST_ASSERT_TRUE(sent[0] == encoded(7, text.c_str()));
+}
+
+void test_encoded_check()
+{
+  const char full[] = "vw\0" "1\0" "abc";
+  TEST_ASSERT_TRUE(write_coalesce_encoded(full, sizeof(full), 64, 3));
+  TEST_ASSERT_FALSE(write_coalesce_encoded(full, sizeof(full), 64, 4));
+  TEST_ASSERT_FALSE(write_coalesce_encoded(full, sizeof(full), sizeof(full), 3));
+}
+
+int main(int argc, char** argv)
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_latest_value_wins);
+  RUN_TEST(test_long_string_is_sent_whole);
+  RUN_TEST(test_long_string_after_a_value);
+  RUN_TEST(test_over_slot_size_is_sent_whole);
+  RUN_TEST(test_encoded_check);
+  return UNITY_END();
+}
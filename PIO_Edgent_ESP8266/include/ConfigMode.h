@@ -2,7 +2,9 @@
 #include <ESP8266WiFi.h>
 #include <ESP8266WebServer.h>
 #include <ESP8266HTTPUpdateServer.h>
-#include <DNSServer.h>
+
+#include "CaptiveDns.h"
+#include "Backoff.h"
 
 static const char configForm[] PROGMEM = R"html(
 <!DOCTYPE HTML>
@@ -52,11 +54,14 @@ static const char configForm[] PROGMEM = R"html(
 
 ESP8266WebServer server(80);
 ESP8266HTTPUpdateServer httpUpdater;
-DNSServer dnsServer;
-const byte DNS_PORT = 53;
 
 static int connectNetRetries    = WIFI_CLOUD_MAX_RETRIES;
 static int connectBlynkRetries  = WIFI_CLOUD_MAX_RETRIES;
+static Backoff netBackoff(WIFI_NET_BACKOFF_BASE, WIFI_NET_BACKOFF_CAP);
+static Backoff cloudBackoff(WIFI_CLOUD_BACKOFF_BASE, WIFI_CLOUD_BACKOFF_CAP);
+static uint32_t portalEnteredAt = 0;
+static bool portalActive = false;       // AP, DNS and HTTP server are up
+static bool portalValidating = false;   // STA join attempted with the portal still up
 
 static inline
 String macToString(byte mac[6]) {
@@ -98,36 +103,134 @@ String getWiFiNetworkBSSID() {
   return WiFi.BSSIDstr();
 }
 
+#include "JsonWriter.h"
+#include "PortalAssets.h"
+#include "ScanCache.h"
+#include "PortalEvents.h"
+
+// Answers 304 if the client already has this version
+static
+bool portalNotModified(const String& etag)
+{
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Cache-Control", "no-cache");
+  if (server.header("If-None-Match") == etag) {
+    server.send(304);
+    return true;
+  }
+  return false;
+}
+
+#ifdef BLYNK_FS
+static
+void portalServeAsset(const PortalAsset& asset)
+{
+  if (portalNotModified(asset.etag)) {
+    return;
+  }
+  File file = BLYNK_FS.open(asset.file, FILE_READ);
+  if (!file) {
+    server.send(404);
+    return;
+  }
+  // Adds Content-Encoding: gzip for *.gz files
+  server.streamFile(file, asset.type);
+}
+#endif
+
+// Reports the time from entering config mode to the first HTTP request.
+// Never handles anything itself, so it is registered before all others
+class PortalFirstRequest : public ESP8266WebServer::RequestHandlerType {
+public:
+  bool canHandle(HTTPMethod method, const String& uri) override {
+    if (portalEnteredAt) {
+      DEBUG_PRINT(String("First request after ") + (millis() - portalEnteredAt) + " ms: " + uri);
+      portalEnteredAt = 0;
+    }
+    return false;
+  }
+};
+
 static
 void handleRoot() {
+  if (portalNotModified(portalFormETag())) {
+    return;
+  }
   server.send(200, "text/html", configForm);
 }
 
-void enterConfigMode()
+// Called once a new configuration is accepted by /config
+static
+void portalSwitchToSTA()
+{
+#if defined(WIFI_AP_STA_VALIDATE_ENABLE)
+  portalValidating = true;
+  BlynkState::set(MODE_CONNECTING_NET, REASON_CONFIG);
+#else
+  BlynkState::set(MODE_SWITCH_TO_STA, REASON_CONFIG);
+#endif
+}
+
+#if defined(WIFI_AP_STA_VALIDATE_ENABLE)
+// Progress of the credential check, polled by the phone after /config
+static
+void portalWriteConfigStatus(JsonWriter& json)
+{
+  const char* status;
+  if (!portalValidating) {
+    status = configStore.last_error ? "failed" : "idle";
+  } else if (BlynkState::is(MODE_CONNECTING_NET)) {
+    status = "connecting_net";
+  } else if (BlynkState::is(MODE_CONNECTING_CLOUD)) {
+    status = "connecting_cloud";
+  } else {
+    status = "connected";
+  }
+  json.beginObject()
+        .member("status", status)
+        .member("last_error", configStore.last_error)
+      .endObject();
+}
+#endif
+
+static
+bool portalStart()
 {
+  const uint32_t entered = millis();
+  portalEnteredAt = entered;
+
+  // WiFi.mode() waits for the mode switch itself
   WiFi.mode(WIFI_OFF);
-  delay(100);
   WiFi.mode(WIFI_AP_STA);
   WiFi.softAPConfig(WIFI_AP_IP, WIFI_AP_IP, WIFI_AP_Subnet);
   WiFi.softAP(systemGetDeviceName().c_str());
-  delay(500);
 
+  // Wait for the AP address instead of a fixed delay
   IPAddress myIP = WiFi.softAPIP();
+  while (myIP == (uint32_t)0 && millis() - entered < WIFI_AP_START_TIMEOUT) {
+    delay(10);
+    myIP = WiFi.softAPIP();
+  }
   if (myIP == (uint32_t)0)
   {
-    config_set_last_error(BLYNK_PROV_ERR_INTERNAL);
-    BlynkState::set(MODE_ERROR);
-    return;
+    return false;
   }
 
+  static PortalFirstRequest* firstRequest = NULL;
+  if (!firstRequest) {
+    firstRequest = new PortalFirstRequest();
+    server.addHandler(firstRequest);
+  }
+
+  static const char* headers[] = { "If-None-Match" };
+  server.collectHeaders(headers, 1);
+
   // Set up DNS Server
-  dnsServer.setTTL(300); // Time-to-live 300s
-  dnsServer.setErrorReplyCode(DNSReplyCode::ServerFailure); // Return code for non-accessible domains
 #ifdef WIFI_CAPTIVE_PORTAL_ENABLE
-  dnsServer.start(DNS_PORT, "*", WiFi.softAPIP()); // Point all to our IP
+  captive_dns_start(WiFi.softAPIP(), "*"); // Point all to our IP
   server.onNotFound(handleRoot);
 #else
-  dnsServer.start(DNS_PORT, CONFIG_AP_URL, WiFi.softAPIP());
+  captive_dns_start(WiFi.softAPIP(), CONFIG_AP_URL);
   DEBUG_PRINT(String("AP URL:  ") + CONFIG_AP_URL);
 #endif
 
@@ -202,7 +305,9 @@ void enterConfigMode()
       server.send(200, "application/json", content);
 
       connectNetRetries = connectBlynkRetries = 1;
-      BlynkState::set(MODE_SWITCH_TO_STA);
+      netBackoff.reset();
+      cloudBackoff.reset();
+      portalSwitchToSTA();
     } else {
       DEBUG_PRINT("Configuration invalid");
       content = R"json({"status":"error","msg":"Configuration invalid"})json";
@@ -211,79 +316,50 @@ void enterConfigMode()
   });
   server.on("/board_info.json", []() {
     // Configuring starts with board info request (may impact indication)
-    BlynkState::set(MODE_CONFIGURING);
+    if (BlynkState::is(MODE_WAIT_CONFIG)) {
+      BlynkState::set(MODE_CONFIGURING);
+    }
 
     DEBUG_PRINT("Sending board info...");
     const char* tmpl = BLYNK_TEMPLATE_ID;
 
-    char buff[512];
-    snprintf(buff, sizeof(buff),
-      R"json({"board":"%s","tmpl_id":"%s","fw_type":"%s","fw_ver":"%s","ssid":"%s","bssid":"%s","mac":"%s","last_error":%d,"wifi_scan":true,"static_ip":true})json",
-      BLYNK_TEMPLATE_NAME,
-      tmpl ? tmpl : "Unknown",
-      BLYNK_FIRMWARE_TYPE,
-      BLYNK_FIRMWARE_VERSION,
-      systemGetDeviceName().c_str(),
-      getWiFiApBSSID().c_str(),
-      getWiFiMacAddress().c_str(),
-      configStore.last_error
-    );
-    server.send(200, "application/json", buff);
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    json.beginObject()
+          .member("board", BLYNK_TEMPLATE_NAME)
+          .member("tmpl_id", tmpl ? tmpl : "Unknown")
+          .member("fw_type", BLYNK_FIRMWARE_TYPE)
+          .member("fw_ver", BLYNK_FIRMWARE_VERSION)
+          .member("ssid", systemGetDeviceName())
+          .member("bssid", getWiFiApBSSID())
+          .member("mac", getWiFiMacAddress())
+          .member("last_error", configStore.last_error)
+          .member("wifi_scan", true)
+          .member("static_ip", true)
+        .endObject();
   });
+#if defined(WIFI_AP_STA_VALIDATE_ENABLE)
+  server.on("/config_status.json", []() {
+    server.sendHeader("Cache-Control", "no-store");
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    portalWriteConfigStatus(json);
+  });
+#endif
+  portal_events_begin();
   server.on("/wifi_scan.json", []() {
-    DEBUG_PRINT("Scanning networks...");
-    int wifi_nets = WiFi.scanNetworks(true, true);
-    const uint32_t t = millis();
-    while (wifi_nets < 0 &&
-           millis() - t < 20000)
-    {
-      delay(20);
-      wifi_nets = WiFi.scanComplete();
+    if (server.arg("refresh").toInt()) {
+      scanCache.requested = true;
     }
-    DEBUG_PRINT(String("Found networks: ") + wifi_nets);
-
-    if (wifi_nets > 0) {
-      // Sort networks
-      int indices[wifi_nets];
-      for (int i = 0; i < wifi_nets; i++) {
-        indices[i] = i;
-      }
-      for (int i = 0; i < wifi_nets; i++) {
-        for (int j = i + 1; j < wifi_nets; j++) {
-          if (WiFi.RSSI(indices[j]) > WiFi.RSSI(indices[i])) {
-            std::swap(indices[i], indices[j]);
-          }
-        }
-      }
-
-      wifi_nets = BlynkMin(15, wifi_nets); // Show top 15 networks
-
-      // TODO: skip empty names
-      server.setContentLength(CONTENT_LENGTH_UNKNOWN);
-      server.send(200, "application/json", "[\n");
-
-      char buff[256];
-      for (int i = 0; i < wifi_nets; i++){
-        int id = indices[i];
-
-        snprintf(buff, sizeof(buff),
-          R"json(  {"ssid":"%s","bssid":"%s","rssi":%i,"sec":"%s","ch":%i,"hidden":%d})json",
-          WiFi.SSID(id).c_str(),
-          WiFi.BSSIDstr(id).c_str(),
-          WiFi.RSSI(id),
-          wifiSecToStr(WiFi.encryptionType(id)),
-          WiFi.channel(id),
-          WiFi.isHidden(id)
-        );
-
-        server.sendContent(buff);
-        if (i != wifi_nets-1) server.sendContent(",\n");
-      }
-      WiFi.scanDelete();
-      server.sendContent("\n]");
-    } else {
-      server.send(200, "application/json", "[]");
+    if (!scanCache.valid) {
+      // Only the very first scan is waited for
+      scan_cache_wait(20000);
     }
+    server.sendHeader("Age", scan_cache_age());
+    server.sendHeader("Cache-Control", "no-store");
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    scan_cache_write(json);
   });
   server.on("/reset", []() {
     BlynkState::set(MODE_RESET_CONFIG);
@@ -295,9 +371,13 @@ void enterConfigMode()
   });
 
 #ifdef BLYNK_FS
-  if (BLYNK_FS.exists("/index.html")) {
+  if (portalAssetsInit()) {
+    for (const PortalAsset& asset : portalAssets) {
+      if (asset.etag.length()) {
+        server.on(asset.uri, HTTP_GET, [&asset]() { portalServeAsset(asset); });
+      }
+    }
     server.serveStatic("/img", BLYNK_FS, "/img");
-    server.serveStatic("/", BLYNK_FS, "/index.html");
   } else
 #endif
   { /* if no BLYNK_FS or index.html not found */
@@ -305,25 +385,117 @@ void enterConfigMode()
   }
 
   server.begin();
+  scan_cache_start();
+  portalActive = true;
+  DEBUG_PRINT(String("Portal ready in ") + (millis() - entered) + " ms");
+  return true;
+}
+
+static
+void portalShutdown()
+{
+  portal_events_end();
+  server.stop();
+  scan_cache_end();
+  captive_dns_stop();
+  portalActive = false;
+}
+
+// Keeps the portal responsive while the STA join is being checked
+static
+void portalValidateRun()
+{
+  if (portalValidating) {
+    captive_dns_run();
+    server.handleClient();
+    portal_events_run();
+  }
+}
+
+// Wrong credentials: drop the STA side and go back to the (still running) portal
+static
+void portalValidateFailed(int error)
+{
+  DEBUG_PRINT("Configuration check failed");
+  config_set_last_error(error);
+  WiFi.disconnect();
+  WiFi.enableSTA(false);
+  portalValidating = false;
+  BlynkState::set(MODE_WAIT_CONFIG);
+}
+
+// Cloud login succeeded: let the phone fetch the result, then close the AP
+static
+void portalValidateDone()
+{
+  const uint32_t t = millis();
+  while (millis() - t < WIFI_AP_STA_LINGER_TIME && BlynkState::is(MODE_RUNNING)) {
+    delay(10);
+    captive_dns_run();
+    server.handleClient();
+    portal_events_run();
+    Blynk.run();
+    app_loop();
+  }
+  portalValidating = false;
+  portalShutdown();
+  WiFi.softAPdisconnect(true);
+}
+
+void enterConfigMode()
+{
+  if (portalActive) {
+    DEBUG_PRINT("Back to portal"); // after a failed credential check
+  } else if (!portalStart()) {
+    config_set_last_error(BLYNK_PROV_ERR_INTERNAL);
+    BlynkState::set(MODE_ERROR);
+    return;
+  }
 
   while (BlynkState::is(MODE_WAIT_CONFIG) || BlynkState::is(MODE_CONFIGURING)) {
     delay(10);
-    dnsServer.processNextRequest();
+    captive_dns_run();
     server.handleClient();
+    portal_events_run();
+    scan_cache_run();
     app_loop();
     if (BlynkState::is(MODE_CONFIGURING) && WiFi.softAPgetStationNum() == 0) {
       BlynkState::set(MODE_WAIT_CONFIG);
     }
   }
+}
 
-  server.stop();
+// Exit hook of WAIT_CONFIG and CONFIGURING. The portal stays up while
+// the new credentials are checked (WIFI_AP_STA_VALIDATE_ENABLE)
+void exitConfigMode()
+{
+  if (portalActive && !portalValidating) {
+    portalShutdown();
+  }
+}
+
+// Waits for the scheduled reconnect, keeping timers and console alive.
+// Returns false if the state was changed meanwhile
+static
+bool backoffWait(Backoff& backoff, State state)
+{
+  while (backoff.waiting()) {
+    delay(10);
+    app_loop();
+    if (!BlynkState::is(state)) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void enterConnectNet() {
-  BlynkState::set(MODE_CONNECTING_NET);
+  if (!backoffWait(netBackoff, MODE_CONNECTING_NET)) {
+    return;
+  }
   DEBUG_PRINT(String("Connecting to WiFi: ") + configStore.wifiSSID);
 
-  WiFi.mode(WIFI_STA);
+  WiFi.mode(portalValidating ? WIFI_AP_STA : WIFI_STA);
 
   String hostname = systemGetDeviceName();
   hostname.replace(" ", "-");
@@ -337,13 +509,26 @@ void enterConnectNet() {
                     configStore.staticDNS2)
     ) {
       DEBUG_PRINT("Failed to configure Static IP");
+      if (portalValidating) {
+        portalValidateFailed(BLYNK_PROV_ERR_CONFIG);
+        return;
+      }
       config_set_last_error(BLYNK_PROV_ERR_CONFIG);
       BlynkState::set(MODE_ERROR);
       return;
     }
   }
 
-  if (!WiFi.begin(configStore.wifiSSID, configStore.wifiPass)) {
+  // Join the scanned AP directly. The SoftAP follows to its channel
+  const ScanRecord* net = portalValidating ? scan_cache_find(configStore.wifiSSID) : NULL;
+  if (!WiFi.begin(configStore.wifiSSID, configStore.wifiPass,
+                  net ? net->channel : 0, net ? net->bssid : NULL))
+  {
+    DEBUG_PRINT("WiFi.begin failed");
+    if (portalValidating) {
+      portalValidateFailed(BLYNK_PROV_ERR_CONFIG);
+      return;
+    }
     config_set_last_error(BLYNK_PROV_ERR_CONFIG);
     BlynkState::set(MODE_ERROR);
     return;
@@ -354,11 +539,19 @@ void enterConnectNet() {
   {
     delay(10);
     app_loop();
+    portalValidateRun();
 
     if (!BlynkState::is(MODE_CONNECTING_NET)) {
       WiFi.disconnect();
       return;
     }
+    // Report wrong credentials right away instead of waiting for the timeout
+    const wl_status_t status = WiFi.status();
+    if (portalValidating &&
+        (status == WL_CONNECT_FAILED || status == WL_NO_SSID_AVAIL || status == WL_WRONG_PASSWORD))
+    {
+      break;
+    }
   }
 
   if (WiFi.status() == WL_CONNECTED) {
@@ -370,15 +563,23 @@ void enterConnectNet() {
     }
 
     connectNetRetries = WIFI_CLOUD_MAX_RETRIES;
+    netBackoff.reset();
     BlynkState::set(MODE_CONNECTING_CLOUD);
+  } else if (portalValidating) {
+    portalValidateFailed(BLYNK_PROV_ERR_NETWORK);
   } else if (--connectNetRetries <= 0) {
     config_set_last_error(BLYNK_PROV_ERR_NETWORK);
-    BlynkState::set(MODE_ERROR);
+    BlynkState::set(MODE_ERROR, REASON_NET_FAILED);
+  } else {
+    WiFi.disconnect(); // Stop the driver from retrying on its own
+    DEBUG_PRINT(String("Next WiFi attempt in ") + netBackoff.fail() + " ms");
   }
 }
 
 void enterConnectCloud() {
-  BlynkState::set(MODE_CONNECTING_CLOUD);
+  if (!backoffWait(cloudBackoff, MODE_CONNECTING_CLOUD)) {
+    return;
+  }
 
   Blynk.config(configStore.cloudToken, configStore.cloudHost, configStore.cloudPort);
   Blynk.connect(0);
@@ -392,6 +593,7 @@ void enterConnectCloud() {
     delay(10);
     Blynk.run();
     app_loop();
+    portalValidateRun();
     if (!BlynkState::is(MODE_CONNECTING_CLOUD)) {
       Blynk.disconnect();
       return;
@@ -402,14 +604,18 @@ void enterConnectCloud() {
     DEBUG_PRINT("Timeout");
   }
 
-  if (Blynk.isTokenInvalid()) {
+  if (Blynk.isTokenInvalid() && portalValidating) {
+    Blynk.disconnect();
+    portalValidateFailed(BLYNK_PROV_ERR_TOKEN);
+  } else if (Blynk.isTokenInvalid()) {
     config_set_last_error(BLYNK_PROV_ERR_TOKEN);
-    BlynkState::set(MODE_WAIT_CONFIG); // TODO: retry after timeout
+    BlynkState::set(MODE_WAIT_CONFIG, REASON_TOKEN); // TODO: retry after timeout
   } else if (WiFi.status() != WL_CONNECTED) {
-    BlynkState::set(MODE_CONNECTING_NET);
+    BlynkState::set(MODE_CONNECTING_NET, REASON_NET_LOST);
   } else if (Blynk.connected()) {
     BlynkState::set(MODE_RUNNING);
     connectBlynkRetries = WIFI_CLOUD_MAX_RETRIES;
+    cloudBackoff.reset();
 
     if (0 != strcmp(configStore.version, BLYNK_FIRMWARE_VERSION)) {
       Blynk.logEvent("sys_ota", String("Firmware updated to ") + BLYNK_FIRMWARE_VERSION);
@@ -425,15 +631,23 @@ void enterConnectCloud() {
       Blynk.sendInternal("meta", "set", "Hotspot Name", systemGetDeviceName());
       Blynk.sendInternal("meta", "set", "Network",      configStore.wifiSSID);
     }
+
+    if (portalValidating) {
+      portalValidateDone();
+    }
+  } else if (portalValidating) {
+    Blynk.disconnect();
+    portalValidateFailed(BLYNK_PROV_ERR_CLOUD);
   } else if (--connectBlynkRetries <= 0) {
     config_set_last_error(BLYNK_PROV_ERR_CLOUD);
-    BlynkState::set(MODE_ERROR);
+    BlynkState::set(MODE_ERROR, REASON_CLOUD_FAILED);
+  } else {
+    Blynk.disconnect();
+    DEBUG_PRINT(String("Next cloud attempt in ") + cloudBackoff.fail() + " ms");
   }
 }
 
 void enterSwitchToSTA() {
-  BlynkState::set(MODE_SWITCH_TO_STA);
-
   DEBUG_PRINT("Switching to STA...");
 
   delay(1000);
@@ -445,8 +659,6 @@ void enterSwitchToSTA() {
 }
 
 void enterError() {
-  BlynkState::set(MODE_ERROR);
-
   unsigned long timeoutMs = millis() + 10000;
   while (timeoutMs > millis() || g_buttonPressed)
   {
@@ -6,8 +6,9 @@ BlynkConsole    edgentConsole;
 void console_init()
 {
 #ifdef BLYNK_PRINT
-  edgentConsole.begin(BLYNK_PRINT);
+  remoteConsoleStream.begin(&BLYNK_PRINT);
 #endif
+  edgentConsole.begin(remoteConsoleStream);
 
   edgentConsole.print("\n>");
 
@@ -17,14 +18,15 @@ void console_init()
   });
 
   edgentConsole.addCommand("devinfo", []() {
-    edgentConsole.printf(
-        R"json({"name":"%s","board":"%s","tmpl_id":"%s","fw_type":"%s","fw_ver":"%s"})json" "\n",
-        systemGetDeviceName().c_str(),
-        BLYNK_TEMPLATE_NAME,
-        BLYNK_TEMPLATE_ID,
-        BLYNK_FIRMWARE_TYPE,
-        BLYNK_FIRMWARE_VERSION
-    );
+    JsonWriter json(edgentConsole.getStream());
+    json.beginObject()
+          .member("name", systemGetDeviceName())
+          .member("board", BLYNK_TEMPLATE_NAME)
+          .member("tmpl_id", BLYNK_TEMPLATE_ID)
+          .member("fw_type", BLYNK_FIRMWARE_TYPE)
+          .member("fw_ver", BLYNK_FIRMWARE_VERSION)
+        .endObject();
+    edgentConsole.print("\n");
   });
 
   edgentConsole.addCommand("connect", [](int argc, const char** argv) {
@@ -156,30 +158,101 @@ void console_init()
       if (!param[1].isValid() || cmd == "show") {
         edgentConsole.printf("CPU freq: %lu MHz\n", ESP.getCpuFreqMHz());
       }
+    } else if (tool == "writes") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        write_coalesce_clear_stats();
+      } else {
+        write_coalesce_print(edgentConsole.getStream());
+      }
+#if defined(OFFLINE_BUFFER_ENABLE)
+    } else if (tool == "offline") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        offline_buffer_clear();
+      } else if (cmd == "bench") {
+        offline_buffer_benchmark(edgentConsole.getStream());
+      } else {
+        offline_buffer_print(edgentConsole.getStream());
+      }
+#endif
+#if defined(LOOP_PROFILER_ENABLE)
+    } else if (tool == "perf") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        profiler_clear();
+      } else if (cmd == "send") {
+        profiler_send();
+      } else {
+        profiler_print(edgentConsole.getStream());
+      }
+#endif
+    } else if (tool == "remote") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        remote_console_clear();
+      } else {
+        remote_console_print(edgentConsole.getStream());
+      }
+    } else if (tool == "states") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        state_trace_clear();
+      } else {
+        state_trace_print(edgentConsole.getStream());
+      }
     } else if (tool == "drop_stats") {
       systemStats.clear();
     } else {
-      edgentConsole.getStream().println(F("Available commands: powersave [show|on|off], nodelay [show|on|off], cpufreq, drop_stats"));
+      Stream& out = edgentConsole.getStream();
+      out.print(F("Available commands: powersave [show|on|off], nodelay [show|on|off], cpufreq, writes [show|clear]"));
+#if defined(OFFLINE_BUFFER_ENABLE)
+      out.print(F(", offline [show|clear|bench]"));
+#endif
+#if defined(LOOP_PROFILER_ENABLE)
+      out.print(F(", perf [show|clear|send]"));
+#endif
+      out.println(F(", remote [show|clear], states [show|clear], drop_stats"));
     }
   });
 
 #ifdef BLYNK_FS
 
+  // Hashes come from the index (see FileIndex.h), "ls -v" computes them again
   edgentConsole.addCommand("ls", [](int argc, const char** argv) {
+    const bool verify = (argc >= 1) && !strcmp(argv[0], "-v");
+    if (verify) {
+      argc--;
+      argv++;
+    }
     const char* path = (argc < 1) ? "/" : argv[0];
     Dir dir = BLYNK_FS.openDir(path);
     while (dir.next()) {
       File f = dir.openFile(FILE_READ);
+      // LittleFS gives the name in the directory, SPIFFS the full path
+      String fn = dir.fileName();
+      if (!fn.startsWith("/")) {
+        fn = String(path) + (String(path).endsWith("/") ? "" : "/") + fn;
+      }
 
-      MD5Builder md5;
-      md5.begin();
-      md5.addStream(f, f.size());
-      md5.calculate();
-      String md5str = md5.toString();
+      uint8_t md5[16];
+      char    md5str[9] = "";
+      if (!dir.isDirectory()) {
+        if (verify) {
+          file_index_hash(fn, f, md5);
+        }
+        if (verify || file_index_get(fn, f, md5)) {
+          snprintf(md5str, sizeof(md5str), "%02x%02x%02x%02x", md5[0], md5[1], md5[2], md5[3]);
+        } else {
+          strcpy(md5str, "-"); // Not indexed, or changed since
+        }
+      }
 
       edgentConsole.printf("%8d %-24s %s\n",
-                            f.size(), dir.fileName().c_str(),
-                            md5str.substring(0,8).c_str());
+                            f.size(), dir.fileName().c_str(), md5str);
+    }
+    if (verify) {
+      file_index_save();
     }
   });
 
@@ -189,6 +262,7 @@ void console_init()
     for (int i=0; i<argc; i++) {
       const char* fn = argv[i];
       if (BLYNK_FS.remove(fn)) {
+        file_index_remove(fn);
         edgentConsole.printf("Removed %s\n", fn);
       } else {
         edgentConsole.printf("Removing %s failed\n", fn);
@@ -201,6 +275,8 @@ void console_init()
 
     if (!BLYNK_FS.rename(argv[0], argv[1])) {
       edgentConsole.print("Rename failed\n");
+    } else {
+      file_index_rename(argv[0], argv[1]);
     }
   });
 
@@ -213,8 +289,9 @@ void console_init()
     }
 
     if (File f = BLYNK_FS.open(argv[0], FILE_READ)) {
-      while (f.available()) {
-        edgentConsole.print((char)f.read());
+      uint8_t buf[256];
+      while (size_t n = f.read(buf, sizeof(buf))) {
+        edgentConsole.getStream().write(buf, n);
       }
       edgentConsole.print("\n");
     } else {
@@ -229,16 +306,48 @@ void console_init()
       if (!f.print(argv[0])) {
         edgentConsole.print("Cannot write file\n");
       }
+      f.close();
+      file_index_update(argv[1]);
     } else {
       edgentConsole.print("Cannot open file\n");
     }
   });
 
+  // Block transfer, see FileTransfer.h
+  edgentConsole.addCommand("get", [](int argc, const char** argv) {
+    if (argc < 1) {
+      file_transfer_abort();
+      return;
+    }
+    file_transfer_get(edgentConsole.getStream(), argv[0], (argc > 1) ? strtoul(argv[1], NULL, 10) : 0);
+  });
+
+  edgentConsole.addCommand("ack", [](int argc, const char** argv) {
+    if (argc != 1) return;
+
+    file_transfer_ack(strtoul(argv[0], NULL, 10));
+  });
+
+  edgentConsole.addCommand("put", [](int argc, const char** argv) {
+    if (argc != 3) {
+      file_transfer_abort();
+      return;
+    }
+    file_transfer_put(edgentConsole.getStream(), argv[0], strtoul(argv[1], NULL, 10), strtoul(argv[2], NULL, 16));
+  });
+
+  edgentConsole.addCommand("d", [](int argc, const char** argv) {
+    if (argc != 3) return;
+
+    file_transfer_data(edgentConsole.getStream(), strtoul(argv[0], NULL, 10), strtoul(argv[1], NULL, 16), argv[2]);
+  });
+
 #endif
 
 }
 
 BLYNK_WRITE(InternalPinDBG) {
+  remote_console_begin();
   String cmd = String(param.asStr()) + "\n";
   edgentConsole.runCommand((char*)cmd.c_str());
 }
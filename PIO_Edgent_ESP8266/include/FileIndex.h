@@ -0,0 +1,199 @@
+
+/*
+ * MD5 index of the files on BLYNK_FS.
+ *
+ * Hashing every file made "ls" stall the loop for seconds on a full
+ * partition. The index keeps the MD5 of each file with the size and last
+ * write time it was computed for, in FILE_INDEX_PATH. Where the filesystem
+ * keeps no write time (or the clock was not set when the file was written),
+ * a CRC32 of the first FILE_INDEX_HEAD bytes stands in for it. Files written
+ * through Edgent (console echo, mv, rm) update it, and the portal takes its
+ * ETags from it. "ls" only shows fresh entries, "ls -v" hashes everything
+ * again.
+ *
+ * Entries are keyed by the CRC32 of the path. When full, the entry hashed
+ * longest ago is replaced (the stamps are saved with the index).
+ */
+
+#ifdef BLYNK_FS
+
+#include <MD5Builder.h>
+
+#define FILE_INDEX_PATH     "/.fileindex"
+#define FILE_INDEX_SIZE     64
+#define FILE_INDEX_HEAD     256               // bytes checked when there is no write time
+#define FILE_INDEX_MAGIC    (0x4f1d3e27 + sizeof(FileIndexEntry))
+
+struct FileIndexEntry {
+  uint32_t path;                    // CRC32 of the path, 0 for a free entry
+  uint32_t size;
+  uint32_t mtime;                   // File::getLastWrite(), 0 if not known
+  uint32_t head;                    // CRC32 of the start of the file, if no mtime
+  uint32_t stamp;                   // when hashed, 0 for a free entry
+  uint8_t  md5[16];
+};
+
+static FileIndexEntry fileIndex[FILE_INDEX_SIZE];
+static uint32_t       fileIndexStamp = 0;    // latest stamp given
+
+static
+uint32_t file_index_key(const String& path)
+{
+  const uint32_t key = BlynkCRC32(path.c_str(), path.length());
+  return key ? key : 1;
+}
+
+static
+FileIndexEntry* file_index_find(const String& path)
+{
+  const uint32_t key = file_index_key(path);
+  for (FileIndexEntry& e : fileIndex) {
+    if (e.path == key) {
+      return &e;
+    }
+  }
+  return NULL;
+}
+
+static
+void file_index_init()
+{
+  if (File f = BLYNK_FS.open(FILE_INDEX_PATH, FILE_READ)) {
+    uint32_t magic = 0;
+    if (f.read((uint8_t*)&magic, sizeof(magic)) != sizeof(magic) || magic != FILE_INDEX_MAGIC ||
+        f.read((uint8_t*)fileIndex, sizeof(fileIndex)) != sizeof(fileIndex))
+    {
+      memset(fileIndex, 0, sizeof(fileIndex));
+    }
+  }
+  for (const FileIndexEntry& e : fileIndex) {
+    fileIndexStamp = BlynkMax(fileIndexStamp, e.stamp);
+  }
+}
+
+static
+void file_index_save()
+{
+  if (File f = BLYNK_FS.open(FILE_INDEX_PATH, FILE_WRITE)) {
+    const uint32_t magic = FILE_INDEX_MAGIC;
+    f.write((const uint8_t*)&magic, sizeof(magic));
+    f.write((const uint8_t*)fileIndex, sizeof(fileIndex));
+  }
+}
+
+// Write time of the file, 0 if the filesystem or the clock did not set it
+static
+uint32_t file_index_mtime(File& f)
+{
+  const time_t t = f.getLastWrite();
+  return (t >= 1600000000) ? t : 0;
+}
+
+static
+uint32_t file_index_head(File& f)
+{
+  uint8_t buf[FILE_INDEX_HEAD];
+  f.seek(0);
+  const size_t n = f.read(buf, sizeof(buf));
+  return BlynkCRC32(buf, n);
+}
+
+// Digest of an indexed file, false if missing or the file changed since
+static
+bool file_index_get(const String& path, File& f, uint8_t* md5)
+{
+  const FileIndexEntry* e = file_index_find(path);
+  const uint32_t mtime = file_index_mtime(f);
+  if (!e || e->size != f.size() || e->mtime != mtime ||
+      (!mtime && e->head != file_index_head(f)))
+  {
+    return false;
+  }
+  memcpy(md5, e->md5, sizeof(e->md5));
+  return true;
+}
+
+// Hashes the file and updates its entry. Call file_index_save() after
+static
+void file_index_hash(const String& path, File& f, uint8_t* md5)
+{
+  MD5Builder builder;
+  builder.begin();
+  f.seek(0);
+  builder.addStream(f, f.size());
+  builder.calculate();
+  builder.getBytes(md5);
+
+  FileIndexEntry* e = file_index_find(path);
+  if (!e) {
+    // A free entry, or the one hashed longest ago
+    e = &fileIndex[0];
+    for (FileIndexEntry& c : fileIndex) {
+      if (c.stamp < e->stamp) {
+        e = &c;
+      }
+    }
+  }
+  e->path  = file_index_key(path);
+  e->size  = f.size();
+  e->mtime = file_index_mtime(f);
+  e->head  = e->mtime ? 0 : file_index_head(f);
+  e->stamp = ++fileIndexStamp;
+  memcpy(e->md5, md5, sizeof(e->md5));
+}
+
+// Indexed digest, or hashes the file if needed
+static
+bool file_index_md5(const String& path, uint8_t* md5)
+{
+  File f = BLYNK_FS.open(path, FILE_READ);
+  if (!f) {
+    return false;
+  }
+  if (!file_index_get(path, f, md5)) {
+    file_index_hash(path, f, md5);
+    f.close();
+    file_index_save();
+  }
+  return true;
+}
+
+// After a file was written through Edgent
+static
+void file_index_update(const String& path)
+{
+  uint8_t md5[16];
+  if (File f = BLYNK_FS.open(path, FILE_READ)) {
+    file_index_hash(path, f, md5);
+    f.close();
+    file_index_save();
+  }
+}
+
+static
+void file_index_remove(const String& path)
+{
+  if (FileIndexEntry* e = file_index_find(path)) {
+    memset(e, 0, sizeof(FileIndexEntry));
+    file_index_save();
+  }
+}
+
+static
+void file_index_rename(const String& from, const String& to)
+{
+  file_index_remove(to);
+  if (FileIndexEntry* e = file_index_find(from)) {
+    e->path = file_index_key(to);
+    file_index_save();
+  }
+}
+
+#else
+
+static
+void file_index_init()
+{
+}
+
+#endif
@@ -0,0 +1,117 @@
+
+/*
+ * Minimal streaming JSON writer.
+ *
+ * Output goes straight into a Print (console stream, chunked HTTP response),
+ * so replies are never assembled in a heap String. Strings are escaped
+ * according to RFC 8259.
+ */
+
+class JsonWriter {
+public:
+  explicit JsonWriter(Print& out) : _out(out), _comma(false) {}
+
+  JsonWriter& beginObject() { separator(); _out.write('{'); _comma = false; return *this; }
+  JsonWriter& endObject()   { _out.write('}'); _comma = true; return *this; }
+  JsonWriter& beginArray()  { separator(); _out.write('['); _comma = false; return *this; }
+  JsonWriter& endArray()    { _out.write(']'); _comma = true; return *this; }
+
+  JsonWriter& key(const char* name) {
+    separator();
+    string(name);
+    _out.write(':');
+    _comma = false;
+    return *this;
+  }
+
+  JsonWriter& value(const char* s)        { separator(); s ? string(s) : (void)_out.print("null"); _comma = true; return *this; }
+  JsonWriter& value(const String& s)      { return value(s.c_str()); }
+  JsonWriter& value(bool v)               { separator(); _out.print(v ? "true" : "false"); _comma = true; return *this; }
+  JsonWriter& value(int v)                { separator(); _out.print(v); _comma = true; return *this; }
+  JsonWriter& value(unsigned v)           { separator(); _out.print(v); _comma = true; return *this; }
+  JsonWriter& value(long v)               { separator(); _out.print(v); _comma = true; return *this; }
+  JsonWriter& value(unsigned long v)      { separator(); _out.print(v); _comma = true; return *this; }
+
+  template <typename T>
+  JsonWriter& member(const char* name, const T& v) { return key(name).value(v); }
+
+private:
+  void separator() {
+    if (_comma) {
+      _out.write(',');
+    }
+  }
+
+  void string(const char* s) {
+    _out.write('"');
+    for (; *s; s++) {
+      const uint8_t c = *s;
+      switch (c) {
+      case '"':  _out.print("\\\""); break;
+      case '\\': _out.print("\\\\"); break;
+      case '\n': _out.print("\\n");  break;
+      case '\r': _out.print("\\r");  break;
+      case '\t': _out.print("\\t");  break;
+      default:
+        if (c < 0x20) {
+          char buff[8];
+          snprintf(buff, sizeof(buff), "\\u%04x", c);
+          _out.print(buff);
+        } else {
+          _out.write(c);
+        }
+      }
+    }
+    _out.write('"');
+  }
+
+  Print& _out;
+  bool   _comma;
+};
+
+/*
+ * Sends everything written to it as a chunked HTTP response body.
+ * Data is collected in a small stack buffer, so each chunk is one TCP write.
+ */
+class ChunkedPrint : public Print {
+public:
+  ChunkedPrint(ESP8266WebServer& server, int code, const char* type)
+    : _server(server), _len(0)
+  {
+    _server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    _server.send(code, type, "");
+  }
+
+  ~ChunkedPrint() {
+    flush();
+  }
+
+  using Print::write;
+
+  size_t write(uint8_t c) {
+    if (_len == sizeof(_buff)) {
+      flush();
+    }
+    _buff[_len++] = c;
+    return 1;
+  }
+
+  size_t write(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      write(data[i]);
+    }
+    return size;
+  }
+
+  void flush() {
+    if (_len) {
+      _server.sendContent((const char*)_buff, _len);
+      _len = 0;
+    }
+  }
+
+private:
+  ESP8266WebServer& _server;
+  uint8_t    _buff[256];
+  size_t     _len;
+};
@@ -23,7 +23,7 @@ BLYNK_WRITE(InternalPinOTA) {
     // Disconnect, not to interfere with OTA process
     Blynk.disconnect();
 
-    BlynkState::set(MODE_OTA_UPGRADE);
+    BlynkState::set(MODE_OTA_UPGRADE, REASON_OTA);
   });
 }
 
@@ -133,8 +133,6 @@ bool parseURL(String url, String& protocol, String& host, int& port, String& uri
 }
 
 void enterOTA() {
-  BlynkState::set(MODE_OTA_UPGRADE);
-
   // Disconnect, not to interfere with OTA process
   Blynk.disconnect();
 
@@ -0,0 +1,83 @@
+
+/*
+ * Static portal assets with gzip and ETag revalidation.
+ *
+ * "make fs" stores text assets gzip-compressed (i.e. /index.html.gz),
+ * these are sent as-is with Content-Encoding: gzip. Every asset gets a
+ * strong ETag (MD5 of the stored file, from the file index), so repeat
+ * visits are answered with 304 Not Modified.
+ */
+
+#include <MD5Builder.h>
+
+struct PortalAsset {
+  const char* uri;
+  const char* path;
+  const char* type;
+  String      file;   // resolved file name, "<path>.gz" if present
+  String      etag;
+};
+
+static PortalAsset portalAssets[] = {
+  { "/",                "/index.html",      "text/html" },
+  { "/img/favicon.png", "/img/favicon.png", "image/png" },
+  { "/img/logo.png",    "/img/logo.png",    "image/png" },
+};
+
+static
+String portalMakeETag(const uint8_t* digest)
+{
+  char buff[40];
+  snprintf(buff, sizeof(buff), "\"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\"",
+           digest[0], digest[1], digest[2],  digest[3],  digest[4],  digest[5],  digest[6],  digest[7],
+           digest[8], digest[9], digest[10], digest[11], digest[12], digest[13], digest[14], digest[15]);
+  return buff;
+}
+
+#ifdef BLYNK_FS
+// Returns false if the portal page is not on the filesystem
+static
+bool portalAssetsInit()
+{
+  for (PortalAsset& a : portalAssets) {
+    if (a.etag.length()) {
+      continue; // Already resolved
+    }
+    const String gz = String(a.path) + ".gz";
+    if (BLYNK_FS.exists(gz)) {
+      a.file = gz;
+    } else if (BLYNK_FS.exists(a.path)) {
+      a.file = a.path;
+    } else {
+      continue;
+    }
+    uint8_t digest[16];
+    if (file_index_md5(a.file, digest)) {
+      a.etag = portalMakeETag(digest);
+    }
+  }
+  return portalAssets[0].etag.length() > 0;
+}
+#endif
+
+// ETag of the built-in configForm page
+static
+const String& portalFormETag()
+{
+  static String etag;
+  if (!etag.length()) {
+    uint8_t  digest[16];
+    uint8_t  buff[64];
+    MD5Builder md5;
+    md5.begin();
+    for (size_t i = 0; i < sizeof(configForm); i += sizeof(buff)) {
+      const size_t len = BlynkMin(sizeof(buff), sizeof(configForm) - i);
+      memcpy_P(buff, configForm + i, len);
+      md5.add(buff, len);
+    }
+    md5.calculate();
+    md5.getBytes(digest);
+    etag = portalMakeETag(digest);
+  }
+  return etag;
+}
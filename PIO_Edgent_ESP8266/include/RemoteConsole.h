@@ -0,0 +1,172 @@
+
+/*
+ * Console output for commands received on InternalPinDBG.
+ *
+ * The console writes to RemoteConsoleStream, which passes everything to the
+ * local stream (BLYNK_PRINT, if any). For REMOTE_CONSOLE_SESSION ms after a
+ * command arrives on InternalPinDBG, the output is also kept in a ring buffer
+ * of REMOTE_CONSOLE_BUFFER bytes and written back to InternalPinDBG from the
+ * Blynk loop, in chunks of up to REMOTE_CONSOLE_CHUNK bytes cut at the end of
+ * a line, at most one every REMOTE_CONSOLE_INTERVAL ms.
+ *
+ * The first chunk waits a random time up to REMOTE_CONSOLE_JITTER, so the
+ * replies to a command sent to a whole fleet are spread out. Output that does
+ * not fit the buffer is dropped and counted, the session ends with a note of
+ * it. availableForWrite() is the free space of the buffer, so a download
+ * ("get") waits for it instead of being dropped. See "sys remote".
+ */
+
+#define REMOTE_CONSOLE_SESSION  30000     // ms of capture after the last command
+#define REMOTE_CONSOLE_JITTER   2000      // ms, max delay of the first chunk
+
+static struct {
+  char     buf[REMOTE_CONSOLE_BUFFER];
+  uint16_t head;                        // next byte to send
+  uint16_t len;
+  uint32_t activeUntil;                 // millis() when the capture ends, 0 if none
+  uint32_t sendAt;                      // millis() of the next chunk
+  uint32_t dropped;                     // in this session
+  uint32_t commands;
+  uint32_t chunks;
+  uint32_t sent;                        // bytes
+  uint32_t droppedTotal;
+} remoteConsole;
+
+static inline
+bool remote_console_active()
+{
+  return remoteConsole.activeUntil && (int32_t)(millis() - remoteConsole.activeUntil) < 0;
+}
+
+class RemoteConsoleStream : public Stream {
+public:
+  RemoteConsoleStream() : local(NULL) {}
+
+  void begin(Stream* stream) {
+    local = stream;
+  }
+
+  int available() override {
+    return local ? local->available() : 0;
+  }
+
+  int read() override {
+    return local ? local->read() : -1;
+  }
+
+  int peek() override {
+    return local ? local->peek() : -1;
+  }
+
+  void flush() override {
+    if (local) {
+      local->flush();
+    }
+  }
+
+  int availableForWrite() override {
+    if (!remote_console_active()) {
+      return INT16_MAX;
+    }
+    return REMOTE_CONSOLE_BUFFER - remoteConsole.len;
+  }
+
+  size_t write(uint8_t c) override {
+    return write(&c, 1);
+  }
+
+  size_t write(const uint8_t* data, size_t size) override {
+    if (local) {
+      local->write(data, size);
+    }
+    if (remote_console_active()) {
+      const size_t n = BlynkMin(size, (size_t)(REMOTE_CONSOLE_BUFFER - remoteConsole.len));
+      for (size_t i = 0; i < n; i++) {
+        remoteConsole.buf[(remoteConsole.head + remoteConsole.len++) % REMOTE_CONSOLE_BUFFER] = data[i];
+      }
+      remoteConsole.dropped      += size - n;
+      remoteConsole.droppedTotal += size - n;
+    }
+    return size;
+  }
+
+  using Print::write;
+
+private:
+  Stream* local;
+};
+
+static RemoteConsoleStream remoteConsoleStream;
+
+// Called for a command received on InternalPinDBG
+static
+void remote_console_begin()
+{
+  if (!remote_console_active() && !remoteConsole.len) {
+    remoteConsole.sendAt  = millis() + backoffRandom() % REMOTE_CONSOLE_JITTER;
+    remoteConsole.dropped = 0;
+  }
+  remoteConsole.activeUntil = (millis() + REMOTE_CONSOLE_SESSION) | 1;
+  remoteConsole.commands++;
+}
+
+// Sends the next chunk, called from the Blynk loop when connected
+static
+void remote_console_run()
+{
+  if (!remoteConsole.len) {
+    if (remoteConsole.dropped && !remote_console_active()) {
+      Blynk.virtualWrite(InternalPinDBG, String("[") + remoteConsole.dropped + " bytes dropped]\n");
+      remoteConsole.dropped = 0;
+    }
+    return;
+  }
+  if ((int32_t)(millis() - remoteConsole.sendAt) < 0) {
+    return;
+  }
+
+  char chunk[REMOTE_CONSOLE_CHUNK + 1];
+  size_t n = BlynkMin((size_t)remoteConsole.len, (size_t)REMOTE_CONSOLE_CHUNK);
+  for (size_t i = 0; i < n; i++) {
+    chunk[i] = remoteConsole.buf[(remoteConsole.head + i) % REMOTE_CONSOLE_BUFFER];
+  }
+  // Don't split a line, unless it is longer than a chunk
+  if (n < remoteConsole.len) {
+    size_t end = n;
+    while (end && chunk[end - 1] != '\n') {
+      end--;
+    }
+    if (end) {
+      n = end;
+    }
+  }
+  chunk[n] = '\0';
+
+  Blynk.virtualWrite(InternalPinDBG, chunk);
+  remoteConsole.head    = (remoteConsole.head + n) % REMOTE_CONSOLE_BUFFER;
+  remoteConsole.len    -= n;
+  remoteConsole.sendAt  = millis() + REMOTE_CONSOLE_INTERVAL;
+  remoteConsole.chunks++;
+  remoteConsole.sent   += n;
+}
+
+static
+void remote_console_clear()
+{
+  remoteConsole.head         = 0;
+  remoteConsole.len          = 0;
+  remoteConsole.dropped      = 0;
+  remoteConsole.commands     = 0;
+  remoteConsole.chunks       = 0;
+  remoteConsole.sent         = 0;
+  remoteConsole.droppedTotal = 0;
+}
+
+static
+void remote_console_print(Stream& out)
+{
+  out.println(String("Session: ") + (remote_console_active() ? "active" : "none") +
+              ", buffered " + remoteConsole.len + "/" + REMOTE_CONSOLE_BUFFER + " bytes");
+  out.println(String("Commands: ") + remoteConsole.commands + ", sent " + remoteConsole.sent +
+              " bytes in " + remoteConsole.chunks + " chunks, dropped " + remoteConsole.droppedTotal);
+}
@@ -76,12 +76,30 @@
 #define CONFIG_DEFAULT_PORT           443
 #endif
 
+//#define STATE_TRACE_REPORT_VPIN V100                      // Send time-in-state counters there on connect (StateTrace.h)
+
+#define WRITE_COALESCE_WINDOW         100                   // Changed pins of BlynkEdgent.virtualWrite() are sent at most this often
+#define LOOP_PROFILER_ENABLE                                // Cycle counts of the loop parts, see "sys perf" (Profiler.h)
+#define REMOTE_CONSOLE_BUFFER         2048                  // Console output kept for InternalPinDBG, the rest is dropped
+#define REMOTE_CONSOLE_CHUNK          256                   // Max bytes per write of console output to InternalPinDBG
+#define REMOTE_CONSOLE_INTERVAL       250                   // ms between these writes
+//#define OFFLINE_BUFFER_ENABLE                             // Store writes made while offline on BLYNK_FS, replay them later (OfflineBuffer.h)
+//#define OFFLINE_BUFFER_SNTP_ENABLE                        // Set the clock from pool.ntp.org, so stored writes keep their time
+#define OFFLINE_BUFFER_SEGMENTS       16                    // 4 KB each, the oldest is dropped when all are full
+#define OFFLINE_REPLAY_RATE           20                    // Stored writes replayed per second
 #define WIFI_CLOUD_MAX_RETRIES        500
 #define WIFI_NET_CONNECT_TIMEOUT      50000
 #define WIFI_CLOUD_CONNECT_TIMEOUT    50000
+#define WIFI_NET_BACKOFF_BASE         1000                  // Reconnect delay is random in [0, min(CAP, BASE * 2^failures)]
+#define WIFI_NET_BACKOFF_CAP          60000
+#define WIFI_CLOUD_BACKOFF_BASE       5000
+#define WIFI_CLOUD_BACKOFF_CAP        300000
+#define WIFI_AP_START_TIMEOUT         5000
+#define WIFI_AP_STA_LINGER_TIME       3000                  // Keep the AP after a validated config, so the phone gets the result
 #define WIFI_AP_IP                    IPAddress(192, 168, 4, 1)
 #define WIFI_AP_Subnet                IPAddress(255, 255, 255, 0)
 //#define WIFI_CAPTIVE_PORTAL_ENABLE
+//#define WIFI_AP_STA_VALIDATE_ENABLE                       // Check credentials with the AP still up (AP+STA)
 
 #define USE_TICKER
 //#define USE_TIMER_ONE
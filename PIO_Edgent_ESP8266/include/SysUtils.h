@@ -14,8 +14,9 @@
 #endif
 
 #if defined(BLYNK_FS) && defined(ESP8266)
-  #define FILE_READ  "r"
-  #define FILE_WRITE "w"
+  #define FILE_READ   "r"
+  #define FILE_WRITE  "w"
+  #define FILE_APPEND "a"
 #endif
 
 #if defined(BLYNK_NOINIT_ATTR)
@@ -26,19 +26,26 @@ BlynkTimer edgentTimer;
 
 #include "SysUtils.h"
 #include "BlynkState.h"
+#include "StateTrace.h"
+#include "Profiler.h"
+#include "WriteCoalesce.h"
 #include "ConfigStore.h"
 #include "ResetButton.h"
 #include "ConfigMode.h"
 #include "Indicator.h"
 #include "OTA.h"
+#include "RemoteConsole.h"
 #include "Console.h"
 
 
 inline
-void BlynkState::set(State m) {
+void BlynkState::set(State m, StateReason reason) {
   if (state != m && m < MODE_MAX_VALUE) {
-    DEBUG_PRINT(String(StateStr[state]) + " => " + StateStr[m]);
+    if (!state_trace_transition(state, m, reason)) {
+      return;
+    }
     state = m;
+    portal_events_push(m);
 
     // You can put your state handling here,
     // i.e. implement custom indication
@@ -64,24 +71,61 @@ void printDeviceBanner()
 }
 
 void runBlynkWithChecks() {
-  Blynk.run();
+  {
+    ProfileScope profile(PROF_BLYNK);
+    Blynk.run();
+  }
   if (BlynkState::get() == MODE_RUNNING) {
     if (!Blynk.connected()) {
+      // Even the first reconnect is delayed by a random time,
+      // so a cloud outage does not end with every device at once
       if (WiFi.status() == WL_CONNECTED) {
-        BlynkState::set(MODE_CONNECTING_CLOUD);
+        DEBUG_PRINT(String("Reconnecting to cloud in ") + cloudBackoff.fail() + " ms");
+        BlynkState::set(MODE_CONNECTING_CLOUD, REASON_CLOUD_LOST);
       } else {
-        BlynkState::set(MODE_CONNECTING_NET);
+        DEBUG_PRINT(String("Reconnecting to WiFi in ") + netBackoff.fail() + " ms");
+        BlynkState::set(MODE_CONNECTING_NET, REASON_NET_LOST);
       }
+    } else {
+      write_coalesce_flush();
+      remote_console_run();
     }
   }
 }
 
+struct StateHooks {
+  void (*enter)();    // on the first step() in the state
+  void (*run)();      // on every step() in the state
+  void (*exit)();     // on the first step() in another state
+};
+
+// Indexed by State
+constexpr StateHooks stateHooks[MODE_MAX_VALUE] = {
+  /* WAIT_CONFIG      */ { NULL,               enterConfigMode,    exitConfigMode },
+  /* CONFIGURING      */ { NULL,               enterConfigMode,    exitConfigMode },
+  /* CONNECTING_NET   */ { NULL,               enterConnectNet,    NULL },
+  /* CONNECTING_CLOUD */ { NULL,               enterConnectCloud,  NULL },
+  /* RUNNING          */ { state_trace_report, runBlynkWithChecks, NULL },
+  /* OTA_UPGRADE      */ { NULL,               enterOTA,           NULL },
+  /* SWITCH_TO_STA    */ { NULL,               enterSwitchToSTA,   NULL },
+  /* RESET_CONFIG     */ { NULL,               enterResetConfig,   NULL },
+  /* ERROR            */ { NULL,               enterError,         NULL },
+};
+
+constexpr bool state_hooks_complete(unsigned m = 0) {
+  return m >= MODE_MAX_VALUE || (stateHooks[m].run != NULL && state_hooks_complete(m + 1));
+}
+
+static_assert(state_hooks_complete(), "Every state needs a run hook");
+
 class Edgent {
 
 public:
   void begin()
   {
     systemInit();
+    state_trace_init();
+    profiler_init();
 
     //indicator_init();
     button_init();
@@ -106,25 +150,56 @@ public:
     }
   }
 
+  // Keeps the latest value, sent with the next batch (see WriteCoalesce.h)
+  template <typename... Args>
+  void virtualWrite(int pin, Args... values) {
+    write_coalesce_add(pin, values...);
+  }
+
+  void writePolicy(int pin, uint32_t minInterval, float deadband = 0) {
+    write_coalesce_set_policy(pin, minInterval, deadband);
+  }
+
   void run() {
+    profiler_run_begin();
+    step();
+    profiler_run_end();
+  }
+
+private:
+  void step() {
+    ProfileScope profile(PROF_STEP);
     app_loop();
-    switch (BlynkState::get()) {
-    case MODE_WAIT_CONFIG:       
-    case MODE_CONFIGURING:       enterConfigMode();    break;
-    case MODE_CONNECTING_NET:    enterConnectNet();    break;
-    case MODE_CONNECTING_CLOUD:  enterConnectCloud();  break;
-    case MODE_RUNNING:           runBlynkWithChecks(); break;
-    case MODE_OTA_UPGRADE:       enterOTA();           break;
-    case MODE_SWITCH_TO_STA:     enterSwitchToSTA();   break;
-    case MODE_RESET_CONFIG:      enterResetConfig();   break;
-    default:                     enterError();         break;
+    const State m = BlynkState::get();
+    if (m != current) {
+      // Not in BlynkState::set(), which may be called from an ISR
+      if (current < MODE_MAX_VALUE && stateHooks[current].exit) {
+        stateHooks[current].exit();
+      }
+      current = m;
+      if (m < MODE_MAX_VALUE && stateHooks[m].enter) {
+        stateHooks[m].enter();
+      }
+    }
+    if (m < MODE_MAX_VALUE) {
+      stateHooks[m].run();
+    } else {
+      BlynkState::set(MODE_ERROR); // begin() did not pick a state
     }
   }
 
+  State current = MODE_MAX_VALUE;   // as last seen by step()
+
 } BlynkEdgent;
 
 void app_loop() {
+  {
+    ProfileScope profile(PROF_TIMER);
     edgentTimer.run();
+  }
+  {
+    ProfileScope profile(PROF_CONSOLE);
     edgentConsole.run();
+  }
 }
 
@@ -0,0 +1,175 @@
+
+/*
+ * Captive portal DNS responder.
+ *
+ * Polled from the portal loop, but each call drains all queued queries,
+ * so bursts of connectivity checks from a joining phone do not wait for
+ * one loop iteration each. Replies are built in place from a precomputed
+ * answer record.
+ */
+
+#include <WiFiUdp.h>
+
+#define CAPTIVE_DNS_PORT        53
+#define CAPTIVE_DNS_TTL         300
+#define CAPTIVE_DNS_BUFF_SIZE   512
+
+struct CaptiveDnsStats {
+  uint32_t  queries;
+  uint32_t  answered;
+  uint32_t  failed;
+  uint32_t  maxBurst;   // Queries handled in one wakeup
+  uint32_t  maxTime;    // Longest turnaround, us
+};
+
+static CaptiveDnsStats captiveDnsStats;
+static uint8_t         captiveDnsAnswer[16];  // A record, the name points to the question
+static char            captiveDnsDomain[64];  // "*" answers every name
+
+static
+void captive_dns_prepare(const IPAddress& ip, const char* domain)
+{
+  const uint8_t answer[] = {
+    0xC0, 0x0C,                                 // Name: pointer to the question
+    0x00, 0x01,                                 // Type: A
+    0x00, 0x01,                                 // Class: IN
+    (CAPTIVE_DNS_TTL >> 24) & 0xFF, (CAPTIVE_DNS_TTL >> 16) & 0xFF,
+    (CAPTIVE_DNS_TTL >> 8)  & 0xFF, (CAPTIVE_DNS_TTL)       & 0xFF,
+    0x00, 0x04,                                 // Data length
+    ip[0], ip[1], ip[2], ip[3]
+  };
+  memcpy(captiveDnsAnswer, answer, sizeof(captiveDnsAnswer));
+  strncpy(captiveDnsDomain, domain, sizeof(captiveDnsDomain)-1);
+  memset(&captiveDnsStats, 0, sizeof(captiveDnsStats));
+}
+
+static
+bool captive_dns_matches(const char* name)
+{
+  if (captiveDnsDomain[0] == '*') {
+    return true;
+  }
+  if (0 == strncasecmp(name, "www.", 4)) {
+    name += 4;
+  }
+  return 0 == strcasecmp(name, captiveDnsDomain);
+}
+
+// Turns the query in buff into a reply, in place.
+// Returns the reply length, or 0 if the packet should be dropped
+static
+size_t captive_dns_reply(uint8_t* buff, size_t len)
+{
+  if (len < 12) {
+    return 0;
+  }
+  const uint8_t flags = buff[2];
+  if (flags & 0x80) {
+    return 0;                                   // Not a query
+  }
+
+  // Answer counts are filled in below, other sections are never sent
+  memset(buff + 6, 0, 6);
+
+  const uint16_t qdcount = (buff[4] << 8) | buff[5];
+  if ((flags & 0x78) || qdcount != 1) {
+    buff[2] = 0x80 | (flags & 0x79);            // QR, keep opcode and RD
+    buff[3] = 4;                                // NOTIMP
+    buff[4] = buff[5] = 0;
+    return 12;
+  }
+
+  char   name[128];
+  size_t nameLen = 0;
+  size_t pos = 12;
+  while (pos < len && buff[pos]) {
+    const uint8_t labelLen = buff[pos++];
+    if ((labelLen & 0xC0) || pos + labelLen > len) {
+      return 0;
+    }
+    if (nameLen + labelLen + 2 > sizeof(name)) {
+      return 0;
+    }
+    if (nameLen) {
+      name[nameLen++] = '.';
+    }
+    memcpy(name + nameLen, buff + pos, labelLen);
+    nameLen += labelLen;
+    pos += labelLen;
+  }
+  name[nameLen] = '\0';
+  pos += 1 + 4;                                 // Root label, type, class
+  if (pos > len || pos + sizeof(captiveDnsAnswer) > CAPTIVE_DNS_BUFF_SIZE) {
+    return 0;
+  }
+  const uint16_t qtype = (buff[pos-4] << 8) | buff[pos-3];
+
+  buff[2] = 0x84 | (flags & 0x01);              // QR, AA, keep RD
+  buff[3] = 0;
+  if (!captive_dns_matches(name)) {
+    buff[3] = 2;                                // SERVFAIL
+    captiveDnsStats.failed++;
+  } else if (qtype == 1 || qtype == 255) {      // A or ANY
+    memcpy(buff + pos, captiveDnsAnswer, sizeof(captiveDnsAnswer));
+    pos += sizeof(captiveDnsAnswer);
+    buff[7] = 1;
+    captiveDnsStats.answered++;
+  }
+  // Other types (i.e. AAAA) get an empty answer, so clients fall back to A quickly
+  return pos;
+}
+
+static
+void captive_dns_account(uint32_t started, uint32_t burst)
+{
+  const uint32_t elapsed = micros() - started;
+  captiveDnsStats.queries++;
+  captiveDnsStats.maxTime  = BlynkMax(captiveDnsStats.maxTime, elapsed);
+  captiveDnsStats.maxBurst = BlynkMax(captiveDnsStats.maxBurst, burst);
+}
+
+static
+void captive_dns_print_stats()
+{
+  DEBUG_PRINT(String("DNS: ") + captiveDnsStats.queries + " queries, " +
+              captiveDnsStats.answered + " answered, " +
+              captiveDnsStats.failed + " failed, max burst " +
+              captiveDnsStats.maxBurst + ", max " +
+              captiveDnsStats.maxTime + " us");
+}
+
+static WiFiUDP captiveDnsUdp;
+
+static
+void captive_dns_start(const IPAddress& ip, const char* domain)
+{
+  captive_dns_prepare(ip, domain);
+  if (!captiveDnsUdp.begin(CAPTIVE_DNS_PORT)) {
+    DEBUG_PRINT("DNS: cannot bind");
+  }
+}
+
+static
+void captive_dns_run()
+{
+  static uint8_t buff[CAPTIVE_DNS_BUFF_SIZE];
+
+  for (uint32_t burst = 1; captiveDnsUdp.parsePacket() > 0; burst++) {
+    const uint32_t t = micros();
+    const int len = captiveDnsUdp.read(buff, sizeof(buff));
+    const size_t reply = (len > 0) ? captive_dns_reply(buff, len) : 0;
+    if (reply) {
+      captiveDnsUdp.beginPacket(captiveDnsUdp.remoteIP(), captiveDnsUdp.remotePort());
+      captiveDnsUdp.write(buff, reply);
+      captiveDnsUdp.endPacket();
+    }
+    captive_dns_account(t, burst);
+  }
+}
+
+static
+void captive_dns_stop()
+{
+  captiveDnsUdp.stop();
+  captive_dns_print_stats();
+}
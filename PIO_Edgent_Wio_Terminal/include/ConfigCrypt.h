@@ -0,0 +1,148 @@
+
+/*
+ * AES-256-GCM sealing of the ConfigStore record (mbedTLS).
+ *
+ * This is obfuscation, not protection against a flash dump: the key is an
+ * HMAC of the SAMD51 serial number with a fixed salt, and any code running
+ * on the chip can read the serial number. Anyone with the dump and the
+ * serial number can derive the key. It keeps the credentials out of a plain
+ * read of the external flash, and the GCM tag rejects a damaged record.
+ */
+
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+
+#define CONFIG_SEALED_MAGIC     0x626C6E45
+
+struct ConfigSealed {
+  uint32_t  magic;
+  uint8_t   iv[12];
+  uint8_t   tag[16];
+  uint8_t   data[sizeof(ConfigStore)];
+} __attribute__((packed));
+
+static
+uint32_t config_crypt_random()
+{
+  MCLK->APBCMASK.bit.TRNG_ = 1;
+  TRNG->CTRLA.bit.ENABLE = 1;
+  while (!TRNG->INTFLAG.bit.DATARDY) {}
+  return TRNG->DATA.reg;
+}
+
+static
+bool config_crypt_key(uint8_t key[32])
+{
+  static const char salt[] = "blynk.edgent.config";
+  const uint32_t chipId[4] = {
+    SERIAL_NUMBER_WORD_0,
+    SERIAL_NUMBER_WORD_1,
+    SERIAL_NUMBER_WORD_2,
+    SERIAL_NUMBER_WORD_3
+  };
+
+  return 0 == mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                              (const uint8_t*)salt, sizeof(salt)-1,
+                              (const uint8_t*)chipId, sizeof(chipId),
+                              key);
+}
+
+static
+bool config_seal(const ConfigStore& in, ConfigSealed& out)
+{
+  uint8_t key[32];
+  if (!config_crypt_key(key)) {
+    return false;
+  }
+
+  out.magic = CONFIG_SEALED_MAGIC;
+  for (unsigned i = 0; i < sizeof(out.iv); i += 4) {
+    const uint32_t r = config_crypt_random();
+    memcpy(out.iv + i, &r, 4);
+  }
+
+  mbedtls_gcm_context gcm;
+  mbedtls_gcm_init(&gcm);
+  int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
+  if (ret == 0) {
+    ret = mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, sizeof(in),
+                                    out.iv, sizeof(out.iv),
+                                    (const uint8_t*)&out.magic, sizeof(out.magic),
+                                    (const uint8_t*)&in, out.data,
+                                    sizeof(out.tag), out.tag);
+  }
+  mbedtls_gcm_free(&gcm);
+  memset(key, 0, sizeof(key));
+  return ret == 0;
+}
+
+static
+bool config_unseal(const ConfigSealed& in, ConfigStore& out)
+{
+  if (in.magic != CONFIG_SEALED_MAGIC) {
+    return false;
+  }
+
+  uint8_t key[32];
+  if (!config_crypt_key(key)) {
+    return false;
+  }
+
+  mbedtls_gcm_context gcm;
+  mbedtls_gcm_init(&gcm);
+  int ret = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, 256);
+  if (ret == 0) {
+    ret = mbedtls_gcm_auth_decrypt(&gcm, sizeof(out),
+                                   in.iv, sizeof(in.iv),
+                                   (const uint8_t*)&in.magic, sizeof(in.magic),
+                                   in.tag, sizeof(in.tag),
+                                   in.data, (uint8_t*)&out);
+  }
+  mbedtls_gcm_free(&gcm);
+  memset(key, 0, sizeof(key));
+  return ret == 0;
+}
+
+/*
+ * Compares save and load latency of the plaintext and the sealed record.
+ * Runs on the flash sector after the config, which is erased again after.
+ */
+static
+void config_benchmark(Stream& out, const int iterations = 20)
+{
+  const uint32_t addr = _flash->chip.erase_gran;
+  ConfigStore  plain = configStore;
+  ConfigSealed sealed;
+  uint32_t tPlainSave = 0, tPlainLoad = 0;
+  uint32_t tSealSave  = 0, tSealLoad  = 0;
+  bool ok = true;
+
+  for (int i = 0; i < iterations; i++) {
+    uint32_t t = micros();
+    ok &= sfud_erase_write(_flash, addr, sizeof(plain), (const uint8_t*)&plain) == SFUD_SUCCESS;
+    tPlainSave += micros() - t;
+
+    t = micros();
+    ok &= sfud_read(_flash, addr, sizeof(plain), (uint8_t*)&plain) == SFUD_SUCCESS;
+    tPlainLoad += micros() - t;
+
+    t = micros();
+    ok &= config_seal(plain, sealed);
+    ok &= sfud_erase_write(_flash, addr, sizeof(sealed), (const uint8_t*)&sealed) == SFUD_SUCCESS;
+    tSealSave += micros() - t;
+
+    t = micros();
+    ok &= sfud_read(_flash, addr, sizeof(sealed), (uint8_t*)&sealed) == SFUD_SUCCESS;
+    ok &= config_unseal(sealed, plain);
+    tSealLoad += micros() - t;
+
+    ok &= memcmp(&plain, &configStore, sizeof(plain)) == 0;
+  }
+  sfud_erase(_flash, addr, sizeof(sealed));
+
+  out.print(" Iterations:  "); out.print(iterations); out.println(ok ? " (OK)" : " (FAILED)");
+  out.print(" Plain load:  "); out.print(tPlainLoad / iterations); out.println(" us");
+  out.print(" Plain save:  "); out.print(tPlainSave / iterations); out.println(" us");
+  out.print(" AES load:    "); out.print(tSealLoad  / iterations); out.println(" us");
+  out.print(" AES save:    "); out.print(tSealSave  / iterations); out.println(" us");
+}
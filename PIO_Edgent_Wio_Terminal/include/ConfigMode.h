@@ -1,7 +1,9 @@
 
 #include <WiFiClient.h>
 #include <WebServer.h>
-#include <DNSServer.h>
+
+#include "CaptiveDns.h"
+#include "Backoff.h"
 
 static const char configForm[] PROGMEM = R"html(
 <!DOCTYPE HTML>
@@ -50,11 +52,12 @@ static const char configForm[] PROGMEM = R"html(
 )html";
 
 WebServer server(80);
-DNSServer dnsServer;
-const byte DNS_PORT = 53;
 
 static int connectNetRetries    = WIFI_CLOUD_MAX_RETRIES;
 static int connectBlynkRetries  = WIFI_CLOUD_MAX_RETRIES;
+static Backoff netBackoff(WIFI_NET_BACKOFF_BASE, WIFI_NET_BACKOFF_CAP);
+static Backoff cloudBackoff(WIFI_CLOUD_BACKOFF_BASE, WIFI_CLOUD_BACKOFF_CAP);
+static uint32_t portalEnteredAt = 0;
 
 static inline
 String macToString(byte mac[6]) {
@@ -96,70 +99,54 @@ String getWiFiNetworkBSSID() {
   return WiFi.BSSIDstr();
 }
 
-String scanNetworks()
-{
-    DEBUG_PRINT("Scanning networks...");
-    int wifi_nets = WiFi.scanNetworks(true, true);
-    const uint32_t t = millis();
-    while (wifi_nets < 0 &&
-           millis() - t < 20000)
-    {
-      delay(20);
-      wifi_nets = WiFi.scanComplete();
-    }
-    DEBUG_PRINT(String("Found networks: ") + wifi_nets);
-
-    if (wifi_nets > 0) {
-      // Sort networks
-      int indices[wifi_nets];
-      for (int i = 0; i < wifi_nets; i++) {
-        indices[i] = i;
-      }
-      for (int i = 0; i < wifi_nets; i++) {
-        for (int j = i + 1; j < wifi_nets; j++) {
-          if (WiFi.RSSI(indices[j]) > WiFi.RSSI(indices[i])) {
-            std::swap(indices[i], indices[j]);
-          }
-        }
-      }
-
-      wifi_nets = BlynkMin(15, wifi_nets); // Show top 15 networks
-
-      // TODO: skip empty names
-      String result = "[\n";
+#include "JsonWriter.h"
+#include "ScanCache.h"
+#include "PortalEvents.h"
 
-      char buff[256];
-      for (int i = 0; i < wifi_nets; i++){
-        int id = indices[i];
-
-        snprintf(buff, sizeof(buff),
-          R"json(  {"ssid":"%s","bssid":"%s","rssi":%i,"sec":"%s","ch":%i})json",
-          WiFi.SSID(id).c_str(),
-          WiFi.BSSIDstr(id).c_str(),
-          WiFi.RSSI(id),
-          wifiSecToStr(WiFi.encryptionType(id)),
-          WiFi.channel(id)
-        );
+// The page is built into the firmware, so its CRC is a strong ETag
+static
+const String& configFormETag() {
+  static String etag;
+  if (!etag.length()) {
+    char buff[16];
+    snprintf(buff, sizeof(buff), "\"%08lx\"",
+             (unsigned long)BlynkCRC32(configForm, sizeof(configForm)));
+    etag = buff;
+  }
+  return etag;
+}
 
-        result += buff;
-        if (i != wifi_nets-1) result += ",\n";
-      }
-      return result + "\n]";
-    } else {
-      return "[]";
+// Reports the time from entering config mode to the first HTTP request.
+// Never handles anything itself, so it is registered before all others
+class PortalFirstRequest : public RequestHandler {
+public:
+  bool canHandle(HTTPMethod method, String uri) override {
+    if (portalEnteredAt) {
+      DEBUG_PRINT(String("First request after ") + (millis() - portalEnteredAt) + " ms: " + uri);
+      portalEnteredAt = 0;
     }
-}
+    return false;
+  }
+};
 
 static
 void handleRoot() {
+  const String& etag = configFormETag();
+  server.sendHeader("ETag", etag);
+  server.sendHeader("Cache-Control", "no-cache");
+  if (server.header("If-None-Match") == etag) {
+    server.send(304);
+    return;
+  }
   server.send(200, "text/html", configForm);
 }
 
-String networks = "[]";
-
 void enterConfigMode()
 {
-  networks = scanNetworks();
+  const uint32_t entered = millis();
+  portalEnteredAt = entered;
+
+  scan_cache_wait(20000);
 
   WiFi.mode(WIFI_OFF);
   delay(100);
@@ -169,14 +156,21 @@ void enterConfigMode()
   WiFi.softAP(systemGetDeviceName().c_str());
   delay(500);
 
+  static PortalFirstRequest* firstRequest = NULL;
+  if (!firstRequest) {
+    firstRequest = new PortalFirstRequest();
+    server.addHandler(firstRequest);
+  }
+
+  static const char* headers[] = { "If-None-Match" };
+  server.collectHeaders(headers, 1);
+
   // Set up DNS Server
-  dnsServer.setTTL(300); // Time-to-live 300s
-  dnsServer.setErrorReplyCode(DNSReplyCode::ServerFailure); // Return code for non-accessible domains
 #ifdef WIFI_CAPTIVE_PORTAL_ENABLE
-  dnsServer.start(DNS_PORT, "*", WiFi.softAPIP()); // Point all to our IP
+  captive_dns_start(WiFi.softAPIP(), "*"); // Point all to our IP
   server.onNotFound(handleRoot);
 #else
-  dnsServer.start(DNS_PORT, CONFIG_AP_URL, WiFi.softAPIP());
+  captive_dns_start(WiFi.softAPIP(), CONFIG_AP_URL);
   DEBUG_PRINT(String("AP URL:  ") + CONFIG_AP_URL);
 #endif
 
@@ -249,7 +243,9 @@ void enterConfigMode()
       server.send(200, "application/json", content);
 
       connectNetRetries = connectBlynkRetries = 1;
-      BlynkState::set(MODE_SWITCH_TO_STA);
+      netBackoff.reset();
+      cloudBackoff.reset();
+      BlynkState::set(MODE_SWITCH_TO_STA, REASON_CONFIG);
     } else {
       DEBUG_PRINT("Configuration invalid");
       content = R"json({"status":"error","msg":"Configuration invalid"})json";
@@ -263,22 +259,32 @@ void enterConfigMode()
     DEBUG_PRINT("Sending board info...");
     const char* tmpl = BLYNK_TEMPLATE_ID;
 
-    char buff[512];
-    snprintf(buff, sizeof(buff),
-      R"json({"board":"%s","tmpl_id":"%s","fw_type":"%s","fw_ver":"%s","ssid":"%s","bssid":"%s","mac":"%s","last_error":%d,"wifi_scan":true,"static_ip":true,"5ghz":true})json",
-      BLYNK_TEMPLATE_NAME,
-      tmpl ? tmpl : "Unknown",
-      BLYNK_FIRMWARE_TYPE,
-      BLYNK_FIRMWARE_VERSION,
-      systemGetDeviceName().c_str(),
-      getWiFiApBSSID().c_str(),
-      getWiFiMacAddress().c_str(),
-      configStore.last_error
-    );
-    server.send(200, "application/json", buff);
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    json.beginObject()
+          .member("board", BLYNK_TEMPLATE_NAME)
+          .member("tmpl_id", tmpl ? tmpl : "Unknown")
+          .member("fw_type", BLYNK_FIRMWARE_TYPE)
+          .member("fw_ver", BLYNK_FIRMWARE_VERSION)
+          .member("ssid", systemGetDeviceName())
+          .member("bssid", getWiFiApBSSID())
+          .member("mac", getWiFiMacAddress())
+          .member("last_error", configStore.last_error)
+          .member("wifi_scan", true)
+          .member("static_ip", true)
+          .member("5ghz", true)
+        .endObject();
   });
+  portal_events_begin();
   server.on("/wifi_scan.json", []() {
-    server.send(200, "application/json", networks);
+    if (server.arg("refresh").toInt()) {
+      scanCache.requested = true;
+    }
+    server.sendHeader("Age", scan_cache_age());
+    server.sendHeader("Cache-Control", "no-store");
+    ChunkedPrint body(server, 200, "application/json");
+    JsonWriter json(body);
+    scan_cache_write(json);
   });
   server.on("/reset", []() {
     BlynkState::set(MODE_RESET_CONFIG);
@@ -291,22 +297,49 @@ void enterConfigMode()
   server.on("/", handleRoot);
 
   server.begin();
+  DEBUG_PRINT(String("Portal ready in ") + (millis() - entered) + " ms");
 
   while (BlynkState::is(MODE_WAIT_CONFIG) || BlynkState::is(MODE_CONFIGURING)) {
     delay(10);
-    dnsServer.processNextRequest();
+    captive_dns_run();
     server.handleClient();
+    portal_events_run();
+    scan_cache_run();
     app_loop();
     if (BlynkState::is(MODE_CONFIGURING) && WiFi.softAPgetStationNum() == 0) {
       BlynkState::set(MODE_WAIT_CONFIG);
     }
   }
+}
 
+// Exit hook of WAIT_CONFIG and CONFIGURING
+void exitConfigMode()
+{
+  portal_events_end();
   server.stop();
+  scan_cache_end();
+  captive_dns_stop();
+}
+
+// Waits for the scheduled reconnect, keeping timers and console alive.
+// Returns false if the state was changed meanwhile
+static
+bool backoffWait(Backoff& backoff, State state)
+{
+  while (backoff.waiting()) {
+    delay(10);
+    app_loop();
+    if (!BlynkState::is(state)) {
+      return false;
+    }
+  }
+  return true;
 }
 
 void enterConnectNet() {
-  BlynkState::set(MODE_CONNECTING_NET);
+  if (!backoffWait(netBackoff, MODE_CONNECTING_NET)) {
+    return;
+  }
   DEBUG_PRINT(String("Connecting to WiFi: ") + configStore.wifiSSID);
 
   String hostname = systemGetDeviceName();
@@ -354,15 +387,21 @@ void enterConnectNet() {
     }
 
     connectNetRetries = WIFI_CLOUD_MAX_RETRIES;
+    netBackoff.reset();
     BlynkState::set(MODE_CONNECTING_CLOUD);
   } else if (--connectNetRetries <= 0) {
     config_set_last_error(BLYNK_PROV_ERR_NETWORK);
-    BlynkState::set(MODE_ERROR);
+    BlynkState::set(MODE_ERROR, REASON_NET_FAILED);
+  } else {
+    WiFi.disconnect(); // Stop the driver from retrying on its own
+    DEBUG_PRINT(String("Next WiFi attempt in ") + netBackoff.fail() + " ms");
   }
 }
 
 void enterConnectCloud() {
-  BlynkState::set(MODE_CONNECTING_CLOUD);
+  if (!backoffWait(cloudBackoff, MODE_CONNECTING_CLOUD)) {
+    return;
+  }
 
   Blynk.config(configStore.cloudToken, configStore.cloudHost, configStore.cloudPort);
   Blynk.connect(0);
@@ -388,12 +427,13 @@ void enterConnectCloud() {
 
   if (Blynk.isTokenInvalid()) {
     config_set_last_error(BLYNK_PROV_ERR_TOKEN);
-    BlynkState::set(MODE_WAIT_CONFIG); // TODO: retry after timeout
+    BlynkState::set(MODE_WAIT_CONFIG, REASON_TOKEN); // TODO: retry after timeout
   } else if (WiFi.status() != WL_CONNECTED) {
-    BlynkState::set(MODE_CONNECTING_NET);
+    BlynkState::set(MODE_CONNECTING_NET, REASON_NET_LOST);
   } else if (Blynk.connected()) {
     BlynkState::set(MODE_RUNNING);
     connectBlynkRetries = WIFI_CLOUD_MAX_RETRIES;
+    cloudBackoff.reset();
 
     if (0 != strcmp(configStore.version, BLYNK_FIRMWARE_VERSION)) {
       Blynk.logEvent("sys_ota", String("Firmware updated to ") + BLYNK_FIRMWARE_VERSION);
@@ -411,13 +451,14 @@ void enterConnectCloud() {
     }
   } else if (--connectBlynkRetries <= 0) {
     config_set_last_error(BLYNK_PROV_ERR_CLOUD);
-    BlynkState::set(MODE_ERROR);
+    BlynkState::set(MODE_ERROR, REASON_CLOUD_FAILED);
+  } else {
+    Blynk.disconnect();
+    DEBUG_PRINT(String("Next cloud attempt in ") + cloudBackoff.fail() + " ms");
   }
 }
 
 void enterSwitchToSTA() {
-  BlynkState::set(MODE_SWITCH_TO_STA);
-
   DEBUG_PRINT("Switching to STA...");
 
   delay(1000);
@@ -429,8 +470,6 @@ void enterSwitchToSTA() {
 }
 
 void enterError() {
-  BlynkState::set(MODE_ERROR);
-
   unsigned long timeoutMs = millis() + 10000;
   while (timeoutMs > millis() || g_buttonPressed)
   {
@@ -106,30 +106,61 @@ static bool config_load_blnkopt()
 #include <sfud.h>
 const sfud_flash *_flash = sfud_get_device_table() + 0;
 
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+  #include "ConfigCrypt.h"
+#endif
+
+static bool configIsPlaintext = false;
+
 void config_load()
 {
   memset(&configStore, 0, sizeof(configStore));
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+  ConfigSealed sealed;
+  sfud_err result = sfud_read(_flash, 0, sizeof(sealed), (uint8_t*)&sealed);
+  if (result == SFUD_SUCCESS && sealed.magic == CONFIG_SEALED_MAGIC) {
+    if (!config_unseal(sealed, configStore)) {
+      DEBUG_PRINT("Config decryption failed");
+      memset(&configStore, 0, sizeof(configStore));
+    }
+  } else if (result == SFUD_SUCCESS) {
+    memcpy(&configStore, &sealed, sizeof(configStore));
+    configIsPlaintext = true;
+  }
+#else
   sfud_err result = sfud_read(_flash, 0, sizeof(configStore), (uint8_t*)&configStore);
+#endif
   if (result != SFUD_SUCCESS || configStore.magic != 0x626C6E6B)
   {
     DEBUG_PRINT("Using default config.");
     configStore = configDefault;
+    configIsPlaintext = false;
     return;
   }
 }
 
 bool config_save()
 {
-
-  sfud_err result = sfud_erase(_flash, 0, sizeof(configStore));
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+  ConfigSealed sealed;
+  if (!config_seal(configStore, sealed)) { DEBUG_PRINT("Config encryption failed"); return false; }
+  const uint8_t* data = (const uint8_t*)&sealed;
+  const size_t   size = sizeof(sealed);
+#else
+  const uint8_t* data = (const uint8_t*)&configStore;
+  const size_t   size = sizeof(configStore);
+#endif
+
+  sfud_err result = sfud_erase(_flash, 0, size);
   delay(100);
   if (!result == SFUD_SUCCESS) { DEBUG_PRINT("Erase flash data failed"); return false; }
 
-  result = sfud_write(_flash, 0, sizeof(configStore), (uint8_t*)&configStore);
+  result = sfud_write(_flash, 0, size, data);
   delay(50);
 
   if (!result == SFUD_SUCCESS) { DEBUG_PRINT("Write the flash data failed"); return false; }
 
+  configIsPlaintext = false;
   DEBUG_PRINT("Configuration stored to flash");
   return true;
 }
@@ -140,7 +171,16 @@ bool config_init()
 
   sfud_qspi_fast_read_enable(sfud_get_device(SFUD_W25Q32_DEVICE_INDEX), 2);
 
+  const uint32_t t = micros();
   config_load();
+  DEBUG_PRINT(String("Config loaded in ") + (micros() - t) + " us");
+
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+  if (configIsPlaintext) {
+    DEBUG_PRINT("Encrypting stored config");
+    config_save();
+  }
+#endif
   return true;
 }
 
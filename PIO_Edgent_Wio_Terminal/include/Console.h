@@ -6,8 +6,9 @@ BlynkConsole    edgentConsole;
 void console_init()
 {
 #ifdef BLYNK_PRINT
-  edgentConsole.begin(BLYNK_PRINT);
+  remoteConsoleStream.begin(&BLYNK_PRINT);
 #endif
+  edgentConsole.begin(remoteConsoleStream);
 
   edgentConsole.print("\n>");
 
@@ -17,14 +18,15 @@ void console_init()
   });
 
   edgentConsole.addCommand("devinfo", []() {
-    edgentConsole.printf(
-        R"json({"name":"%s","board":"%s","tmpl_id":"%s","fw_type":"%s","fw_ver":"%s"})json" "\n",
-        systemGetDeviceName().c_str(),
-        BLYNK_TEMPLATE_NAME,
-        BLYNK_TEMPLATE_ID,
-        BLYNK_FIRMWARE_TYPE,
-        BLYNK_FIRMWARE_VERSION
-    );
+    JsonWriter json(edgentConsole.getStream());
+    json.beginObject()
+          .member("name", systemGetDeviceName())
+          .member("board", BLYNK_TEMPLATE_NAME)
+          .member("tmpl_id", BLYNK_TEMPLATE_ID)
+          .member("fw_type", BLYNK_FIRMWARE_TYPE)
+          .member("fw_ver", BLYNK_FIRMWARE_VERSION)
+        .endObject();
+    edgentConsole.print("\n");
   });
 
   edgentConsole.addCommand("connect", [](int argc, const char** argv) {
@@ -56,8 +58,16 @@ void console_init()
       BlynkState::set(MODE_WAIT_CONFIG);
     } else if (0 == strcmp(argv[0], "erase")) {
       BlynkState::set(MODE_RESET_CONFIG);
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+    } else if (0 == strcmp(argv[0], "bench")) {
+      config_benchmark(edgentConsole.getStream());
+#endif
     } else {
+#if defined(CONFIG_ENCRYPTION_ENABLE)
+      edgentConsole.getStream().println(F("Available commands: start, erase, bench"));
+#else
       edgentConsole.getStream().println(F("Available commands: start, erase"));
+#endif
     }
   });
 
@@ -73,11 +83,13 @@ void console_init()
       );
     } else if (0 == strcmp(argv[0], "scan")) {
       int found = WiFi.scanNetworks();
+      const String connected = WiFi.SSID(); // Each call is an eRPC round-trip
       for (int i = 0; i < found; i++) {
-        bool current = (WiFi.SSID(i) == WiFi.SSID());
+        const String ssid = WiFi.SSID(i);
+        bool current = (ssid == connected);
         edgentConsole.printf(
             "%s %s [%s] %s ch:%d rssi:%d\n",
-            (current ? "*" : " "), WiFi.SSID(i).c_str(),
+            (current ? "*" : " "), ssid.c_str(),
             macToString(WiFi.BSSID(i)).c_str(),
             wifiSecToStr(WiFi.encryptionType(i)),
             WiFi.channel(i), WiFi.RSSI(i)
@@ -116,16 +128,54 @@ void console_init()
       } else if (cmd == "off") {
         _blynkWifiClient.setNoDelay(false);
       }
+    } else if (tool == "writes") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        write_coalesce_clear_stats();
+      } else {
+        write_coalesce_print(edgentConsole.getStream());
+      }
+#if defined(LOOP_PROFILER_ENABLE)
+    } else if (tool == "perf") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        profiler_clear();
+      } else if (cmd == "send") {
+        profiler_send();
+      } else {
+        profiler_print(edgentConsole.getStream());
+      }
+#endif
+    } else if (tool == "remote") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        remote_console_clear();
+      } else {
+        remote_console_print(edgentConsole.getStream());
+      }
+    } else if (tool == "states") {
+      const String cmd = param[1].asStr();
+      if (cmd == "clear") {
+        state_trace_clear();
+      } else {
+        state_trace_print(edgentConsole.getStream());
+      }
     } else if (tool == "drop_stats") {
       systemStats.clear();
     } else {
-      edgentConsole.getStream().println(F("Available commands: coredump [show|clear], partitions, powersave [show|on|off], nodelay [show|on|off], cpufreq [show|N(MHz), drop_stats]"));
+      Stream& out = edgentConsole.getStream();
+      out.print(F("Available commands: powersave [show|on|off], nodelay [show|on|off], writes [show|clear]"));
+#if defined(LOOP_PROFILER_ENABLE)
+      out.print(F(", perf [show|clear|send]"));
+#endif
+      out.println(F(", remote [show|clear], states [show|clear], drop_stats"));
     }
   });
 
 }
 
 BLYNK_WRITE(InternalPinDBG) {
+  remote_console_begin();
   String cmd = String(param.asStr()) + "\n";
   edgentConsole.runCommand((char*)cmd.c_str());
 }
@@ -26,7 +26,7 @@ BLYNK_WRITE(InternalPinOTA) {
     // Disconnect, not to interfere with OTA process
     Blynk.disconnect();
 
-    BlynkState::set(MODE_OTA_UPGRADE);
+    BlynkState::set(MODE_OTA_UPGRADE, REASON_OTA);
   });
 }
 
@@ -66,8 +66,6 @@ bool parseURL(String url, String& protocol, String& host, int& port, String& uri
 }
 
 void enterOTA() {
-  BlynkState::set(MODE_OTA_UPGRADE);
-
   // Disconnect, not to interfere with OTA process
   Blynk.disconnect();
 
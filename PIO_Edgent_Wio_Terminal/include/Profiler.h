@@ -0,0 +1,227 @@
+
+/*
+ * Cycle-count profiler of the Edgent loop.
+ *
+ * With LOOP_PROFILER_ENABLE, the main parts of the loop are timed with the
+ * CPU cycle counter: edgentTimer and console callbacks, Blynk.run() (which
+ * calls the BLYNK_WRITE handlers), the whole Edgent step and the time spent
+ * outside BlynkEdgent.run(), in loop(). Each keeps count, min, avg, max and
+ * a log2 histogram of cycles.
+ *
+ * A scope costs two cycle counter reads and a few adds, it can stay enabled.
+ * Step and loop, which include the portal, OTA and connect loops, are timed
+ * with micros() instead: the cycle counter wraps after 35 s at 120 MHz.
+ * Times are shown in us at the current CPU clock. See "sys perf", "sys perf
+ * send" writes the summary to InternalPinDBG.
+ */
+
+enum ProfilePoint : uint8_t {
+  PROF_LOOP,                    // outside BlynkEdgent.run()
+  PROF_STEP,                    // Edgent step: state machine and all below
+  PROF_TIMER,                   // edgentTimer.run()
+  PROF_CONSOLE,                 // edgentConsole.run()
+  PROF_BLYNK,                   // Blynk.run()
+
+  PROF_MAX
+};
+
+#if defined(LOOP_PROFILER_ENABLE)
+
+#define PROFILER_BUCKETS    32    // bucket N counts [2^(N-1), 2^N) cycles
+
+static const char* ProfilePointStr[PROF_MAX] = {
+  "loop",
+  "step",
+  "edgentTimer",
+  "console",
+  "Blynk.run"
+};
+
+struct ProfileStats {
+  uint32_t count;
+  uint32_t min;                 // cycles
+  uint32_t max;
+  uint64_t total;
+  uint32_t hist[PROFILER_BUCKETS];
+
+  void add(uint32_t cycles) {
+    const int bucket = cycles ? BlynkMin(PROFILER_BUCKETS - 1, 32 - __builtin_clz(cycles)) : 0;
+    hist[bucket]++;
+    if (!count || cycles < min) {
+      min = cycles;
+    }
+    if (cycles > max) {
+      max = cycles;
+    }
+    total += cycles;
+    count++;
+  }
+};
+
+static ProfileStats profileStats[PROF_MAX];
+static uint32_t     profileRunEnd = 0;      // micros() when run() returned
+
+static inline
+uint32_t profiler_cycles()
+{
+  return DWT->CYCCNT;
+}
+
+static inline
+uint32_t profiler_mhz()
+{
+  return SystemCoreClock / 1000000;
+}
+
+// The DWT cycle counter is off after reset
+static
+void profiler_init()
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Cycles, or us for the points that can last for seconds
+static inline
+bool profiler_in_us(int point)
+{
+  return point == PROF_LOOP || point == PROF_STEP;
+}
+
+static inline
+uint32_t profiler_now(ProfilePoint point)
+{
+  return profiler_in_us(point) ? micros() : profiler_cycles();
+}
+
+class ProfileScope {
+public:
+  explicit ProfileScope(ProfilePoint point)
+    : point(point)
+    , started(profiler_now(point))
+  {}
+
+  ~ProfileScope() {
+    profileStats[point].add(profiler_now(point) - started);
+  }
+
+private:
+  const ProfilePoint point;
+  const uint32_t     started;
+};
+
+// Around BlynkEdgent.run(), the time in between is spent in loop()
+static inline
+void profiler_run_begin()
+{
+  if (profileRunEnd) {
+    profileStats[PROF_LOOP].add(profiler_now(PROF_LOOP) - profileRunEnd);
+  }
+}
+
+static inline
+void profiler_run_end()
+{
+  profileRunEnd = profiler_now(PROF_LOOP) | 1;
+}
+
+static
+void profiler_clear()
+{
+  memset(profileStats, 0, sizeof(profileStats));
+  profileRunEnd = 0;
+}
+
+static
+uint32_t profiler_us(int point, uint64_t value)
+{
+  return profiler_in_us(point) ? value : value / profiler_mhz();
+}
+
+// Cycles added by one scope
+static
+uint32_t profiler_overhead()
+{
+  ProfileStats scratch = {};
+  const uint32_t t = profiler_cycles();
+  for (int i = 0; i < 100; i++) {
+    const uint32_t started = profiler_cycles();
+    scratch.add(profiler_cycles() - started);
+  }
+  return (profiler_cycles() - t) / 100;
+}
+
+static
+void profiler_print(Stream& out)
+{
+  out.println(String("CPU ") + profiler_mhz() + " MHz, " + profiler_overhead() + " cycles per scope");
+  out.println(F("Point           count      min      avg      max (us)"));
+  for (int p = 0; p < PROF_MAX; p++) {
+    const ProfileStats& s = profileStats[p];
+    if (!s.count) {
+      continue;
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "%-12s %8lu %8lu %8lu %8lu",
+             ProfilePointStr[p], (unsigned long)s.count,
+             (unsigned long)profiler_us(p, s.min),
+             (unsigned long)profiler_us(p, s.total / s.count),
+             (unsigned long)profiler_us(p, s.max));
+    out.println(line);
+  }
+  out.println(F("log2(cycles), step and loop log2(us): calls"));
+  for (int p = 0; p < PROF_MAX; p++) {
+    const ProfileStats& s = profileStats[p];
+    if (!s.count) {
+      continue;
+    }
+    String line = String(" ") + ProfilePointStr[p] + ":";
+    for (int b = 0; b < PROFILER_BUCKETS; b++) {
+      if (s.hist[b]) {
+        line += String(" ") + b + ":" + s.hist[b];
+      }
+    }
+    out.println(line);
+  }
+}
+
+// One line per point: name count min/avg/max us
+static
+void profiler_send()
+{
+  String msg;
+  for (int p = 0; p < PROF_MAX; p++) {
+    const ProfileStats& s = profileStats[p];
+    if (!s.count) {
+      continue;
+    }
+    msg += String(ProfilePointStr[p]) + " " + s.count + " " +
+           profiler_us(p, s.min) + "/" + profiler_us(p, s.total / s.count) + "/" + profiler_us(p, s.max) + " us\n";
+  }
+  Blynk.virtualWrite(InternalPinDBG, msg);
+}
+
+#else
+
+static
+void profiler_init()
+{
+}
+
+class ProfileScope {
+public:
+  explicit ProfileScope(ProfilePoint) {}
+};
+
+static inline
+void profiler_run_begin()
+{
+}
+
+static inline
+void profiler_run_end()
+{
+}
+
+#endif
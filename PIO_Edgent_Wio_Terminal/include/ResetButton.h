@@ -6,7 +6,7 @@ volatile uint32_t g_buttonPressTime = -1;
 
 void button_action(void)
 {
-  BlynkState::set(MODE_RESET_CONFIG);
+  BlynkState::set(MODE_RESET_CONFIG, REASON_BUTTON);
 }
 
 void button_change(void)
@@ -0,0 +1,173 @@
+
+/*
+ * WiFi scan cache for the provisioning portal.
+ *
+ * Networks are rescanned in the background while waiting for configuration
+ * (no phone is connected to the AP yet, so channel hopping disturbs nobody).
+ * /wifi_scan.json answers from the cache, ?refresh=1 requests a new scan.
+ *
+ * The first scan is done before the AP is started. If the RTL8720 rejects
+ * a scan while the AP is up, that result is simply kept.
+ */
+
+#define SCAN_CACHE_INTERVAL     30000
+#define SCAN_CACHE_RETRY        5000
+#define SCAN_CACHE_MAX_NETS     15
+
+struct ScanRecord {
+  char              ssid[33];
+  uint8_t           bssid[6];
+  int8_t            rssi;
+  uint8_t           channel;
+  wifi_auth_mode_t  sec;
+};
+
+struct ScanCache {
+  ScanRecord        nets[SCAN_CACHE_MAX_NETS];
+  int               count;
+  uint32_t          updated;    // millis() of the last completed scan
+  uint32_t          started;
+  bool              valid;
+  bool              running;
+  volatile bool     requested;
+};
+
+static ScanCache scanCache;
+
+static
+void scan_cache_start()
+{
+  if (scanCache.running) {
+    return;
+  }
+  DEBUG_PRINT("Scanning networks...");
+  scanCache.started = millis();
+  scanCache.requested = false;
+  scanCache.running = (WiFi.scanNetworks(true, true) == WIFI_SCAN_RUNNING);
+}
+
+// Keeps the strongest networks of a completed scan.
+// Each WiFi.xxx(i) accessor is an eRPC round-trip to the RTL8720, so every
+// record is fetched at most once and the top list is sorted locally
+static
+void scan_cache_collect(int wifi_nets)
+{
+  DEBUG_PRINT(String("Found networks: ") + wifi_nets);
+  const uint32_t t = micros();
+
+  int count = 0;
+  for (int id = 0; id < wifi_nets; id++) {
+    const int8_t rssi = WiFi.RSSI(id);
+    if (count == SCAN_CACHE_MAX_NETS && rssi <= scanCache.nets[count-1].rssi) {
+      continue; // Weaker than all of the top 15 networks
+    }
+
+    // Insert, keeping the list sorted by RSSI
+    int pos = BlynkMin(count, SCAN_CACHE_MAX_NETS-1);
+    while (pos > 0 && scanCache.nets[pos-1].rssi < rssi) {
+      scanCache.nets[pos] = scanCache.nets[pos-1];
+      pos--;
+    }
+
+    ScanRecord& rec = scanCache.nets[pos];
+    CopyString(WiFi.SSID(id), rec.ssid);
+    memcpy(rec.bssid, WiFi.BSSID(id), sizeof(rec.bssid));
+    rec.rssi    = rssi;
+    rec.channel = WiFi.channel(id);
+    rec.sec     = WiFi.encryptionType(id);
+
+    if (count < SCAN_CACHE_MAX_NETS) {
+      count++;
+    }
+  }
+  scanCache.count = count;
+  scanCache.updated = millis();
+  scanCache.valid = true;
+
+  DEBUG_PRINT(String("Scan results fetched in ") + (micros() - t) + " us");
+}
+
+// Picks up a completed scan. A failed scan keeps the previous result
+static
+bool scan_cache_poll()
+{
+  if (!scanCache.running) {
+    return false;
+  }
+  const int wifi_nets = WiFi.scanComplete();
+  if (wifi_nets == WIFI_SCAN_RUNNING) {
+    return false;
+  }
+  scanCache.running = false;
+  if (wifi_nets < 0) {
+    DEBUG_PRINT("Scan failed");
+    return false;
+  }
+  scan_cache_collect(wifi_nets);
+  DEBUG_PRINT(String("Scan done in ") + (scanCache.updated - scanCache.started) + " ms");
+  return true;
+}
+
+static
+bool scan_cache_wait(uint32_t timeout)
+{
+  scan_cache_start();
+  const uint32_t t = millis();
+  while (scanCache.running && millis() - t < timeout) {
+    delay(20);
+    scan_cache_poll();
+  }
+  return scanCache.valid;
+}
+
+static
+void scan_cache_run()
+{
+  scan_cache_poll();
+  if (scanCache.running) {
+    return;
+  }
+  const uint32_t interval = scanCache.valid ? SCAN_CACHE_INTERVAL : SCAN_CACHE_RETRY;
+  if (scanCache.requested ||
+      (BlynkState::is(MODE_WAIT_CONFIG) && millis() - scanCache.started >= interval))
+  {
+    scan_cache_start();
+  }
+}
+
+static
+void scan_cache_end()
+{
+  if (scanCache.running) {
+    WiFi.scanDelete();
+    scanCache.running = false;
+  }
+}
+
+// Result age in seconds (for the Age header)
+static
+String scan_cache_age()
+{
+  return String((millis() - scanCache.updated) / 1000);
+}
+
+static
+void scan_cache_write(JsonWriter& json)
+{
+  json.beginArray();
+  for (int i = 0; i < scanCache.count; i++) {
+    const ScanRecord& rec = scanCache.nets[i];
+    char bssid[18];
+    snprintf(bssid, sizeof(bssid), "%02X:%02X:%02X:%02X:%02X:%02X",
+             rec.bssid[0], rec.bssid[1], rec.bssid[2], rec.bssid[3], rec.bssid[4], rec.bssid[5]);
+
+    json.beginObject()
+          .member("ssid", rec.ssid)
+          .member("bssid", bssid)
+          .member("rssi", (int)rec.rssi)
+          .member("sec", wifiSecToStr(rec.sec))
+          .member("ch", (int)rec.channel)
+        .endObject();
+  }
+  json.endArray();
+}
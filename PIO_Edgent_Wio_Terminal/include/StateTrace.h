@@ -0,0 +1,194 @@
+
+/*
+ * State transition trace and time-in-state counters.
+ *
+ * Every BlynkState change is recorded in a small ring (boot, time, from, to,
+ * reason), and the time spent in each state is added up, with a histogram
+ * of how long each visit lasted. Both live in no-init RAM, so they survive
+ * soft resets and crashes. See "sys states".
+ *
+ * With STATE_TRACE_REPORT_VPIN, the counters are also sent to that virtual
+ * pin on each cloud connect, as a StateTraceReport (little-endian, packed).
+ */
+
+#define STATE_TRACE_SIZE      32
+#define STATE_TRACE_BUCKETS   6     // visits of < 1s, 10s, 1m, 10m, 1h, and longer
+#define STATE_TRACE_MAGIC     (0x7c41e90d + sizeof(StateTrace))
+
+struct StateTraceEntry {
+  uint32_t time;                    // uptime, ms
+  uint16_t boot;                    // resetCount.total, low bits
+  uint8_t  from;
+  uint8_t  to    : 4;
+  uint8_t  reason: 4;
+};
+
+struct StateTrace {
+  uint32_t magic;
+  uint32_t head;                    // number of entries ever added
+  uint32_t rejected;                // transitions refused by BlynkState::set()
+  StateTraceEntry entries[STATE_TRACE_SIZE];
+
+  uint64_t timeIn[MODE_MAX_VALUE];  // ms
+  uint32_t visits[MODE_MAX_VALUE];
+  uint32_t hist[MODE_MAX_VALUE][STATE_TRACE_BUCKETS];
+};
+
+BLYNK_NOINIT_ATTR
+static StateTrace stateTrace;
+
+static uint64_t stateTraceSince = 0;      // when the current state was entered
+
+// BlynkState::set() may be called from the button ISR
+#define STATE_TRACE_LOCK()      uint32_t primask = __get_PRIMASK(); __disable_irq()
+#define STATE_TRACE_UNLOCK()    __set_PRIMASK(primask)
+
+static const uint32_t StateTraceLimits[STATE_TRACE_BUCKETS-1] = {
+  1000, 10000, 60000, 600000, 3600000
+};
+
+static
+void state_trace_init()
+{
+  if (stateTrace.magic != STATE_TRACE_MAGIC) {
+    memset(&stateTrace, 0, sizeof(stateTrace));
+    stateTrace.magic = STATE_TRACE_MAGIC;
+  }
+}
+
+static
+void state_trace_add(State from, State to, StateReason reason)
+{
+  const uint64_t now = systemUptime();
+
+  STATE_TRACE_LOCK();
+  if (from < MODE_MAX_VALUE) {
+    const uint64_t spent = now - stateTraceSince;
+    int bucket = 0;
+    while (bucket < STATE_TRACE_BUCKETS-1 && spent >= StateTraceLimits[bucket]) {
+      bucket++;
+    }
+    stateTrace.timeIn[from] += spent;
+    stateTrace.hist[from][bucket]++;
+  }
+  stateTrace.visits[to]++;
+  stateTraceSince = now;
+
+  StateTraceEntry& e = stateTrace.entries[stateTrace.head % STATE_TRACE_SIZE];
+  e.time   = now;
+  e.boot   = systemStats.resetCount.total;
+  e.from   = from;
+  e.to     = to;
+  e.reason = reason;
+  stateTrace.head++;
+  STATE_TRACE_UNLOCK();
+}
+
+// Called by BlynkState::set() for a change of state. Records the transition
+// if StateTransitions allows it, else counts it as rejected and returns false
+static
+bool state_trace_transition(State from, State to, StateReason reason)
+{
+  if (!state_transition_allowed(from, to)) {
+    DEBUG_PRINT(String("Rejected ") + StateStr[from] + " => " + StateStr[to]);
+    STATE_TRACE_LOCK();
+    stateTrace.rejected++;
+    STATE_TRACE_UNLOCK();
+    return false;
+  }
+  DEBUG_PRINT(String(StateStr[from]) + " => " + StateStr[to]);
+  state_trace_add(from, to, reason);
+  return true;
+}
+
+// Time spent in a state so far, including the current visit
+static
+uint64_t state_trace_time_in(State m)
+{
+  STATE_TRACE_LOCK();
+  uint64_t result = stateTrace.timeIn[m];
+  if (BlynkState::is(m)) {
+    result += systemUptime() - stateTraceSince;
+  }
+  STATE_TRACE_UNLOCK();
+  return result;
+}
+
+static
+void state_trace_clear()
+{
+  STATE_TRACE_LOCK();
+  stateTrace.magic = 0;
+  state_trace_init();
+  stateTraceSince = systemUptime();
+  STATE_TRACE_UNLOCK();
+}
+
+static
+void state_trace_print(Stream& out)
+{
+  out.println(F("State             visits       time  <1s <10s  <1m <10m  <1h >=1h"));
+  for (int m = 0; m < MODE_MAX_VALUE; m++) {
+    char line[96];
+    int n = snprintf(line, sizeof(line), "%-16s %7lu %9lus",
+                     StateStr[m], (unsigned long)stateTrace.visits[m],
+                     (unsigned long)(state_trace_time_in((State)m) / 1000));
+    for (int b = 0; b < STATE_TRACE_BUCKETS; b++) {
+      n += snprintf(line + n, sizeof(line) - n, " %4lu", (unsigned long)stateTrace.hist[m][b]);
+    }
+    out.println(line);
+  }
+
+  out.println(String("Rejected transitions: ") + stateTrace.rejected);
+
+  const uint32_t count = BlynkMin(stateTrace.head, (uint32_t)STATE_TRACE_SIZE);
+  out.println(String("Last ") + count + " transitions (boot, uptime):");
+  for (uint32_t i = stateTrace.head - count; i != stateTrace.head; i++) {
+    const StateTraceEntry e = stateTrace.entries[i % STATE_TRACE_SIZE];
+    char line[96];
+    int n = snprintf(line, sizeof(line), " %5u %9lu.%03lu %s => %s",
+                     e.boot, (unsigned long)(e.time / 1000), (unsigned long)(e.time % 1000),
+                     StateStr[BlynkMin(e.from, (uint8_t)MODE_MAX_VALUE)],
+                     StateStr[BlynkMin((uint8_t)e.to, (uint8_t)MODE_MAX_VALUE)]);
+    if (e.reason) {
+      snprintf(line + n, sizeof(line) - n, " (%s)",
+               StateReasonStr[BlynkMin((uint8_t)e.reason, (uint8_t)REASON_MAX_VALUE)]);
+    }
+    out.println(line);
+  }
+}
+
+#if defined(STATE_TRACE_REPORT_VPIN)
+
+struct StateTraceReport {
+  uint8_t  version;                 // 1
+  uint8_t  states;                  // MODE_MAX_VALUE
+  uint16_t boots;                   // resetCount.total
+  struct {
+    uint32_t seconds;
+    uint16_t visits;
+  } __attribute__((packed)) state[MODE_MAX_VALUE];
+} __attribute__((packed));
+
+static
+void state_trace_report()
+{
+  StateTraceReport report;
+  report.version = 1;
+  report.states  = MODE_MAX_VALUE;
+  report.boots   = systemStats.resetCount.total;
+  for (int m = 0; m < MODE_MAX_VALUE; m++) {
+    report.state[m].seconds = state_trace_time_in((State)m) / 1000;
+    report.state[m].visits  = BlynkMin(stateTrace.visits[m], (uint32_t)0xFFFF);
+  }
+  Blynk.virtualWriteBinary(STATE_TRACE_REPORT_VPIN, &report, sizeof(report));
+}
+
+#else
+
+static
+void state_trace_report()
+{
+}
+
+#endif